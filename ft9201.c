@@ -1,9 +1,24 @@
 #include <linux/module.h>
 #include <linux/printk.h>
 #include <linux/usb.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/kfifo.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/pm_runtime.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
 
 #include "ft9201.h"
 
+#define CREATE_TRACE_POINTS
+#include "ft9201_trace.h"
+
 MODULE_AUTHOR("Ben Maddocks <bm16ton@gmail.com>");
 MODULE_LICENSE("GPL v2");
 MODULE_DESCRIPTION("FT9201 Fingeprint reader driver");
@@ -23,6 +38,238 @@ MODULE_DEVICE_TABLE(usb, ft9201_table);
 
 #define USB_CONTROL_OP_TIMEOUT 1000
 #define USB_READ_OP_TIMEOUT 1000
+#define USB_ARM_OP_TIMEOUT (FT9201_ARM_STEPS * USB_CONTROL_OP_TIMEOUT)	/* whole arm sequence */
+
+#define FT9201_IMG_WIDTH	0x50
+#define FT9201_IMG_HEIGHT	0x40
+#define FT9201_IMG_SIZE		(FT9201_IMG_WIDTH * FT9201_IMG_HEIGHT)
+
+/* frame gate scoring granularity */
+#define FT9201_BLOCK		8
+#define FT9201_BLOCKS_X		(FT9201_IMG_WIDTH / FT9201_BLOCK)
+#define FT9201_BLOCKS		(FT9201_BLOCKS_X * (FT9201_IMG_HEIGHT / FT9201_BLOCK))
+
+/* bulk-in URBs kept queued on the endpoint, each filling one or, in bursts, several ring slots */
+#define FT9201_IN_URBS		4
+
+/* longest burst, bursts in flight never take more than half the ring */
+#define FT9201_BURST_MAX	8
+
+/* control transfers that arm the sensor for a capture */
+#define FT9201_ARM_STEPS	3
+
+static unsigned int ring_slots = 16;
+module_param(ring_slots, uint, 0444);
+MODULE_PARM_DESC(ring_slots, "Frames kept in the mmap()able capture ring (power of two, up to 64)");
+
+static unsigned int burst_frames = 1;
+module_param(burst_frames, uint, 0444);
+MODULE_PARM_DESC(burst_frames, "Frames the sensor sends per bulk-in transfer (1 .. 8, and no more than ring_slots / 8)");
+
+static unsigned int poll_min_us = 2000;
+module_param(poll_min_us, uint, 0644);
+MODULE_PARM_DESC(poll_min_us, "Finger-detect poll interval right after arming the sensor (us)");
+
+static unsigned int poll_max_us = 50000;
+module_param(poll_max_us, uint, 0644);
+MODULE_PARM_DESC(poll_max_us, "Finger-detect poll interval ceiling while no finger is present (us)");
+
+/*
+ * Frame gate. Every full frame is scored when its transfer completes;
+ * frames that look empty or repeat the previous one are kept out of
+ * read()/GET_FRAME and the capture keeps going instead of waking readers.
+ */
+static unsigned int gate_min_variance;
+module_param(gate_min_variance, uint, 0644);
+MODULE_PARM_DESC(gate_min_variance, "Drop frames whose pixel variance is below this (0 disables)");
+
+static unsigned int gate_min_coverage;
+module_param(gate_min_coverage, uint, 0644);
+MODULE_PARM_DESC(gate_min_coverage, "Drop frames with fewer per mille of 8x8 blocks showing ridges (0 disables)");
+
+static unsigned int gate_block_variance = 100;
+module_param(gate_block_variance, uint, 0644);
+MODULE_PARM_DESC(gate_block_variance, "Pixel variance above which an 8x8 block counts toward coverage");
+
+static bool gate_duplicates;
+module_param(gate_duplicates, bool, 0644);
+MODULE_PARM_DESC(gate_duplicates, "Drop frames whose block hash matches the previous frame");
+
+static unsigned int gate_hash_shift = 4;
+module_param(gate_hash_shift, uint, 0644);
+MODULE_PARM_DESC(gate_hash_shift, "Low bits of each block mean left out of the hash, so sensor noise does not change it");
+
+static int autosuspend_ms = 2000;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time before the sensor is runtime suspended (ms, -1 leaves autosuspend off)");
+
+static bool prearm = true;
+module_param(prearm, bool, 0644);
+MODULE_PARM_DESC(prearm, "Arm the sensor on resume so the first capture after idle skips it");
+
+static unsigned int detect_timeout_ms;
+module_param(detect_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(detect_timeout_ms, "Give up on a capture when no finger shows up for this long (ms, 0 waits for ever)");
+
+static unsigned int auto_power_grace_ms = 5000;
+module_param(auto_power_grace_ms, uint, 0644);
+MODULE_PARM_DESC(auto_power_grace_ms, "With auto power, poll for the finger when the sensor has pushed no frame for this long (ms, 0 never polls)");
+
+static bool stream_arm_once;
+module_param(stream_arm_once, bool, 0644);
+MODULE_PARM_DESC(stream_arm_once, "Send the arm sequence once per streaming session rather than before every frame");
+
+/* longest wait between two recovery attempts */
+#define FT9201_RECOVER_BACKOFF_MAX_MS	1000
+
+static bool recover = true;
+module_param(recover, bool, 0644);
+MODULE_PARM_DESC(recover, "Recover from transfer errors in the driver, resetting the device if need be");
+
+static unsigned int recover_retries = 3;
+module_param(recover_retries, uint, 0644);
+MODULE_PARM_DESC(recover_retries, "Endpoint halt clears tried before resetting the device (0 resets straight away)");
+
+static unsigned int recover_backoff_ms = 20;
+module_param(recover_backoff_ms, uint, 0644);
+MODULE_PARM_DESC(recover_backoff_ms, "Wait before the second recovery attempt, doubling for every one after it (ms)");
+
+enum ft9201_capture_state {
+	FT9201_CAPTURE_IDLE,
+	FT9201_CAPTURE_PREARM,		/* arming after resume, ahead of any capture */
+	FT9201_CAPTURE_ARM,		/* sending the arm sequence */
+	FT9201_CAPTURE_DETECT,		/* polling the sensor for a finger */
+	FT9201_CAPTURE_FRAME,		/* finger seen, waiting on the bulk-in ring */
+};
+
+/* bucket n counts values in [2^(n-1), 2^n), the last one everything above */
+#define FT9201_HIST_BUCKETS	24
+
+struct ft9201_hist {
+	u64 count[FT9201_HIST_BUCKETS];
+};
+
+struct ft9201_capture_stats {
+	u64 captures;			/* frames delivered to a capture */
+	u64 errors;			/* captures that ended in an error */
+	u64 detect_polls;		/* register reads while waiting for a finger */
+	u64 arm_to_detect_ns;		/* cumulative arm -> finger seen */
+	u64 detect_to_frame_ns;		/* cumulative finger seen -> frame complete */
+	u64 last_detect_to_frame_ns;
+	u64 ctrl_errors;		/* arm or finger-detect control messages that failed */
+	u64 timeouts;			/* control messages or frames that timed out */
+	unsigned int capture_polls;	/* detect polls of the capture in progress */
+	struct ft9201_hist arm_to_detect_us;
+	struct ft9201_hist detect_to_frame_us;
+	struct ft9201_hist polls_per_capture;
+	u64 suspends;
+	u64 resumes;
+	u64 resume_ns;			/* cumulative time spent in the resume callback */
+	u64 resume_to_armed_ns;		/* cumulative resume -> sensor pre-armed */
+	u64 prearm_hits;		/* captures that found the sensor already armed */
+	u64 auto_rearms;		/* auto power arm sequences after a frame */
+	u64 auto_power_fallbacks;	/* auto power captures that went back to polling */
+	u64 auto_power_polled;		/* ... and found the finger by polling, no frame was pushed */
+	struct ft9201_hist resume_to_armed_us;
+	u64 recoveries;			/* errors recovered from, device usable again */
+	u64 recover_failures;		/* recoveries that gave up */
+	u64 recover_resets;		/* recoveries that reset the device */
+	u64 recover_ns;			/* cumulative error -> usable again */
+	u64 last_recover_ns;
+	struct ft9201_hist recover_us;
+
+	/* bulk-in ring and streaming queues, protected by ring_lock rather than capture_lock */
+	u64 stream_frames;		/* frames queued for read(), once per reader */
+	u64 dropped_oldest;		/* queued frames pushed out by newer ones */
+	u64 dropped_newest;		/* new frames refused by a full queue */
+	u64 short_frames;		/* transfers shorter than a frame, not queued */
+	u64 bulk_transfers;		/* completed bulk-in transfers */
+	u64 bulk_frames;		/* frames they carried, more than one each in bursts */
+	u64 bulk_errors;		/* bulk-in transfers that failed, unlinks excluded */
+	u64 gated_empty;		/* frames the gate found empty */
+	u64 gated_duplicate;		/* frames the gate found repeated */
+	struct ft9201_hist bulk_us;	/* submit -> completion */
+};
+
+/* vendor registers are 8 bit wide and addressed by an 8 bit index */
+#define FT9201_NR_REGS		256
+
+struct ft9201_reg_stats {
+	u64 hits;			/* reads served from the cache */
+	u64 misses;			/* reads that went to the device, volatile ones included */
+	u64 writes;			/* writes that went to the device */
+	u64 writes_elided;		/* writes of the value the cache already held */
+	u64 writes_batched;		/* writes deferred to ft9201_reg_batch_end() */
+	u64 errors;
+};
+
+struct ft9201_device;
+
+struct ft9201_in_urb {
+	struct ft9201_device	*dev;
+	struct urb		*urb;
+	unsigned int		slot;		/* first ring slot the transfer lands in */
+	unsigned int		nr_slots;	/* consecutive slots bound, one per frame */
+	bool			active;		/* submitted, or being resubmitted from completion */
+	ktime_t			submit_time;
+};
+
+/*
+ * A prebuilt control transfer: one step of the arm sequence, whose
+ * completions submit the next step, or the finger-detect register read.
+ * The urbs, setup packets and buffers are allocated at probe.
+ */
+struct ft9201_ctrl_urb {
+	struct ft9201_device	*dev;
+	struct urb		*urb;
+	struct usb_ctrlrequest	*setup;
+	unsigned char		*data;			/* IN data stage, NULL for the arm steps */
+	unsigned int		step;
+	ktime_t			submit_time;
+};
+
+/* kernel copy of a published descriptor, the mmap()ed one is never read back */
+struct ft9201_frame {
+	u32			seq;
+	unsigned int		slot;
+	u32			len;
+	u32			detect_polls;		/* of the capture in progress when it landed */
+	u64			timestamp_ns;
+	u64			transfer_ns;
+
+	u32			flags;			/* FT9201_FRAME_* */
+	u32			mean;
+	u32			variance;
+	u32			coverage;		/* per mille */
+	u32			hash;
+};
+
+/*
+ * Per open file read cursor. A capture is shared by every reader waiting
+ * on it and each streamed frame is queued to every streaming reader, so
+ * readers pin ring slots instead of owning a buffer.
+ */
+struct ft9201_reader {
+	struct ft9201_device	*dev;
+	struct list_head	node;			/* on dev->readers, under ring_lock */
+	struct mutex		lock;			/* serializes read()/poll()/ioctl on this file */
+
+	int			read_slot;		/* slot pinned by this reader, -1 if none */
+	struct ft9201_frame	read_frame;		/* descriptor of the frame in read_slot */
+	unsigned char		*read_img_data;		/* points into read_slot */
+	size_t			img_in_filled;		/* number of bytes in the frame */
+	size_t			img_in_copied;		/* already copied to user space */
+	bool			timetoexit;
+	bool			read_waiting;		/* read()/poll() started a capture */
+	u32			read_gen;		/* capture generation read() waits for */
+
+	bool			auto_power;		/* holds an auto power reference */
+	bool			streaming;		/* queue every frame, under ring_lock */
+	unsigned int		stream_overflow;	/* FT9201_STREAM_DROP_* */
+	u32			stream_err_gen;		/* last dev->stream_err_gen seen */
+	DECLARE_KFIFO_PTR(queue, struct ft9201_frame);	/* each entry pins its slot */
+	struct ft9201_reader_stats stats;		/* under ring_lock */
+};
 
 struct ft9201_device {
 	struct usb_device *udev;
@@ -36,25 +283,113 @@ struct ft9201_device {
 	unsigned long		disconnected:1;
 	wait_queue_head_t	bulk_in_wait;		/* to wait for an ongoing read */
 
+	seqlock_t		status_lock;		/* device_status, readers never wait on I/O */
 	struct ft9201_status device_status;
 
 	bool            ongoing_read;           /* a read is going on */
-	unsigned char   *read_img_data;
+	struct ft9201_in_urb	in_urbs[FT9201_IN_URBS];
+	spinlock_t		ring_lock;		/* protects the ring bookkeeping below */
+	struct ft9201_ring_ctrl	*ring_ctrl;		/* shared with userspace through mmap */
+	unsigned char		*ring_data;		/* ring_slots frames, page backed */
+	size_t			ring_data_size;
+	unsigned int		ring_slots;
+	unsigned int		burst;			/* frames per bulk-in transfer */
+	unsigned int		ring_next;		/* next slot to hand to a bulk-in urb */
+	u32			ring_seq;		/* last published sequence number */
+	u32			gate_last_hash;		/* hash of the last frame the gate let through */
+	struct ft9201_frame	frames[FT9201_RING_MAX_SLOTS];	/* indexed by seq % ring_slots */
+	u32			slot_seq[FT9201_RING_MAX_SLOTS];
+	unsigned int		slot_users[FT9201_RING_MAX_SLOTS];	/* readers pinning a slot */
+	DECLARE_BITMAP(slot_bound, FT9201_RING_MAX_SLOTS);	/* slots owned by a bulk-in urb */
+	unsigned int		slots_pinned;		/* slots with slot_users != 0 */
+	struct list_head	readers;		/* open files, under ring_lock */
+	unsigned int		streamers;		/* readers with streaming enabled */
 	size_t			img_in_size;		/* the size of the receive buffer */
-	size_t			img_in_filled;		/* number of bytes in the buffer */
-	size_t			img_in_copied;		/* already copied to user space */
-	bool			timetoexit;
 
+	struct workqueue_struct	*capture_wq;		/* this device's own, never shared */
+	struct delayed_work	capture_work;		/* arm / finger-detect state machine */
+	spinlock_t		capture_lock;		/* protects the capture_* state and stats */
+	enum ft9201_capture_state capture_state;
+	int			capture_err;		/* result of the last capture */
+	u32			capture_seq;		/* frame that ended the last capture */
+	u32			capture_done_gen;	/* bumped every time a capture ends */
+	int			stream_err;		/* last capture error while streaming */
+	u32			stream_err_gen;		/* bumped with stream_err, readers compare */
+	bool			pm_held;		/* a non-IDLE state holds an autopm reference */
+	bool			sensor_armed;		/* pre-armed, the next ARM can skip the sequence */
+	bool			stream_armed;		/* armed earlier in this streaming session */
+	unsigned int		arm_once_users;		/* multi-captures that skip re-arming */
+	unsigned int		auto_power_users;	/* files with auto power on */
+	bool			auto_rearm;		/* the PREARM in progress is auto power's */
+	bool			auto_power_polling;	/* no frame pushed within auto_power_grace_ms */
+	bool			arm_pending;		/* arm urbs in flight, the work is their timeout */
+	bool			detect_pending;		/* detect urb in flight */
+	struct ft9201_ctrl_urb	arm_urbs[FT9201_ARM_STEPS];
+	struct ft9201_ctrl_urb	detect_urb;
+	struct usb_anchor	ctrl_anchor;		/* arm and detect urbs, killed by capture_stop */
+	struct usb_anchor	in_anchor;		/* bulk-in urbs */
+	bool			recovering;		/* recover_work is getting the device going again */
+	bool			capture_deferred;	/* a capture held back until recovery is done */
+	bool			capture_recovered;	/* this capture was held back once already */
+	bool			recover_reinit;		/* reset from outside, only set the device up again */
+	bool			recover_pm;		/* recovery holds an autopm reference */
+	unsigned int		recover_attempt;
+	ktime_t			recover_start;
+	struct delayed_work	recover_work;		/* on capture_wq */
+	atomic_t		capture_waiters;	/* sleeping on the capture in progress */
+	ktime_t			resume_time;
+	unsigned int		poll_interval_us;	/* current finger-detect backoff */
+	seqcount_spinlock_t	health_seq;		/* writers hold capture_lock */
+	struct ft9201_health	health;			/* published capture state and stats */
+	u32			health_done_gen;	/* capture_done_gen as of the last publish */
+	ktime_t			start_time;		/* capture left IDLE */
+	ktime_t			arm_time;
+	ktime_t			detect_time;
+	struct ft9201_capture_stats stats;
+
+	struct mutex		reg_lock;		/* register cache and its stats */
+	u8			reg_cache[FT9201_NR_REGS];
+	DECLARE_BITMAP(reg_valid, FT9201_NR_REGS);	/* reg_cache holds the device's value */
+	DECLARE_BITMAP(reg_dirty, FT9201_NR_REGS);	/* written to the cache, not yet the device */
+	unsigned int		reg_batch;		/* nesting of ft9201_reg_batch_begin() */
+	struct ft9201_reg_stats	reg_stats;
+
+	struct list_head	device_node;		/* on ft9201_devices, by minor */
+	u32			group;			/* 0, or the group it is captured with */
+
+	struct dentry		*debugfs_dir;
 };
 #define to_ft9201_dev(d) container_of(d, struct ft9201_device, kref)
 
 static int ft9201_open(struct inode *inode, struct file *file);
 static int ft9201_release(struct inode *inode, struct file *file);
 static long ft9201_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
-static ssize_t ft9201_read(struct file *fp, char __user *buf, size_t count, loff_t *f_pos);
+static ssize_t ft9201_read_iter(struct kiocb *iocb, struct iov_iter *to);
 static int ft9201_initialize(struct ft9201_device *dev);
 static int ft9201_ic_sensor_mode_exit(struct ft9201_device *dev);
-static int ft9201_read_image(struct ft9201_device *dev);
+static int ft9201_read_image(struct ft9201_reader *reader, u32 seq);
+static int ft9201_capture(struct ft9201_device *dev, u32 *seq);
+static void ft9201_capture_frame_done(struct ft9201_device *dev, u32 seq, int err);
+static void ft9201_capture_frame_gated(struct ft9201_device *dev);
+static int ft9201_mmap(struct file *file, struct vm_area_struct *vma);
+static __poll_t ft9201_poll(struct file *file, poll_table *wait);
+static int ft9201_set_streaming(struct ft9201_reader *reader, const struct ft9201_stream *cfg);
+static void ft9201_stream_stop(struct ft9201_reader *reader);
+static void ft9201_get_reader_stats(struct ft9201_reader *reader, struct ft9201_reader_stats *stats);
+static void ft9201_release_frame(struct ft9201_reader *reader);
+static void ft9201_capture_stop(struct ft9201_device *dev, int err);
+static void ft9201_capture_abandon(struct ft9201_device *dev, u32 gen, struct ft9201_reader *except);
+static void ft9201_debugfs_init(struct ft9201_device *dev);
+static int ft9201_get_frame(struct ft9201_reader *reader, struct ft9201_get_frame *req, bool nonblock);
+static int ft9201_multi_capture(struct ft9201_reader *reader, struct ft9201_multi_capture *req);
+static int ft9201_registers(struct ft9201_device *dev, struct ft9201_registers *req);
+static int ft9201_group_ioctl(struct ft9201_device *dev, struct ft9201_group_capture __user *arg);
+static void ft9201_status_read(struct ft9201_device *dev, struct ft9201_status *status);
+static void ft9201_health_read(struct ft9201_device *dev, struct ft9201_health *health);
+static void ft9201_health_publish_locked(struct ft9201_device *dev);
+static void ft9201_recover_schedule(struct ft9201_device *dev, int err);
+static int ft9201_set_auto_power(struct ft9201_reader *reader, bool enable);
+static void ft9201_auto_power_off(struct ft9201_reader *reader);
 
 static void ft9201_delete(struct kref *kref);
 
@@ -66,7 +401,10 @@ static const struct file_operations ft9201_fops = {
 		.open =    ft9201_open,
 		.release = ft9201_release,
 		.unlocked_ioctl = ft9201_ioctl,
-		.read =    ft9201_read,
+		.read_iter = ft9201_read_iter,
+		.splice_read = copy_splice_read,
+		.mmap =    ft9201_mmap,
+		.poll =    ft9201_poll,
 };
 
 /*
@@ -88,6 +426,7 @@ static struct usb_class_driver ft9201_class = {
 #define FT9201_REQ_CONFIGURE_BULK_TRANSFER_SIZE_PROBABLY 0x35
 #define FT9201_REQ_WRITE_REGISTER 0x3b
 
+#define FT9201_REG_FINGER_DETECT 0x00
 #define FT9201_REG_MCU_SENSOR_STATUS_INDEX 0x20
 
 #define FT9201_AFE_0X30_SUCCESSFUL_RESPONSE 0xbb
@@ -95,21 +434,134 @@ static struct usb_class_driver ft9201_class = {
 static long ft9201_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	long errCode;
-	struct ft9201_device *dev = file->private_data;
+	struct ft9201_reader *reader = file->private_data;
+	struct ft9201_device *dev = reader->dev;
+	struct ft9201_reader_stats reader_stats;
+	struct ft9201_stream stream;
+	struct ft9201_get_frame get_frame;
+	struct ft9201_multi_capture multi;
+	struct ft9201_registers regs;
+	struct ft9201_health health;
+	struct ft9201_status status;
+	u32 seq;
 
-	pr_info("ft9201 ioctl, cmd: %u\n", cmd);
+	/* per call, keep it off the console when many sensors are busy */
+	pr_debug("ft9201 ioctl, cmd: %u\n", cmd);
 
 	errCode = 0;
 
 	switch (cmd) {
 		case FT9201_IOCTL_REQ_INITIALIZE:
+			/* talks to the sensor, which may have autosuspended since the last capture */
+			errCode = usb_autopm_get_interface(dev->interface);
+			if (errCode < 0) {
+				return errCode;
+			}
 			errCode = ft9201_initialize(dev);
+			usb_autopm_put_interface(dev->interface);
 			if (errCode < 0) {
 				dev_err(&dev->interface->dev, "Error initializing device: %ld", errCode);
 				return errCode;
 			}
 			break;
 
+		case FT9201_IOCTL_REQ_GET_STATUS:
+			ft9201_status_read(dev, &status);
+			if (copy_to_user((void __user *)arg, &status, sizeof(status))) {
+				return -EFAULT;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_SET_AUTO_POWER:
+			errCode = ft9201_set_auto_power(reader, arg != 0);
+			if (errCode < 0) {
+				return errCode;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_GET_HEALTH:
+			ft9201_health_read(dev, &health);
+			if (copy_to_user((void __user *)arg, &health, sizeof(health))) {
+				return -EFAULT;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_CAPTURE:
+			errCode = dev->disconnected ? -ENODEV : ft9201_capture(dev, &seq);
+			if (errCode < 0) {
+				return errCode;
+			}
+			if (put_user(seq, (__u32 __user *)arg)) {
+				return -EFAULT;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_SET_STREAMING:
+			if (copy_from_user(&stream, (void __user *)arg, sizeof(stream))) {
+				return -EFAULT;
+			}
+			errCode = ft9201_set_streaming(reader, &stream);
+			if (errCode < 0) {
+				return errCode;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_GET_FRAME:
+			if (copy_from_user(&get_frame, (void __user *)arg, sizeof(get_frame))) {
+				return -EFAULT;
+			}
+			errCode = ft9201_get_frame(reader, &get_frame, file->f_flags & O_NONBLOCK);
+			/* the descriptor goes back even when the buffer was too small */
+			if (errCode == 0 || errCode == -ENOSPC) {
+				if (copy_to_user((void __user *)arg, &get_frame, sizeof(get_frame))) {
+					return -EFAULT;
+				}
+			}
+			if (errCode < 0) {
+				return errCode;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_CAPTURE_MULTI:
+			if (copy_from_user(&multi, (void __user *)arg, sizeof(multi))) {
+				return -EFAULT;
+			}
+			errCode = ft9201_multi_capture(reader, &multi);
+			if (errCode < 0) {
+				return errCode;
+			}
+			if (copy_to_user((void __user *)arg, &multi, sizeof(multi))) {
+				return -EFAULT;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_REGISTERS:
+			if (copy_from_user(&regs, (void __user *)arg, sizeof(regs))) {
+				return -EFAULT;
+			}
+			errCode = dev->disconnected ? -ENODEV : ft9201_registers(dev, &regs);
+			if (copy_to_user((void __user *)arg, &regs, sizeof(regs))) {
+				return -EFAULT;
+			}
+			if (errCode < 0) {
+				return errCode;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_GROUP_CAPTURE:
+			errCode = ft9201_group_ioctl(dev, (struct ft9201_group_capture __user *)arg);
+			if (errCode < 0) {
+				return errCode;
+			}
+			break;
+
+		case FT9201_IOCTL_REQ_READER_STATS:
+			ft9201_get_reader_stats(reader, &reader_stats);
+			if (copy_to_user((void __user *)arg, &reader_stats, sizeof(reader_stats))) {
+				return -EFAULT;
+			}
+			break;
+
 		default:
 			return -EINVAL;
 	}
@@ -121,8 +573,10 @@ static int ft9201_open(struct inode *inode, struct file *file)
 {
 	struct usb_interface *intf;
 	struct ft9201_device *dev;
+	struct ft9201_reader *reader;
+	int retval;
 	
-	pr_info("ft9201 open\n");
+	pr_debug("ft9201 open\n");
 
 	intf = usb_find_interface(&ft9201_driver, iminor(inode));
 	if (!intf) {
@@ -135,328 +589,3134 @@ static int ft9201_open(struct inode *inode, struct file *file)
 		return -ENODEV;
 	}
 
-	dev->timetoexit = false;
-	dev->img_in_copied = 0;
-	dev->img_in_filled = 0;
+	/* wake the sensor up now, resuming also pre-arms it for the first read */
+	retval = usb_autopm_get_interface(intf);
+	if (retval) {
+		return retval;
+	}
+	usb_autopm_put_interface(intf);
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader) {
+		return -ENOMEM;
+	}
+
+	reader->dev = dev;
+	reader->read_slot = -1;
+	mutex_init(&reader->lock);
 	kref_get(&dev->kref);
 
-	file->private_data = dev;
+	spin_lock_irq(&dev->ring_lock);
+	list_add_tail(&reader->node, &dev->readers);
+	spin_unlock_irq(&dev->ring_lock);
+
+	file->private_data = reader;
+	/* read_iter honours IOCB_NOWAIT, io_uring can try it inline */
+	file->f_mode |= FMODE_NOWAIT;
 
 	return 0;
 }
 
 static int ft9201_release(struct inode *inode, struct file *file)
 {
-	struct ft9201_device *dev = file->private_data;
-	pr_info("ft9201 release\n");
+	struct ft9201_reader *reader = file->private_data;
+	struct ft9201_device *dev;
+	bool last;
+	pr_debug("ft9201 release\n");
 
-	if (dev == NULL) {
+	if (reader == NULL) {
 		return -ENODEV;
 	}
+	dev = reader->dev;
+
+	mutex_lock(&reader->lock);
+	ft9201_stream_stop(reader);
+	ft9201_release_frame(reader);
+	if (reader->auto_power) {
+		ft9201_auto_power_off(reader);
+	}
+	mutex_unlock(&reader->lock);
+
+	spin_lock_irq(&dev->ring_lock);
+	list_del(&reader->node);
+	last = list_empty(&dev->readers);
+	spin_unlock_irq(&dev->ring_lock);
+
+	/* nobody is left to hand a frame to */
+	if (last) {
+		ft9201_capture_stop(dev, -ECANCELED);
+	}
 
+	kfree(reader);
 	kref_put(&dev->kref, ft9201_delete);
 
 	return 0;
 }
 
-static int ft9201_initialize(struct ft9201_device *dev)
+/*
+ * Register cache. Registers that only the driver changes are read from
+ * the device once and then served from memory; writes of an unchanged
+ * value are dropped, and writes inside a batch are held back and sent in
+ * register order when the batch ends. Volatile registers, which the
+ * sensor changes on its own, always go to the device.
+ *
+ * Registers are read with FT9201_REQ_READ_REGISTERS and written with
+ * FT9201_REQ_WRITE_REGISTER, the register in wIndex and, for writes, the
+ * value in wValue. These block, so they are for ioctl and probe paths;
+ * the capture path reads the finger-detect register with its own urb.
+ */
+static bool ft9201_reg_volatile(unsigned int reg)
 {
-	int errCode = 0;
-	unsigned char sensor_status = 1;
-
-	dev_info(&dev->interface->dev, "ioctl initialize");
-
-	if (sensor_status != 1) {
-		ft9201_ic_sensor_mode_exit(dev);
+	switch (reg) {
+	case FT9201_REG_FINGER_DETECT:
+	case FT9201_REG_MCU_SENSOR_STATUS_INDEX:
+		return true;
+	default:
+		return false;
 	}
+}
 
-	dev->device_status.sensor_height = 0x40;
-	dev->device_status.sensor_width = 0x50;
-
-	dev_info(&dev->interface->dev, "Image dimensions: %d x %d", dev->device_status.sensor_width, dev->device_status.sensor_height);
+/* Called with reg_lock held */
+static int ft9201_reg_xfer_write(struct ft9201_device *dev, unsigned int reg, u8 val)
+{
+	int retval;
 
-	if (errCode == 0) {
-		dev->device_status.initialized = 1;
-		dev_info(&dev->interface->dev, "Device initialization successful");
+	retval = usb_control_msg_send(dev->udev, 0, FT9201_REQ_WRITE_REGISTER,
+			USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			val, reg, NULL, 0, USB_CONTROL_OP_TIMEOUT, GFP_KERNEL);
+	if (retval) {
+		dev->reg_stats.errors++;
+		dev_info(&dev->interface->dev, "Error writing register 0x%02x: %d\n", reg, retval);
+		return retval;
 	}
+	dev->reg_stats.writes++;
 
-	return errCode;
+	return 0;
 }
 
-static int ft9201_read_image(struct ft9201_device *dev)
+static int ft9201_reg_read(struct ft9201_device *dev, unsigned int reg, u8 *val)
 {
-	int retVal;
-	int img_size = 64 * 80;
-	int transfer_size = img_size;
-	int read_length;
-	unsigned char *img_with_header;
+	int retval = 0;
 
-	dev->device_status.sensor_width = 0x50;
-	dev->device_status.sensor_height = 0x40;
-	dev_info(&dev->interface->dev, "Reading image from scanner; dimensions: %dx%d", dev->device_status.sensor_width, dev->device_status.sensor_height);
+	if (reg >= FT9201_NR_REGS) {
+		return -EINVAL;
+	}
 
-	dev->img_in_copied = 0;
-	dev->img_in_filled = 0;
+	mutex_lock(&dev->reg_lock);
+	if (!ft9201_reg_volatile(reg) && test_bit(reg, dev->reg_valid)) {
+		*val = dev->reg_cache[reg];
+		dev->reg_stats.hits++;
+		goto out;
+	}
 
-	if (dev->read_img_data != NULL) {
-		kfree(dev->read_img_data);
-		dev->img_in_size = 0;
+	retval = usb_control_msg_recv(dev->udev, 0, FT9201_REQ_READ_REGISTERS,
+			USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			0, reg, val, 1, USB_CONTROL_OP_TIMEOUT, GFP_KERNEL);
+	dev->reg_stats.misses++;
+	if (retval) {
+		dev->reg_stats.errors++;
+		goto out;
 	}
 
-	dev->read_img_data = kzalloc(img_size, GFP_KERNEL);
-	if (dev->read_img_data == NULL) {
-		return -ENOMEM;
+	if (!ft9201_reg_volatile(reg)) {
+		dev->reg_cache[reg] = *val;
+		__set_bit(reg, dev->reg_valid);
 	}
-	dev->img_in_size = img_size;
 
-	img_with_header = kzalloc(transfer_size, GFP_KERNEL);
-	if (img_with_header == NULL) {
-		retVal = -ENOMEM;
-		goto out;
+out:
+	mutex_unlock(&dev->reg_lock);
+	return retval;
+}
+
+static int ft9201_reg_write(struct ft9201_device *dev, unsigned int reg, u8 val)
+{
+	int retval = 0;
+
+	if (reg >= FT9201_NR_REGS) {
+		return -EINVAL;
 	}
 
-	retVal = usb_bulk_msg(
-			dev->udev,
-			usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
-			img_with_header,
-			transfer_size,
-			&read_length,
-			USB_READ_OP_TIMEOUT
-	);
-	if (retVal < 0) {
-		dev_err(&dev->interface->dev, "Error reading data from device: Error %d", retVal);
+	mutex_lock(&dev->reg_lock);
+	if (!ft9201_reg_volatile(reg) && test_bit(reg, dev->reg_valid) && dev->reg_cache[reg] == val) {
+		dev->reg_stats.writes_elided++;
 		goto out;
 	}
-	dev_info(&dev->interface->dev, "Received %d bytes from device", read_length);
-	if (read_length != transfer_size) {
-		dev_err(&dev->interface->dev, "Read less than image size");
-		retVal = -EINVAL;
+
+	if (dev->reg_batch && !ft9201_reg_volatile(reg)) {
+		dev->reg_cache[reg] = val;
+		__set_bit(reg, dev->reg_valid);
+		__set_bit(reg, dev->reg_dirty);
+		dev->reg_stats.writes_batched++;
 		goto out;
 	}
 
-	// Ignore added 2 bytes at the start of data
-	memcpy(dev->read_img_data, img_with_header, img_size);
-	dev->img_in_filled = img_size;
-
-
-out:
-	if (img_with_header != NULL) {
-		kfree(img_with_header);
+	retval = ft9201_reg_xfer_write(dev, reg, val);
+	if (retval == 0 && !ft9201_reg_volatile(reg)) {
+		dev->reg_cache[reg] = val;
+		__set_bit(reg, dev->reg_valid);
+	} else {
+		__clear_bit(reg, dev->reg_valid);
 	}
 
-	return retVal;
+out:
+	mutex_unlock(&dev->reg_lock);
+	return retval;
 }
 
-static int ft9201_ic_sensor_mode_exit(struct ft9201_device *dev)
+static void ft9201_reg_batch_begin(struct ft9201_device *dev)
 {
-	int errCode = 0;
-	return errCode;
+	mutex_lock(&dev->reg_lock);
+	dev->reg_batch++;
+	mutex_unlock(&dev->reg_lock);
 }
 
-static DECLARE_WAIT_QUEUE_HEAD(ft9201_wq);
-
-static int has_data_remaining(struct ft9201_device *dev)
+/* Send what the outermost batch held back. Registers that fail are dropped from the cache. */
+static int ft9201_reg_batch_end(struct ft9201_device *dev)
 {
-	dev_info(&dev->interface->dev, "Copied: %lu, Filled: %lu", dev->img_in_copied, dev->img_in_filled);
-	if ((dev->img_in_copied == 5120) && (dev->img_in_filled == 5120)) {
-		dev->timetoexit = true;
+	unsigned int reg;
+	int retval = 0;
+	int err;
+
+	mutex_lock(&dev->reg_lock);
+	if (--dev->reg_batch == 0) {
+		for_each_set_bit(reg, dev->reg_dirty, FT9201_NR_REGS) {
+			err = ft9201_reg_xfer_write(dev, reg, dev->reg_cache[reg]);
+			if (err) {
+				__clear_bit(reg, dev->reg_valid);
+				retval = retval ? retval : err;
+			}
+		}
+		bitmap_zero(dev->reg_dirty, FT9201_NR_REGS);
 	}
-	return dev->img_in_copied < dev->img_in_filled;
+	mutex_unlock(&dev->reg_lock);
+
+	return retval;
 }
 
-static ssize_t send_read_data(struct ft9201_device *dev, char __user *buf, size_t count)
+static int ft9201_registers(struct ft9201_device *dev, struct ft9201_registers *req)
 {
-	size_t remaining = dev->img_in_filled - dev->img_in_copied;
-	size_t to_copy = remaining;
-	if (to_copy > count) {
-		to_copy = count;
-	}
-	dev_info(&dev->interface->dev, "Copied: %lu, to_copy: %lu, full_size: %lu", dev->img_in_copied, to_copy, dev->img_in_size);
+	struct ft9201_reg_op __user *uops = u64_to_user_ptr(req->ops);
+	struct ft9201_reg_op *ops;
+	unsigned int i;
+	int retval = 0;
 
-	if (dev->img_in_copied + to_copy > dev->img_in_size) {
-		dev_info(&dev->interface->dev, "error img_in_copied + to_copy > dev->img_in_size");
+	if (req->count == 0 || req->count > FT9201_REGS_MAX_OPS) {
 		return -EINVAL;
 	}
 
-	if (copy_to_user(buf, dev->read_img_data + dev->img_in_copied, to_copy)) {
-		dev_info(&dev->interface->dev, "error copy_to_user");
-		return -EFAULT;
+	ops = memdup_array_user(uops, req->count, sizeof(*ops));
+	if (IS_ERR(ops)) {
+		return PTR_ERR(ops);
+	}
+
+	retval = usb_autopm_get_interface(dev->interface);
+	if (retval) {
+		goto out_free;
+	}
+
+	ft9201_reg_batch_begin(dev);
+	for (i = 0; i < req->count && retval == 0; i++) {
+		if (ops[i].write) {
+			retval = ft9201_reg_write(dev, ops[i].reg, ops[i].val);
+		} else {
+			retval = ft9201_reg_read(dev, ops[i].reg, &ops[i].val);
+		}
+	}
+	/* a failed flush leaves it open which of the writes made it */
+	if (ft9201_reg_batch_end(dev) && retval == 0) {
+		retval = -EIO;
+		i = 0;
+	} else if (retval) {
+		i--;
+	}
+	usb_autopm_put_interface(dev->interface);
+
+	req->count = i;
+	if (copy_to_user(uops, ops, i * sizeof(*ops))) {
+		retval = -EFAULT;
 	}
-	dev->img_in_copied += to_copy;
-	dev_info(&dev->interface->dev, "Copied total: %lu", dev->img_in_copied);
-	return (ssize_t)to_copy;
+
+out_free:
+	kfree(ops);
+	return retval;
 }
 
-static ssize_t ft9201_read(struct file *fp, char __user *buf, size_t count, loff_t *f_pos)
+/* The device lost its registers, e.g. across a reset; read them again */
+static void ft9201_reg_cache_drop(struct ft9201_device *dev)
 {
-	struct ft9201_device *dev = fp->private_data;
-//	struct inode *inode = fp->f_path.dentry->d_inode;
+	mutex_lock(&dev->reg_lock);
+	bitmap_zero(dev->reg_valid, FT9201_NR_REGS);
+	bitmap_zero(dev->reg_dirty, FT9201_NR_REGS);
+	mutex_unlock(&dev->reg_lock);
+}
 
-	unsigned long loop_timeout = msecs_to_jiffies(1000);
+static int ft9201_initialize(struct ft9201_device *dev)
+{
+	int errCode = 0;
+	u8 sensor_status;
+	bool disarm = false;
 	int ret;
 
-	if (dev == NULL) {
-		pr_err("device is null\n");
-		return 0;
+	dev_info(&dev->interface->dev, "ioctl initialize");
+
+	/*
+	 * Informational only: reading the status register with wIndex 0x20 is
+	 * a guess at the register layout, so a sensor that refuses it is not
+	 * treated as failing to initialize.
+	 */
+	ret = ft9201_reg_read(dev, FT9201_REG_MCU_SENSOR_STATUS_INDEX, &sensor_status);
+	if (ret == 0) {
+		write_seqlock(&dev->status_lock);
+		dev->device_status.sensor_mcu_state = sensor_status;
+		write_sequnlock(&dev->status_lock);
+	} else {
+		dev_info(&dev->interface->dev, "Could not read the sensor status: %d", ret);
 	}
 
-	ret = mutex_lock_interruptible(&dev->io_mutex);
-	if (ret < 0) {
-		pr_info("Interrupted while waiting on IO mutex");
-		return ret;
+	/*
+	 * Only undo an arm of our own: the status register does not tell a
+	 * sensor we armed from one that never was, and the exit request is a
+	 * guess we would rather not send to a sensor that never saw the arm.
+	 */
+	spin_lock_irq(&dev->capture_lock);
+	if (dev->capture_state == FT9201_CAPTURE_IDLE && dev->sensor_armed && !dev->auto_power_users) {
+		dev->sensor_armed = false;
+		disarm = true;
+		ft9201_health_publish_locked(dev);
 	}
+	spin_unlock_irq(&dev->capture_lock);
 
-	if (dev->disconnected) {
-		ret = -ENODEV;
-		goto exit;
+	if (disarm) {
+		errCode = ft9201_ic_sensor_mode_exit(dev);
 	}
 
-int ret2;
+	write_seqlock(&dev->status_lock);
+	dev->device_status.sensor_height = FT9201_IMG_HEIGHT;
+	dev->device_status.sensor_width = FT9201_IMG_WIDTH;
+	if (errCode == 0) {
+		dev->device_status.initialized = 1;
+	}
+	write_sequnlock(&dev->status_lock);
 
-	while (true) {
-		if (has_data_remaining(dev)) {
-			ret = send_read_data(dev, buf, count);
-			ret2 = ret;
-			break;
-		}
-/*
-		if (ret2 == 5120) {
-			mutex_unlock(&dev->io_mutex);
-			kfree(dev->read_img_data);
-			dev->read_img_data = NULL;
-	        ft9201_release(inode, fp);
-			break;
-		}
-*/
-//		pr_info("ft9201 reading %d\n", i);
+	dev_info(&dev->interface->dev, "Image dimensions: %d x %d", FT9201_IMG_WIDTH, FT9201_IMG_HEIGHT);
+	if (errCode == 0) {
+		dev_info(&dev->interface->dev, "Device initialization successful");
+	}
 
+	return errCode;
+}
 
-		ret = wait_event_interruptible_timeout(ft9201_wq, 0, loop_timeout);
-		if ((ret == -ERESTARTSYS) || (dev->timetoexit == true)){
-			// We were interrupted by a signal
-			dev->timetoexit = false;
-			mutex_unlock(&dev->io_mutex);
-			pr_info("Done reading fingerprint closing");
-			ret = 0;
-			break;
-		}
+static inline void ft9201_hist_add(struct ft9201_hist *hist, u64 val)
+{
+	hist->count[min_t(unsigned int, fls64(val), FT9201_HIST_BUCKETS - 1)]++;
+}
 
-		int retval;
-		int poo = 0;
-unsigned char local_value[4];
+static inline unsigned char *ft9201_ring_frame(struct ft9201_device *dev, unsigned int slot)
+{
+	return dev->ring_data + slot * FT9201_IMG_SIZE;
+}
 
+static inline bool ft9201_slot_free(struct ft9201_device *dev, unsigned int slot)
+{
+	return !dev->slot_users[slot] && !test_bit(slot, dev->slot_bound);
+}
 
-	retval = usb_control_msg_send(
-			dev->udev,
-			0,
-			52,
-			0x40,
-			0x0003,
-			0,
-			NULL,
-			0,
-			5000,
-			GFP_KERNEL);
+/*
+ * Pick up to @want consecutive slots that no reader has pinned and no
+ * other urb is filling, so a burst lands in them back to back. The first
+ * full run from ring_next wins, the longest one otherwise; runs do not
+ * wrap. Pins leave room for every urb's burst, see ft9201_slot_pin(), but
+ * a burst length changed under queued urbs can still leave no slot free:
+ * @nr is then 0 and nothing is bound. Returns the first slot and sets @nr.
+ * Called with ring_lock held.
+ */
+static unsigned int ft9201_ring_bind_slots(struct ft9201_device *dev, unsigned int want,
+		unsigned int *nr)
+{
+	unsigned int i, n, start, slot = dev->ring_next, best = 0;
 
-	if (retval) {
-		dev_info(&dev->interface->dev, "Error sending control data 1: %d\n", retval);
-		return retval;
+	for (i = 0; i < dev->ring_slots && best < want; i++) {
+		start = (dev->ring_next + i) % dev->ring_slots;
+		for (n = 0; n < want && start + n < dev->ring_slots; n++) {
+			if (!ft9201_slot_free(dev, start + n)) {
+				break;
+			}
+		}
+		if (n > best) {
+			slot = start;
+			best = n;
+		}
+	}
+	if (best == 0) {
+		*nr = 0;
+		return 0;
 	}
-	retval = usb_control_msg_send(
-			dev->udev,
-			0,
-			111,
-			0x40,
-			0x0020,
-			37248,
-			NULL,
-			0,
-			5000,
-			GFP_KERNEL);
 
-	if (retval) {
-		dev_info(&dev->interface->dev, "Error sending control data 2: %d\n", retval);
-		return retval;
+	dev->ring_next = (slot + best) % dev->ring_slots;
+	for (i = slot; i < slot + best; i++) {
+		__set_bit(i, dev->slot_bound);
+		dev->slot_seq[i] = 0;
+		WRITE_ONCE(dev->ring_ctrl->slot_seq[i], 0);
 	}
+	*nr = best;
 
-	retval = usb_control_msg_send(
-			dev->udev,
-			0,
-			111,
-			0x40,
-			0x1400,
-			36992,
-			NULL,
-			0,
-			5000,
-			GFP_KERNEL);
+	return slot;
+}
 
-	if (retval) {
-		dev_info(&dev->interface->dev, "Error sending control data 3: %d\n", retval);
-		return retval;
+/* Give back bound slots no frame was published in. Called with ring_lock held. */
+static void ft9201_ring_unbind_slots(struct ft9201_device *dev, unsigned int slot, unsigned int nr)
+{
+	while (nr--) {
+		__clear_bit(slot++, dev->slot_bound);
 	}
+}
 
-	while(poo == 0) {
-	retval = usb_control_msg_recv(
-			dev->udev,
-			0,
-			FT9201_REQ_READ_REGISTERS,
-			USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-			0,
-			0,
-			&local_value,
-			sizeof(local_value),
-			5000,
-			GFP_KERNEL);
+/* Slots readers may pin at once: the rest stays for the urbs, a whole burst each */
+static inline unsigned int ft9201_pin_limit(struct ft9201_device *dev)
+{
+	return dev->ring_slots - FT9201_IN_URBS * READ_ONCE(dev->burst);
+}
 
-	if (retval) {
-		dev_info(&dev->interface->dev, "Error sending data: %d\n", retval);
+/*
+ * Slots are pinned while a reader holds or queues their frame. At most
+ * ft9201_pin_limit() are pinned at once, so a completing urb can always be
+ * rebound. Called with ring_lock held.
+ */
+static bool ft9201_slot_pin(struct ft9201_device *dev, unsigned int slot)
+{
+	if (!dev->slot_users[slot]) {
+		if (dev->slots_pinned >= ft9201_pin_limit(dev)) {
+			return false;
+		}
+		dev->slots_pinned++;
+	}
+	dev->slot_users[slot]++;
+
+	return true;
+}
+
+static void ft9201_slot_unpin(struct ft9201_device *dev, unsigned int slot)
+{
+	if (--dev->slot_users[slot] == 0) {
+		dev->slots_pinned--;
+	}
+}
+
+/*
+ * Queue a frame on one streaming reader, applying its overflow policy.
+ * A full ring counts as a full queue. Called with ring_lock held.
+ */
+static void ft9201_reader_push(struct ft9201_device *dev, struct ft9201_reader *reader,
+		const struct ft9201_frame *frame)
+{
+	struct ft9201_frame old;
+
+	if (kfifo_is_full(&reader->queue)) {
+		if (reader->stream_overflow == FT9201_STREAM_DROP_NEWEST) {
+			reader->stats.dropped_newest++;
+			dev->stats.dropped_newest++;
+			return;
+		}
+
+		if (kfifo_get(&reader->queue, &old)) {
+			ft9201_slot_unpin(dev, old.slot);
+		}
+		reader->stats.dropped_oldest++;
+		dev->stats.dropped_oldest++;
+	}
+
+	if (!ft9201_slot_pin(dev, frame->slot)) {
+		reader->stats.dropped_newest++;
+		dev->stats.dropped_newest++;
+		return;
+	}
+
+	kfifo_put(&reader->queue, *frame);
+	dev->stats.stream_frames++;
+}
+
+/*
+ * Hand a freshly published frame to every streaming reader, pinning its
+ * slot until each of them is done with it. Called with ring_lock held.
+ */
+static void ft9201_stream_push(struct ft9201_device *dev, const struct ft9201_frame *frame)
+{
+	struct ft9201_reader *reader;
+
+	if (frame->len != FT9201_IMG_SIZE) {
+		dev->stats.short_frames++;
+		return;
+	}
+
+	if (!dev->streamers || frame->flags) {
+		return;
+	}
+
+	list_for_each_entry(reader, &dev->readers, node) {
+		if (reader->streaming) {
+			ft9201_reader_push(dev, reader, frame);
+		}
+	}
+}
+
+/*
+ * One pass over a full frame: global mean and variance, the share of 8x8
+ * blocks with enough contrast to be ridges, and a rolling hash of the
+ * quantized block means. Cheap enough for the urb completion.
+ */
+static void ft9201_frame_score(const unsigned char *data, struct ft9201_frame *frame)
+{
+	u32 block_sum[FT9201_BLOCKS_X] = { 0 };
+	u32 block_sq[FT9201_BLOCKS_X] = { 0 };
+	unsigned int covered = 0;
+	unsigned int x, y, bx;
+	u64 sum = 0, sq = 0;
+	u32 hash = 0;
+	u32 n, var;
+	u8 p;
+
+	for (y = 0; y < FT9201_IMG_HEIGHT; y++) {
+		for (x = 0; x < FT9201_IMG_WIDTH; x++) {
+			p = data[y * FT9201_IMG_WIDTH + x];
+			block_sum[x / FT9201_BLOCK] += p;
+			block_sq[x / FT9201_BLOCK] += p * p;
+		}
+
+		if (y % FT9201_BLOCK != FT9201_BLOCK - 1) {
+			continue;
+		}
+
+		/* a row of blocks is complete */
+		n = FT9201_BLOCK * FT9201_BLOCK;
+		for (bx = 0; bx < FT9201_BLOCKS_X; bx++) {
+			var = (block_sq[bx] * n - block_sum[bx] * block_sum[bx]) / (n * n);
+			if (var > gate_block_variance) {
+				covered++;
+			}
+			hash = hash * 31 + ((block_sum[bx] / n) >> min(gate_hash_shift, 7u));
+
+			sum += block_sum[bx];
+			sq += block_sq[bx];
+			block_sum[bx] = 0;
+			block_sq[bx] = 0;
+		}
+	}
+
+	frame->mean = div_u64(sum, FT9201_IMG_SIZE);
+	frame->variance = div_u64(sq * FT9201_IMG_SIZE - sum * sum, (u64)FT9201_IMG_SIZE * FT9201_IMG_SIZE);
+	frame->coverage = covered * 1000 / FT9201_BLOCKS;
+	frame->hash = hash;
+}
+
+/* Flag the frame if the gate drops it. Called with ring_lock held. */
+static void ft9201_frame_gate(struct ft9201_device *dev, struct ft9201_frame *frame)
+{
+	if ((gate_min_variance && frame->variance < gate_min_variance) ||
+	    (gate_min_coverage && frame->coverage < gate_min_coverage)) {
+		frame->flags |= FT9201_FRAME_EMPTY;
+		dev->stats.gated_empty++;
+		return;
+	}
+
+	if (gate_duplicates && frame->hash == dev->gate_last_hash) {
+		frame->flags |= FT9201_FRAME_DUPLICATE;
+		dev->stats.gated_duplicate++;
+	}
+	dev->gate_last_hash = frame->hash;
+}
+
+static u32 ft9201_ring_publish(struct ft9201_device *dev, unsigned int slot, u32 len, u64 transfer_ns, bool *gated)
+{
+	struct ft9201_ring_ctrl *ctrl = dev->ring_ctrl;
+	struct ft9201_ring_desc *desc;
+	struct ft9201_frame score = { 0 };
+	struct ft9201_frame *frame;
+	unsigned long flags;
+	u32 seq;
+
+	/* the slot is still bound to this urb, nothing else touches it */
+	if (len == FT9201_IMG_SIZE) {
+		ft9201_frame_score(ft9201_ring_frame(dev, slot), &score);
+	}
+
+	spin_lock_irqsave(&dev->ring_lock, flags);
+	__clear_bit(slot, dev->slot_bound);
+
+	/* 0 marks an empty entry */
+	seq = ++dev->ring_seq;
+	if (seq == 0) {
+		seq = ++dev->ring_seq;
+	}
+
+	frame = &dev->frames[seq % dev->ring_slots];
+	frame->seq = seq;
+	frame->slot = slot;
+	frame->len = len;
+	frame->flags = 0;
+	frame->mean = score.mean;
+	frame->variance = score.variance;
+	frame->coverage = score.coverage;
+	frame->hash = score.hash;
+	if (len == FT9201_IMG_SIZE) {
+		ft9201_frame_gate(dev, frame);
+	}
+	*gated = frame->flags != 0;
+	frame->timestamp_ns = ktime_get_ns();
+	frame->transfer_ns = transfer_ns;
+	/* capture_lock protects it, a torn or stale count only skews metadata */
+	frame->detect_polls = READ_ONCE(dev->stats.capture_polls);
+	dev->slot_seq[slot] = seq;
+
+	desc = &ctrl->desc[seq % dev->ring_slots];
+	WRITE_ONCE(desc->seq, 0);
+	smp_wmb();
+	desc->slot = slot;
+	desc->len = len;
+	desc->flags = frame->flags;
+	desc->timestamp_ns = frame->timestamp_ns;
+	smp_wmb();
+	WRITE_ONCE(desc->seq, seq);
+	WRITE_ONCE(ctrl->slot_seq[slot], seq);
+	smp_store_release(&ctrl->producer, seq);
+
+	ft9201_stream_push(dev, frame);
+	spin_unlock_irqrestore(&dev->ring_lock, flags);
+
+	return seq;
+}
+
+/* Pin frame @seq so its slot is not refilled while it is being copied */
+static int ft9201_ring_get(struct ft9201_device *dev, u32 seq, struct ft9201_frame *out)
+{
+	struct ft9201_frame *frame;
+	int retval = -EOVERFLOW;
+
+	spin_lock_irq(&dev->ring_lock);
+	frame = &dev->frames[seq % dev->ring_slots];
+	if (seq != 0 && frame->seq == seq && dev->slot_seq[frame->slot] == seq) {
+		*out = *frame;
+		retval = ft9201_slot_pin(dev, frame->slot) ? 0 : -EBUSY;
+	}
+	spin_unlock_irq(&dev->ring_lock);
+
+	return retval;
+}
+
+static void ft9201_ring_put(struct ft9201_device *dev, unsigned int slot)
+{
+	spin_lock_irq(&dev->ring_lock);
+	ft9201_slot_unpin(dev, slot);
+	spin_unlock_irq(&dev->ring_lock);
+}
+
+static int ft9201_alloc_ring(struct ft9201_device *dev)
+{
+	struct ft9201_ring_ctrl *ctrl;
+
+	dev->ring_slots = roundup_pow_of_two(clamp_t(unsigned int, ring_slots,
+			FT9201_IN_URBS + 2, FT9201_RING_MAX_SLOTS));
+	dev->ring_data_size = PAGE_ALIGN(dev->ring_slots * FT9201_IMG_SIZE);
+
+	ctrl = (struct ft9201_ring_ctrl *)get_zeroed_page(GFP_KERNEL);
+	if (ctrl == NULL) {
+		return -ENOMEM;
+	}
+	dev->ring_ctrl = ctrl;
+
+	/* page backed so the same memory is DMA'd into and mapped to userspace */
+	dev->ring_data = alloc_pages_exact(dev->ring_data_size, GFP_KERNEL | __GFP_ZERO);
+	if (dev->ring_data == NULL) {
+		return -ENOMEM;
+	}
+
+	ctrl->version = FT9201_RING_VERSION;
+	ctrl->nr_slots = dev->ring_slots;
+	ctrl->frame_size = FT9201_IMG_SIZE;
+	ctrl->data_offset = PAGE_SIZE;
+
+	return 0;
+}
+
+static void ft9201_free_ring(struct ft9201_device *dev)
+{
+	if (dev->ring_data != NULL) {
+		free_pages_exact(dev->ring_data, dev->ring_data_size);
+	}
+	if (dev->ring_ctrl != NULL) {
+		free_page((unsigned long)dev->ring_ctrl);
+	}
+}
+
+static int ft9201_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ft9201_reader *reader = file->private_data;
+	struct ft9201_device *dev = reader->dev;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long data_size;
+	int retval;
+
+	if (!(vma->vm_flags & VM_SHARED) ||
+	    vma->vm_pgoff != 0 || size > PAGE_SIZE + dev->ring_data_size) {
+		return -EINVAL;
+	}
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+	retval = remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(dev->ring_ctrl) >> PAGE_SHIFT,
+			min(size, PAGE_SIZE), vma->vm_page_prot);
+	if (retval || size <= PAGE_SIZE) {
 		return retval;
+	}
+
+	data_size = size - PAGE_SIZE;
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			virt_to_phys(dev->ring_data) >> PAGE_SHIFT,
+			data_size, vma->vm_page_prot);
+}
+
+static int ft9201_submit_in_urb(struct ft9201_device *dev, struct ft9201_in_urb *in, gfp_t mem_flags)
+{
+	unsigned long flags;
+	int retval;
+
+	spin_lock_irqsave(&dev->ring_lock, flags);
+	in->slot = ft9201_ring_bind_slots(dev, READ_ONCE(dev->burst), &in->nr_slots);
+	if (in->nr_slots == 0) {
+		/* every slot is busy, left idle until the next capture queues it again */
+		in->active = false;
+		spin_unlock_irqrestore(&dev->ring_lock, flags);
+		dev_dbg(&dev->interface->dev, "No free ring slot, bulk-in urb left idle");
+		return 0;
+	}
+	spin_unlock_irqrestore(&dev->ring_lock, flags);
+
+	/* frames are a multiple of the packet size, so a short run just splits the burst */
+	in->urb->transfer_buffer = ft9201_ring_frame(dev, in->slot);
+	in->urb->transfer_buffer_length = in->nr_slots * FT9201_IMG_SIZE;
+	in->submit_time = ktime_get();
+
+	usb_anchor_urb(in->urb, &dev->in_anchor);
+	retval = dev->disconnected ? -ENODEV : usb_submit_urb(in->urb, mem_flags);
+	trace_ft9201_bulk_start(dev->interface->minor, in->slot, in->urb->transfer_buffer_length, retval);
+	if (retval) {
+		usb_unanchor_urb(in->urb);
+
+		/* -EPERM means the urb is being killed */
+		if (retval != -EPERM && retval != -ENODEV) {
+			dev_err(&dev->interface->dev, "Failed submitting bulk-in urb: %d", retval);
+			ft9201_recover_schedule(dev, retval);
+		}
+
+		spin_lock_irqsave(&dev->ring_lock, flags);
+		ft9201_ring_unbind_slots(dev, in->slot, in->nr_slots);
+		in->active = false;
+		spin_unlock_irqrestore(&dev->ring_lock, flags);
+	}
+
+	return retval;
+}
+
+static void ft9201_read_bulk_callback(struct urb *urb)
+{
+	struct ft9201_in_urb *in = urb->context;
+	struct ft9201_device *dev = in->dev;
+	unsigned int i, frames, len;
+	unsigned long flags;
+	bool delivered = false;
+	bool gated;
+	u64 ns;
+	u32 seq;
+
+	if (urb->status) {
+		trace_ft9201_bulk_end(dev->interface->minor, in->slot, 0, urb->status, urb->actual_length);
+
+		/* sync/async unlink faults aren't errors */
+		if (!(urb->status == -ENOENT ||
+		      urb->status == -ECONNRESET ||
+		      urb->status == -ESHUTDOWN)) {
+			dev_err(&dev->interface->dev, "%s - nonzero read bulk status received: %d\n",
+					__func__, urb->status);
+
+			spin_lock_irqsave(&dev->ring_lock, flags);
+			dev->stats.bulk_errors++;
+			spin_unlock_irqrestore(&dev->ring_lock, flags);
+
+			spin_lock_irqsave(&dev->err_lock, flags);
+			dev->errors = urb->status;
+			spin_unlock_irqrestore(&dev->err_lock, flags);
+
+			/* first, so the capture is held back for it rather than failed */
+			ft9201_recover_schedule(dev, urb->status);
+			ft9201_capture_frame_done(dev, 0, urb->status);
+		}
+
+		/* left idle, the next capture queues it again */
+		spin_lock_irqsave(&dev->ring_lock, flags);
+		ft9201_ring_unbind_slots(dev, in->slot, in->nr_slots);
+		in->active = false;
+		spin_unlock_irqrestore(&dev->ring_lock, flags);
+
+		wake_up_interruptible(&dev->bulk_in_wait);
+		return;
+	}
+
+	/* a burst carries frames back to back, an empty or short tail is one short frame */
+	frames = clamp_t(unsigned int, DIV_ROUND_UP(urb->actual_length, FT9201_IMG_SIZE), 1, in->nr_slots);
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), in->submit_time));
+	spin_lock_irqsave(&dev->ring_lock, flags);
+	dev->stats.bulk_transfers++;
+	dev->stats.bulk_frames += frames;
+	ft9201_hist_add(&dev->stats.bulk_us, div_u64(ns, NSEC_PER_USEC));
+	ft9201_ring_unbind_slots(dev, in->slot + frames, in->nr_slots - frames);
+	spin_unlock_irqrestore(&dev->ring_lock, flags);
+
+	/* in order, the first frame ends a capture and the rest go to the streams */
+	for (i = 0; i < frames; i++) {
+		len = min_t(unsigned int, urb->actual_length - min(urb->actual_length, i * FT9201_IMG_SIZE),
+				FT9201_IMG_SIZE);
+		seq = ft9201_ring_publish(dev, in->slot + i, len, ns, &gated);
+		trace_ft9201_bulk_end(dev->interface->minor, in->slot + i, seq, 0, len);
+		if (gated) {
+			ft9201_capture_frame_gated(dev);
+		} else {
+			ft9201_capture_frame_done(dev, seq, 0);
+			delivered = true;
+		}
+	}
+
+	/* straight back onto the endpoint, bound to the next free slots */
+	ft9201_submit_in_urb(dev, in, GFP_ATOMIC);
+
+	/* nothing for readers in gated frames */
+	if (delivered) {
+		wake_up_interruptible(&dev->bulk_in_wait);
+	}
+}
+
+/*
+ * Queue every bulk-in urb that is not already on the endpoint. @mem_flags
+ * is GFP_NOIO from resume, which may run while block I/O waits on it.
+ */
+static int ft9201_start_in_urbs(struct ft9201_device *dev, gfp_t mem_flags)
+{
+	struct ft9201_in_urb *in;
+	unsigned int i;
+	bool idle;
+	int retval;
+
+	for (i = 0; i < FT9201_IN_URBS; i++) {
+		in = &dev->in_urbs[i];
+
+		spin_lock_irq(&dev->ring_lock);
+		idle = !in->active;
+		in->active = true;
+		spin_unlock_irq(&dev->ring_lock);
+
+		if (!idle) {
+			continue;
+		}
+
+		retval = ft9201_submit_in_urb(dev, in, mem_flags);
+		if (retval) {
+			return retval;
+		}
+	}
+
+	return 0;
+}
+
+static void ft9201_stop_in_urbs(struct ft9201_device *dev)
+{
+	usb_kill_anchored_urbs(&dev->in_anchor);
+}
+
+static int ft9201_alloc_in_urbs(struct ft9201_device *dev)
+{
+	struct ft9201_in_urb *in;
+	unsigned int i;
+
+	for (i = 0; i < FT9201_IN_URBS; i++) {
+		in = &dev->in_urbs[i];
+		in->dev = dev;
+
+		in->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (in->urb == NULL) {
+			return -ENOMEM;
+		}
+
+		/* buffer and length follow the ring slots bound on every submit */
+		usb_fill_bulk_urb(in->urb, dev->udev,
+				usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+				NULL, FT9201_IMG_SIZE,
+				ft9201_read_bulk_callback, in);
+	}
+
+	return 0;
+}
+
+static void ft9201_free_in_urbs(struct ft9201_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < FT9201_IN_URBS; i++) {
+		if (dev->in_urbs[i].urb == NULL) {
+			continue;
+		}
+
+		usb_kill_urb(dev->in_urbs[i].urb);
+		usb_free_urb(dev->in_urbs[i].urb);
+	}
+}
+
+/*
+ * Tell the sensor how many bytes to send per bulk-in transfer, burst_frames
+ * frames back to back. Not sent for single frames, the sensor's default,
+ * and on failure the driver falls back to them. Frames are a whole number
+ * of packets, so urbs queued for another burst length still split them
+ * at frame boundaries.
+ */
+static void ft9201_configure_burst(struct ft9201_device *dev)
+{
+	unsigned int burst;
+	int retval;
+
+	burst = clamp_t(unsigned int, burst_frames, 1,
+			min_t(unsigned int, FT9201_BURST_MAX, dev->ring_slots / (2 * FT9201_IN_URBS)));
+	if (burst != burst_frames) {
+		dev_info(&dev->interface->dev, "Burst of %u frames, %u asked for", burst, burst_frames);
+	}
+
+	if (burst > 1) {
+		retval = usb_control_msg_send(dev->udev, 0, FT9201_REQ_CONFIGURE_BULK_TRANSFER_SIZE_PROBABLY,
+				USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+				burst * FT9201_IMG_SIZE, 0, NULL, 0, USB_CONTROL_OP_TIMEOUT, GFP_KERNEL);
+		if (retval) {
+			dev_warn(&dev->interface->dev, "Could not configure bursts, single frames: %d", retval);
+			burst = 1;
+		}
+	}
+
+	WRITE_ONCE(dev->burst, burst);
+}
+
+/* Unpin the reader's slot once it has been copied out */
+static void ft9201_release_frame(struct ft9201_reader *reader)
+{
+	if (reader->read_slot < 0) {
+		return;
+	}
+
+	ft9201_ring_put(reader->dev, reader->read_slot);
+	reader->read_slot = -1;
+	reader->read_img_data = NULL;
+}
+
+/* Hand a pinned slot to read(), which copies straight out of it, and account its lag */
+static void ft9201_load_frame(struct ft9201_reader *reader, const struct ft9201_frame *frame)
+{
+	struct ft9201_device *dev = reader->dev;
+	u32 lag;
+
+	ft9201_release_frame(reader);
+
+	reader->read_slot = frame->slot;
+	reader->read_frame = *frame;
+	reader->read_img_data = ft9201_ring_frame(dev, frame->slot);
+	reader->img_in_copied = 0;
+	reader->img_in_filled = frame->len;
+
+	spin_lock_irq(&dev->ring_lock);
+	lag = dev->ring_seq - frame->seq;
+	reader->stats.frames++;
+	reader->stats.lag = lag;
+	reader->stats.max_lag = max(reader->stats.max_lag, lag);
+	spin_unlock_irq(&dev->ring_lock);
+}
+
+static int ft9201_read_image(struct ft9201_reader *reader, u32 seq)
+{
+	struct ft9201_device *dev = reader->dev;
+	struct ft9201_frame frame;
+	int retVal;
+
+	reader->img_in_copied = 0;
+	reader->img_in_filled = 0;
+	ft9201_release_frame(reader);
+
+	retVal = ft9201_ring_get(dev, seq, &frame);
+	if (retVal < 0) {
+		dev_err(&dev->interface->dev, "Frame %u could not be pinned: %d", seq, retVal);
+		return retVal;
+	}
+
+	if (frame.len != FT9201_IMG_SIZE) {
+		dev_err(&dev->interface->dev, "Read less than image size");
+		ft9201_ring_put(dev, frame.slot);
+		return -EINVAL;
+	}
+
+	ft9201_load_frame(reader, &frame);
+
+	return 0;
+}
+
+static void ft9201_count_ctrl_error(struct ft9201_device *dev, int err)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->capture_lock, flags);
+	dev->stats.ctrl_errors++;
+	if (err == -ETIMEDOUT) {
+		dev->stats.timeouts++;
+	}
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irqrestore(&dev->capture_lock, flags);
+
+	ft9201_recover_schedule(dev, err);
+}
+
+/*
+ * Take the sensor out of armed low-power mode. The start request with a
+ * zero value is assumed to undo the arm sequence (0x34 with 3); no capture
+ * of the vendor driver shows it, so the encoding is unverified. Only send
+ * it to a sensor the driver armed itself.
+ */
+static int ft9201_ic_sensor_mode_exit(struct ft9201_device *dev)
+{
+	int errCode;
+
+	errCode = usb_control_msg_send(dev->udev, 0, FT9201_REQ_START_CAPTURE_PROBABLY,
+			USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			0, 0, NULL, 0, USB_CONTROL_OP_TIMEOUT, GFP_KERNEL);
+	if (errCode) {
+		ft9201_count_ctrl_error(dev, errCode);
+		dev_info(&dev->interface->dev, "Error leaving sensor mode: %d\n", errCode);
+	}
+
+	return errCode;
+}
+
+static const struct {
+	u8 request;
+	u16 value;
+	u16 index;
+} ft9201_arm_seq[FT9201_ARM_STEPS] = {
+		{ 52, 0x0003, 0 },
+		{ 111, 0x0020, 37248 },
+		{ 111, 0x1400, 36992 },
+};
+
+static void ft9201_capture_queue(struct ft9201_device *dev, unsigned long delay)
+{
+	if (!dev->disconnected) {
+		/* may cut short the arm timeout, so modify rather than schedule */
+		mod_delayed_work(dev->capture_wq, &dev->capture_work, delay);
+	}
+}
+
+static void ft9201_arm_done(struct ft9201_device *dev, int err);
+
+static int ft9201_arm_submit(struct ft9201_device *dev, unsigned int step, gfp_t mem_flags)
+{
+	struct ft9201_ctrl_urb *arm = &dev->arm_urbs[step];
+	int retval;
+
+	if (dev->disconnected) {
+		return -ENODEV;
+	}
+
+	arm->submit_time = ktime_get();
+	usb_anchor_urb(arm->urb, &dev->ctrl_anchor);
+	retval = usb_submit_urb(arm->urb, mem_flags);
+	if (retval) {
+		usb_unanchor_urb(arm->urb);
+		ft9201_count_ctrl_error(dev, retval);
+		dev_info(&dev->interface->dev, "Error sending control data %u: %d\n", step + 1, retval);
+	}
+
+	return retval;
+}
+
+static void ft9201_arm_callback(struct urb *urb)
+{
+	struct ft9201_ctrl_urb *arm = urb->context;
+	struct ft9201_device *dev = arm->dev;
+	int status = urb->status;
+
+	trace_ft9201_arm_msg(dev->interface->minor, arm->step + 1, arm->setup->bRequest,
+			le16_to_cpu(arm->setup->wValue), le16_to_cpu(arm->setup->wIndex),
+			status, ktime_to_ns(ktime_sub(ktime_get(), arm->submit_time)));
+
+	/* killed by a timeout or a stop, which finish the sequence themselves */
+	if (status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN) {
+		return;
+	}
+
+	if (status) {
+		ft9201_count_ctrl_error(dev, status);
+		dev_info(&dev->interface->dev, "Error sending control data %u: %d\n", arm->step + 1, status);
+		ft9201_arm_done(dev, status);
+		return;
+	}
+
+	if (arm->step + 1 < FT9201_ARM_STEPS) {
+		status = ft9201_arm_submit(dev, arm->step + 1, GFP_ATOMIC);
+		if (status) {
+			ft9201_arm_done(dev, status);
+		}
+		return;
+	}
+
+	ft9201_arm_done(dev, 0);
+}
+
+/*
+ * Send the arm sequence as a chain of prebuilt control urbs. The capture
+ * work is pushed out to serve as the timeout of the whole sequence, the
+ * last completion moves the state machine on from ARM or PREARM.
+ */
+static void ft9201_arm_start(struct ft9201_device *dev)
+{
+	int retval;
+
+	spin_lock_irq(&dev->capture_lock);
+	dev->arm_pending = true;
+	spin_unlock_irq(&dev->capture_lock);
+
+	/* before submitting, so a fast completion is not overridden */
+	ft9201_capture_queue(dev, msecs_to_jiffies(USB_ARM_OP_TIMEOUT));
+
+	retval = ft9201_arm_submit(dev, 0, GFP_KERNEL);
+	if (retval) {
+		ft9201_arm_done(dev, retval);
+	}
+}
+
+/* The capture work ran while the arm sequence was still in flight */
+static void ft9201_arm_timeout(struct ft9201_device *dev)
+{
+	bool pending;
+
+	usb_kill_anchored_urbs(&dev->ctrl_anchor);
+
+	spin_lock_irq(&dev->capture_lock);
+	pending = dev->arm_pending;
+	spin_unlock_irq(&dev->capture_lock);
+
+	/* unless the last completion got in first */
+	if (pending) {
+		dev_info(&dev->interface->dev, "Timed out arming the sensor\n");
+		ft9201_count_ctrl_error(dev, -ETIMEDOUT);
+		ft9201_arm_done(dev, -ETIMEDOUT);
+	}
+}
+
+static int ft9201_init_ctrl_urb(struct ft9201_device *dev, struct ft9201_ctrl_urb *ctrl,
+		u8 request_type, u8 request, u16 value, u16 index, u16 length,
+		usb_complete_t complete)
+{
+	ctrl->dev = dev;
+
+	ctrl->urb = usb_alloc_urb(0, GFP_KERNEL);
+	ctrl->setup = kmalloc(sizeof(*ctrl->setup), GFP_KERNEL);
+	if (length) {
+		ctrl->data = kmalloc(length, GFP_KERNEL);
+	}
+	if (ctrl->urb == NULL || ctrl->setup == NULL || (length && ctrl->data == NULL)) {
+		return -ENOMEM;
+	}
+
+	ctrl->setup->bRequestType = request_type;
+	ctrl->setup->bRequest = request;
+	ctrl->setup->wValue = cpu_to_le16(value);
+	ctrl->setup->wIndex = cpu_to_le16(index);
+	ctrl->setup->wLength = cpu_to_le16(length);
+
+	usb_fill_control_urb(ctrl->urb, dev->udev,
+			request_type & USB_DIR_IN ? usb_rcvctrlpipe(dev->udev, 0) : usb_sndctrlpipe(dev->udev, 0),
+			(unsigned char *)ctrl->setup, ctrl->data, length,
+			complete, ctrl);
+
+	return 0;
+}
+
+static void ft9201_detect_callback(struct urb *urb);
+
+static int ft9201_alloc_ctrl_urbs(struct ft9201_device *dev)
+{
+	unsigned int i;
+	int retval;
+
+	for (i = 0; i < FT9201_ARM_STEPS; i++) {
+		dev->arm_urbs[i].step = i;
+		retval = ft9201_init_ctrl_urb(dev, &dev->arm_urbs[i],
+				USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+				ft9201_arm_seq[i].request, ft9201_arm_seq[i].value,
+				ft9201_arm_seq[i].index, 0, ft9201_arm_callback);
+		if (retval) {
+			return retval;
+		}
+	}
+
+	return ft9201_init_ctrl_urb(dev, &dev->detect_urb,
+			USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			FT9201_REQ_READ_REGISTERS, 0, 0, 4, ft9201_detect_callback);
+}
+
+static void ft9201_free_ctrl_urb(struct ft9201_ctrl_urb *ctrl)
+{
+	usb_free_urb(ctrl->urb);
+	kfree(ctrl->setup);
+	kfree(ctrl->data);
+}
+
+static void ft9201_free_ctrl_urbs(struct ft9201_device *dev)
+{
+	unsigned int i;
+
+	usb_kill_anchored_urbs(&dev->ctrl_anchor);
+
+	for (i = 0; i < FT9201_ARM_STEPS; i++) {
+		ft9201_free_ctrl_urb(&dev->arm_urbs[i]);
+	}
+	ft9201_free_ctrl_urb(&dev->detect_urb);
+}
+
+/*
+ * Status for health checks is published rather than read under the locks
+ * the capture path takes: device_status under a seqlock, and the capture
+ * state and counters as a snapshot under a seqcount that every change to
+ * them republishes, with capture_lock held. Readers retry instead of
+ * waiting, and the newest sequence number comes from the ring itself.
+ */
+static void ft9201_status_read(struct ft9201_device *dev, struct ft9201_status *status)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&dev->status_lock);
+		*status = dev->device_status;
+	} while (read_seqretry(&dev->status_lock, seq));
+
+	status->frame_size = FT9201_IMG_SIZE;
+	status->last_seq = smp_load_acquire(&dev->ring_ctrl->producer);
+}
+
+static void ft9201_health_read(struct ft9201_device *dev, struct ft9201_health *health)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&dev->health_seq);
+		*health = dev->health;
+	} while (read_seqcount_retry(&dev->health_seq, seq));
+
+	health->last_seq = smp_load_acquire(&dev->ring_ctrl->producer);
+	health->streamers = READ_ONCE(dev->streamers);
+}
+
+/* Called with capture_lock held, after changing capture_state, capture_err or stats */
+static void ft9201_health_publish_locked(struct ft9201_device *dev)
+{
+	struct ft9201_health *health = &dev->health;
+
+	write_seqcount_begin(&dev->health_seq);
+	health->capture_state = dev->recovering ? FT9201_STATE_RECOVERING : dev->capture_state;
+	health->last_err = dev->capture_err;
+	if (dev->health_done_gen != dev->capture_done_gen) {
+		dev->health_done_gen = dev->capture_done_gen;
+		health->last_capture_ns = ktime_get_ns();
+	}
+	health->captures = dev->stats.captures;
+	health->errors = dev->stats.errors;
+	health->timeouts = dev->stats.timeouts;
+	health->ctrl_errors = dev->stats.ctrl_errors;
+	health->detect_polls = dev->stats.detect_polls;
+	health->prearm_hits = dev->stats.prearm_hits;
+	health->suspends = dev->stats.suspends;
+	health->resumes = dev->stats.resumes;
+	health->arm_to_detect_ns = dev->stats.arm_to_detect_ns;
+	health->detect_to_frame_ns = dev->stats.detect_to_frame_ns;
+	health->last_detect_to_frame_ns = dev->stats.last_detect_to_frame_ns;
+	health->resume_to_armed_ns = dev->stats.resume_to_armed_ns;
+	health->recoveries = dev->stats.recoveries;
+	health->recover_failures = dev->stats.recover_failures;
+	health->recover_resets = dev->stats.recover_resets;
+	health->recover_ns = dev->stats.recover_ns;
+	health->last_recover_ns = dev->stats.last_recover_ns;
+	write_seqcount_end(&dev->health_seq);
+}
+
+/*
+ * Auto power: between captures the sensor is left armed in its low-power
+ * mode and reports a touch by pushing the frame into the bulk-in urbs that
+ * are always queued, so nothing is polled and an idle sensor sees no
+ * control traffic. After each frame it is armed again in the background,
+ * and a capture that finds it armed just waits for the frame. Called with
+ * capture_lock held.
+ */
+static void ft9201_auto_power_rearm_locked(struct ft9201_device *dev)
+{
+	if (!dev->auto_power_users || dev->disconnected || dev->capture_state != FT9201_CAPTURE_IDLE ||
+	    dev->sensor_armed || dev->arm_pending || dev->recovering) {
+		return;
+	}
+
+	/* auto power holds its own reference, the device is awake */
+	usb_autopm_get_interface_no_resume(dev->interface);
+	dev->pm_held = true;
+	dev->auto_rearm = true;
+	dev->capture_state = FT9201_CAPTURE_PREARM;
+	mod_delayed_work(dev->capture_wq, &dev->capture_work, 0);
+}
+
+/*
+ * Go IDLE, handing back the autopm reference held since the state machine
+ * left IDLE. Returns true when the caller must drop it with
+ * usb_autopm_put_interface_async() once capture_lock is released.
+ */
+static bool ft9201_capture_idle_locked(struct ft9201_device *dev)
+{
+	bool put = dev->pm_held;
+
+	dev->capture_state = FT9201_CAPTURE_IDLE;
+	dev->pm_held = false;
+	dev->stream_armed = false;
+
+	return put;
+}
+
+/* Leave IDLE or PREARM for ARM. Called with capture_lock held. */
+static void ft9201_capture_begin_locked(struct ft9201_device *dev)
+{
+	dev->capture_state = FT9201_CAPTURE_ARM;
+	dev->capture_err = 0;
+	dev->capture_recovered = false;
+	dev->start_time = ktime_get();
+	trace_ft9201_capture_start(dev->interface->minor, dev->capture_done_gen,
+			READ_ONCE(dev->streamers) != 0);
+	/* a pre-arm in flight is taken over by its last completion */
+	if (!dev->arm_pending) {
+		mod_delayed_work(dev->capture_wq, &dev->capture_work, 0);
+	}
+}
+
+/*
+ * The capture failed because the device needs recovering. Rather than end
+ * it, go back to IDLE without waking anyone and let recovery start it again,
+ * once: failing again after that returns the error. Called with
+ * capture_lock held.
+ */
+static bool ft9201_capture_defer_locked(struct ft9201_device *dev)
+{
+	if (!dev->recovering || dev->capture_recovered) {
+		return false;
+	}
+
+	dev->capture_deferred = true;
+	return true;
+}
+
+/* End the capture if it is still in @state and wake whoever waits on it */
+static void ft9201_capture_finish(struct ft9201_device *dev, enum ft9201_capture_state state, int err)
+{
+	unsigned long flags;
+	bool put;
+
+	spin_lock_irqsave(&dev->capture_lock, flags);
+	if (dev->capture_state != state) {
+		spin_unlock_irqrestore(&dev->capture_lock, flags);
+		return;
+	}
+	if (err && ft9201_capture_defer_locked(dev)) {
+		put = ft9201_capture_idle_locked(dev);
+		ft9201_health_publish_locked(dev);
+		spin_unlock_irqrestore(&dev->capture_lock, flags);
+
+		if (put) {
+			usb_autopm_put_interface_async(dev->interface);
+		}
+		return;
+	}
+	put = ft9201_capture_idle_locked(dev);
+	dev->capture_err = err;
+	dev->capture_done_gen++;
+	trace_ft9201_capture_done(dev->interface->minor, 0, err,
+			ktime_to_ns(ktime_sub(ktime_get(), dev->start_time)));
+	if (err) {
+		dev->stats.errors++;
+		if (READ_ONCE(dev->streamers)) {
+			dev->stream_err = err;
+			dev->stream_err_gen++;
+		}
+	}
+	ft9201_auto_power_rearm_locked(dev);
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irqrestore(&dev->capture_lock, flags);
+
+	if (put) {
+		usb_autopm_put_interface_async(dev->interface);
+	}
+	wake_up_interruptible(&dev->bulk_in_wait);
+}
+
+/*
+ * The bulk-in ring delivered frame @seq, or failed with @err. The sensor
+ * may push the frame before the detect poll has noticed the finger, so a
+ * capture still in DETECT ends here as well.
+ */
+static void ft9201_capture_frame_done(struct ft9201_device *dev, u32 seq, int err)
+{
+	unsigned long flags;
+	bool put = false;
+	u64 ns;
+
+	spin_lock_irqsave(&dev->capture_lock, flags);
+	if (dev->capture_state != FT9201_CAPTURE_DETECT &&
+	    dev->capture_state != FT9201_CAPTURE_FRAME) {
+		/* a touch nobody waited for used up the arm */
+		if (dev->capture_state == FT9201_CAPTURE_IDLE && !err) {
+			dev->sensor_armed = false;
+			ft9201_auto_power_rearm_locked(dev);
+		}
+		spin_unlock_irqrestore(&dev->capture_lock, flags);
+		return;
+	}
+
+	if (err && ft9201_capture_defer_locked(dev)) {
+		put = ft9201_capture_idle_locked(dev);
+		cancel_delayed_work(&dev->capture_work);
+		goto out;
+	}
+
+	if (err) {
+		dev->stats.errors++;
+	} else {
+		if (dev->capture_state == FT9201_CAPTURE_FRAME) {
+			ns = ktime_to_ns(ktime_sub(ktime_get(), dev->detect_time));
+			dev->stats.detect_to_frame_ns += ns;
+			dev->stats.last_detect_to_frame_ns = ns;
+			ft9201_hist_add(&dev->stats.detect_to_frame_us, div_u64(ns, NSEC_PER_USEC));
+		}
+		ft9201_hist_add(&dev->stats.polls_per_capture, dev->stats.capture_polls);
+		dev->stats.captures++;
+	}
+	dev->capture_err = err;
+	dev->capture_seq = seq;
+	dev->capture_done_gen++;
+	trace_ft9201_capture_done(dev->interface->minor, seq, err,
+			ktime_to_ns(ktime_sub(ktime_get(), dev->start_time)));
+
+	if (READ_ONCE(dev->streamers) && !err) {
+		/* keep capturing, re-arming for every frame unless stream_arm_once */
+		dev->stream_armed = stream_arm_once || dev->arm_once_users;
+		ft9201_capture_begin_locked(dev);
+	} else {
+		if (err && READ_ONCE(dev->streamers)) {
+			dev->stream_err = err;
+			dev->stream_err_gen++;
+		}
+		put = ft9201_capture_idle_locked(dev);
+		cancel_delayed_work(&dev->capture_work);
+		ft9201_auto_power_rearm_locked(dev);
+	}
+out:
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irqrestore(&dev->capture_lock, flags);
+
+	if (put) {
+		usb_autopm_put_interface_async(dev->interface);
+	}
+}
+
+/* The arm sequence went through, start polling for a finger or, with auto power, wait for the frame */
+static void ft9201_capture_armed(struct ft9201_device *dev)
+{
+	unsigned long flags;
+	bool quiet;
+
+	spin_lock_irqsave(&dev->capture_lock, flags);
+	if (dev->capture_state == FT9201_CAPTURE_ARM) {
+		dev->capture_state = FT9201_CAPTURE_DETECT;
+		dev->arm_time = ktime_get();
+		dev->poll_interval_us = poll_min_us;
+		dev->stats.capture_polls = 0;
+		dev->auto_power_polling = false;
+		ft9201_health_publish_locked(dev);
+	}
+	quiet = dev->auto_power_users != 0;
+	spin_unlock_irqrestore(&dev->capture_lock, flags);
+
+	if (!quiet) {
+		ft9201_capture_queue(dev, usecs_to_jiffies(poll_min_us));
+	} else {
+		/* the work works out how long to wait for the frame */
+		ft9201_capture_queue(dev, 0);
+	}
+}
+
+/*
+ * The arm sequence finished with @err. A pre-arm goes back to IDLE leaving
+ * the sensor armed, unless a capture took it over meanwhile; a capture
+ * carries on polling for a finger. May run from urb completion.
+ */
+static void ft9201_arm_done(struct ft9201_device *dev, int err)
+{
+	enum ft9201_capture_state state;
+	unsigned long flags;
+	bool put = false;
+	u64 ns;
+
+	spin_lock_irqsave(&dev->capture_lock, flags);
+	dev->arm_pending = false;
+	state = dev->capture_state;
+	if (state == FT9201_CAPTURE_PREARM) {
+		put = ft9201_capture_idle_locked(dev);
+		if (!err) {
+			dev->sensor_armed = true;
+			if (dev->auto_rearm) {
+				dev->stats.auto_rearms++;
+			} else {
+				ns = ktime_to_ns(ktime_sub(ktime_get(), dev->resume_time));
+				dev->stats.resume_to_armed_ns += ns;
+				ft9201_hist_add(&dev->stats.resume_to_armed_us, div_u64(ns, NSEC_PER_USEC));
+			}
+		}
+		ft9201_health_publish_locked(dev);
+	}
+	dev->auto_rearm = false;
+	spin_unlock_irqrestore(&dev->capture_lock, flags);
+
+	if (put) {
+		usb_autopm_put_interface_async(dev->interface);
+	}
+
+	if (state == FT9201_CAPTURE_ARM) {
+		if (err) {
+			ft9201_capture_finish(dev, FT9201_CAPTURE_ARM, err);
+		} else {
+			ft9201_capture_armed(dev);
+		}
+	}
+}
+
+/*
+ * The gate dropped the frame that would have ended the capture. Re-arm
+ * and keep waiting for a usable one, the same way streaming continues.
+ */
+static void ft9201_capture_frame_gated(struct ft9201_device *dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->capture_lock, flags);
+	if (dev->capture_state == FT9201_CAPTURE_DETECT ||
+	    dev->capture_state == FT9201_CAPTURE_FRAME) {
+		dev->stream_armed = (stream_arm_once || dev->arm_once_users) && READ_ONCE(dev->streamers);
+		ft9201_capture_begin_locked(dev);
+		ft9201_health_publish_locked(dev);
+	}
+	spin_unlock_irqrestore(&dev->capture_lock, flags);
+}
+
+static void ft9201_detect_callback(struct urb *urb)
+{
+	struct ft9201_ctrl_urb *ctrl = urb->context;
+	struct ft9201_device *dev = ctrl->dev;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), ctrl->submit_time));
+	int status = urb->status;
+	unsigned long delay;
+	unsigned long flags;
+	bool timed_out = false;
+	bool finger;
+
+	/* killed by a timeout or a stop, which clean up themselves */
+	if (status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN) {
+		trace_ft9201_detect_poll(dev->interface->minor, dev->stats.detect_polls, false, 0, status, ns);
+		return;
+	}
+	if (status == 0 && urb->actual_length < 1) {
+		status = -EREMOTEIO;
+	}
+
+	spin_lock_irqsave(&dev->capture_lock, flags);
+	dev->detect_pending = false;
+
+	if (status) {
+		spin_unlock_irqrestore(&dev->capture_lock, flags);
+		trace_ft9201_detect_poll(dev->interface->minor, dev->stats.detect_polls, false, 0, status, ns);
+		ft9201_count_ctrl_error(dev, status);
+		dev_info(&dev->interface->dev, "Error sending data: %d\n", status);
+		ft9201_capture_finish(dev, FT9201_CAPTURE_DETECT, status);
+		return;
+	}
+
+	if (dev->capture_state != FT9201_CAPTURE_DETECT) {
+		/* the frame beat us to it */
+		spin_unlock_irqrestore(&dev->capture_lock, flags);
+		return;
+	}
+	dev->stats.detect_polls++;
+	dev->stats.capture_polls++;
+
+	finger = ctrl->data[0] != 0;
+	if (finger) {
+		if (dev->auto_power_polling) {
+			dev->stats.auto_power_polled++;
+		}
+		dev->capture_state = FT9201_CAPTURE_FRAME;
+		dev->detect_time = ktime_get();
+		dev->stats.arm_to_detect_ns += ktime_to_ns(ktime_sub(dev->detect_time, dev->arm_time));
+		ft9201_hist_add(&dev->stats.arm_to_detect_us, ktime_us_delta(dev->detect_time, dev->arm_time));
+		delay = msecs_to_jiffies(USB_READ_OP_TIMEOUT);
+	} else {
+		delay = usecs_to_jiffies(dev->poll_interval_us);
+		dev->poll_interval_us = min(dev->poll_interval_us * 2, max(poll_max_us, poll_min_us));
+		timed_out = detect_timeout_ms &&
+				ktime_ms_delta(ktime_get(), dev->arm_time) >= detect_timeout_ms;
+		if (timed_out) {
+			dev->stats.timeouts++;
+		}
+	}
+	trace_ft9201_detect_poll(dev->interface->minor, dev->stats.detect_polls, finger,
+			jiffies_to_usecs(delay), 0, ns);
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irqrestore(&dev->capture_lock, flags);
+
+	if (timed_out) {
+		ft9201_capture_finish(dev, FT9201_CAPTURE_DETECT, -ETIMEDOUT);
+	} else {
+		ft9201_capture_queue(dev, delay);
+	}
+}
+
+/* Read the finger-detect register, the work stands by as the timeout */
+static void ft9201_detect_start(struct ft9201_device *dev)
+{
+	struct ft9201_ctrl_urb *ctrl = &dev->detect_urb;
+	int retval = -ENODEV;
+
+	ft9201_capture_queue(dev, msecs_to_jiffies(USB_CONTROL_OP_TIMEOUT));
+
+	ctrl->submit_time = ktime_get();
+	usb_anchor_urb(ctrl->urb, &dev->ctrl_anchor);
+	if (!dev->disconnected) {
+		retval = usb_submit_urb(ctrl->urb, GFP_KERNEL);
+	}
+	if (retval) {
+		usb_unanchor_urb(ctrl->urb);
+
+		spin_lock_irq(&dev->capture_lock);
+		dev->detect_pending = false;
+		spin_unlock_irq(&dev->capture_lock);
+
+		ft9201_count_ctrl_error(dev, retval);
+		dev_info(&dev->interface->dev, "Error sending data: %d\n", retval);
+		ft9201_capture_finish(dev, FT9201_CAPTURE_DETECT, retval);
+	}
+}
+
+/*
+ * The work came round with a detect read still in flight. That is a timeout,
+ * unless the read was left over from an earlier capture and is still young.
+ */
+static void ft9201_detect_timeout(struct ft9201_device *dev)
+{
+	struct ft9201_ctrl_urb *ctrl = &dev->detect_urb;
+	s64 left = USB_CONTROL_OP_TIMEOUT - ktime_ms_delta(ktime_get(), ctrl->submit_time);
+	bool pending;
+
+	if (left > 0) {
+		/* its completion queues the next poll */
+		ft9201_capture_queue(dev, msecs_to_jiffies(left));
+		return;
+	}
+
+	usb_kill_anchored_urbs(&dev->ctrl_anchor);
+
+	spin_lock_irq(&dev->capture_lock);
+	pending = dev->detect_pending;
+	dev->detect_pending = false;
+	spin_unlock_irq(&dev->capture_lock);
+
+	if (pending) {
+		ft9201_count_ctrl_error(dev, -ETIMEDOUT);
+		dev_info(&dev->interface->dev, "Timed out reading the finger-detect register\n");
+		ft9201_capture_finish(dev, FT9201_CAPTURE_DETECT, -ETIMEDOUT);
+	}
+}
+
+/*
+ * With auto power nothing is polled, the work only ends a capture that
+ * waited detect_timeout_ms. That the armed sensor pushes a frame on a touch
+ * is an assumption, so after auto_power_grace_ms without one the capture
+ * goes back to polling the detect register; auto_power_fallbacks and
+ * auto_power_polled in debugfs tell how often that was needed.
+ */
+static void ft9201_auto_power_timeout(struct ft9201_device *dev)
+{
+	s64 waited = ktime_ms_delta(ktime_get(), dev->arm_time);
+	s64 left = S64_MAX;
+	bool fallback = false;
+
+	if (detect_timeout_ms) {
+		if (waited >= detect_timeout_ms) {
+			ft9201_capture_finish(dev, FT9201_CAPTURE_DETECT, -ETIMEDOUT);
+			return;
+		}
+		left = detect_timeout_ms - waited;
+	}
+
+	if (auto_power_grace_ms && waited >= auto_power_grace_ms) {
+		spin_lock_irq(&dev->capture_lock);
+		if (dev->capture_state == FT9201_CAPTURE_DETECT && !dev->auto_power_polling) {
+			dev->auto_power_polling = true;
+			dev->poll_interval_us = poll_min_us;
+			dev->stats.auto_power_fallbacks++;
+			fallback = true;
+		}
+		spin_unlock_irq(&dev->capture_lock);
+
+		if (fallback) {
+			dev_info_once(&dev->interface->dev,
+					"No frame %u ms after arming for auto power, polling for the finger\n",
+					auto_power_grace_ms);
+			ft9201_capture_queue(dev, 0);
+		}
+		return;
+	}
+	if (auto_power_grace_ms) {
+		left = min_t(s64, left, auto_power_grace_ms - waited);
+	}
+
+	if (left != S64_MAX) {
+		ft9201_capture_queue(dev, msecs_to_jiffies(left));
+	}
+}
+
+/*
+ * Capture state machine. The arm sequence is sent asynchronously, or not
+ * at all if resume already pre-armed the sensor or streaming armed it for
+ * the session, with this work standing by as its timeout. Then the
+ * finger-detect register is read the same way, starting at poll_min_us and
+ * backing off exponentially up to poll_max_us while no finger is present,
+ * for at most detect_timeout_ms. Once a finger is seen the work only serves
+ * as the frame timeout; the bulk-in completion ends the capture. With auto
+ * power the detect register is not polled unless no frame came within
+ * auto_power_grace_ms. No I/O
+ * blocks the work, so ft9201_capture_stop() only has to kill ctrl_anchor.
+ */
+static void ft9201_capture_work(struct work_struct *work)
+{
+	struct ft9201_device *dev = container_of(to_delayed_work(work), struct ft9201_device, capture_work);
+	enum ft9201_capture_state state;
+	bool pending;
+	bool armed;
+	bool quiet;
+
+	spin_lock_irq(&dev->capture_lock);
+	state = dev->capture_state;
+	spin_unlock_irq(&dev->capture_lock);
+
+	switch (state) {
+	case FT9201_CAPTURE_PREARM:
+	case FT9201_CAPTURE_ARM:
+		spin_lock_irq(&dev->capture_lock);
+		pending = dev->arm_pending;
+		armed = false;
+		if (!pending && dev->capture_state == FT9201_CAPTURE_ARM) {
+			armed = dev->sensor_armed || dev->stream_armed;
+			if (dev->sensor_armed) {
+				dev->stats.prearm_hits++;
+				ft9201_health_publish_locked(dev);
+			}
+			dev->sensor_armed = false;
+			dev->stream_armed = false;
+		}
+		spin_unlock_irq(&dev->capture_lock);
+
+		if (pending) {
+			ft9201_arm_timeout(dev);
+		} else if (armed) {
+			ft9201_capture_armed(dev);
+		} else {
+			ft9201_arm_start(dev);
+		}
+		break;
+
+	case FT9201_CAPTURE_DETECT:
+		spin_lock_irq(&dev->capture_lock);
+		pending = dev->detect_pending;
+		/* with auto power the frame reports the touch, the work is only a timeout */
+		quiet = !pending && dev->auto_power_users && !dev->auto_power_polling;
+		if (!quiet) {
+			dev->detect_pending = true;
+		}
+		spin_unlock_irq(&dev->capture_lock);
+
+		if (quiet) {
+			ft9201_auto_power_timeout(dev);
+		} else if (pending) {
+			ft9201_detect_timeout(dev);
+		} else {
+			ft9201_detect_start(dev);
+		}
+		break;
+
+	case FT9201_CAPTURE_FRAME:
+		spin_lock_irq(&dev->capture_lock);
+		dev->stats.timeouts++;
+		ft9201_health_publish_locked(dev);
+		spin_unlock_irq(&dev->capture_lock);
+		dev_err(&dev->interface->dev, "Timed out waiting for image data");
+		/* a sensor that saw the finger but sends nothing has stopped sending images */
+		ft9201_recover_schedule(dev, -ETIMEDOUT);
+		ft9201_capture_finish(dev, FT9201_CAPTURE_FRAME, -ETIMEDOUT);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Start a capture unless one is already running. The capture has finished
+ * once ft9201_capture_ready() sees the returned generation go by.
+ */
+static u32 ft9201_capture_start(struct ft9201_device *dev)
+{
+	bool keep_pm = false;
+	u32 gen;
+	int pm;
+	int ret;
+
+	/* resumes a suspended sensor; a running capture keeps it awake */
+	pm = usb_autopm_get_interface(dev->interface);
+	ret = pm;
+	if (ret == 0 && !READ_ONCE(dev->recovering)) {
+		/* transfers that failed were left idle */
+		ret = ft9201_start_in_urbs(dev, GFP_KERNEL);
+	}
+
+	spin_lock_irq(&dev->capture_lock);
+	gen = dev->capture_done_gen;
+	if (dev->capture_state == FT9201_CAPTURE_IDLE && dev->recovering) {
+		/* recovery starts it once the device is back */
+		dev->capture_deferred = true;
+	} else if (dev->capture_state == FT9201_CAPTURE_IDLE) {
+		if (ret < 0) {
+			/* failed before it began, reported like one that failed on the way */
+			dev->capture_err = ret;
+			dev->capture_done_gen++;
+			dev->stats.errors++;
+			if (READ_ONCE(dev->streamers)) {
+				dev->stream_err = ret;
+				dev->stream_err_gen++;
+			}
+		} else {
+			keep_pm = true;
+			dev->pm_held = true;
+			ft9201_capture_begin_locked(dev);
+		}
+	} else if (dev->capture_state == FT9201_CAPTURE_PREARM && ret == 0) {
+		/* pre-arming already holds a reference and has the arm sequence going */
+		ft9201_capture_begin_locked(dev);
+	}
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irq(&dev->capture_lock);
+
+	if (pm == 0 && !keep_pm) {
+		usb_autopm_put_interface(dev->interface);
+	}
+	if (ret < 0) {
+		wake_up_interruptible(&dev->bulk_in_wait);
+	}
+
+	return gen;
+}
+
+static bool ft9201_capture_ready(struct ft9201_device *dev, u32 gen)
+{
+	return READ_ONCE(dev->capture_done_gen) != gen;
+}
+
+/* Outcome of the most recent capture: an error, or the @seq of its frame */
+static int ft9201_capture_result(struct ft9201_device *dev, u32 *seq)
+{
+	int ret;
+
+	spin_lock_irq(&dev->capture_lock);
+	ret = dev->capture_err;
+	*seq = dev->capture_seq;
+	spin_unlock_irq(&dev->capture_lock);
+
+	return ret;
+}
+
+/* Arm the sensor and sleep until a frame lands in the ring, returning its @seq */
+static int ft9201_capture(struct ft9201_device *dev, u32 *seq)
+{
+	u32 gen;
+	int ret;
+
+	gen = ft9201_capture_start(dev);
+
+	atomic_inc(&dev->capture_waiters);
+	ret = wait_event_interruptible(dev->bulk_in_wait,
+			ft9201_capture_ready(dev, gen) || dev->disconnected);
+	if (ret < 0) {
+		ft9201_capture_abandon(dev, gen, NULL);
+		return ret;
+	}
+	atomic_dec(&dev->capture_waiters);
+	if (dev->disconnected) {
+		return -ENODEV;
+	}
+
+	return ft9201_capture_result(dev, seq);
+}
+
+static void ft9201_capture_stop(struct ft9201_device *dev, int err)
+{
+	bool put = false;
+
+	/* neither waits on a transfer timeout, the work never blocks on I/O */
+	cancel_delayed_work_sync(&dev->capture_work);
+	usb_kill_anchored_urbs(&dev->ctrl_anchor);
+
+	spin_lock_irq(&dev->capture_lock);
+	dev->arm_pending = false;
+	dev->detect_pending = false;
+	if (dev->capture_state == FT9201_CAPTURE_PREARM) {
+		put = ft9201_capture_idle_locked(dev);
+	} else if (dev->capture_state != FT9201_CAPTURE_IDLE || dev->capture_deferred) {
+		put = ft9201_capture_idle_locked(dev);
+		dev->capture_err = err;
+		dev->capture_done_gen++;
+	}
+	dev->capture_deferred = false;
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irq(&dev->capture_lock);
+
+	if (put) {
+		usb_autopm_put_interface_async(dev->interface);
+	}
+	wake_up_interruptible(&dev->bulk_in_wait);
+}
+
+/*
+ * Whether a reader other than @except joined capture @gen from poll() and
+ * will collect it, without sleeping on it. Those are not in capture_waiters.
+ */
+static bool ft9201_capture_polled(struct ft9201_device *dev, u32 gen, struct ft9201_reader *except)
+{
+	struct ft9201_reader *reader;
+	bool polled = false;
+
+	spin_lock_irq(&dev->ring_lock);
+	list_for_each_entry(reader, &dev->readers, node) {
+		if (reader != except && READ_ONCE(reader->read_waiting) &&
+		    READ_ONCE(reader->read_gen) == gen) {
+			polled = true;
+			break;
+		}
+	}
+	spin_unlock_irq(&dev->ring_lock);
+
+	return polled;
+}
+
+/*
+ * A sleeper on capture @gen was interrupted. The last one to give up
+ * cancels it, killing its transfers, unless streaming readers still want
+ * frames or readers polling for it still do. @except is the interrupted
+ * sleeper's own file, NULL if it has none waiting on the capture.
+ */
+static void ft9201_capture_abandon(struct ft9201_device *dev, u32 gen, struct ft9201_reader *except)
+{
+	if (!atomic_dec_and_test(&dev->capture_waiters) || READ_ONCE(dev->streamers)) {
+		return;
+	}
+	/* ended meanwhile, or wanted by someone else */
+	if (ft9201_capture_ready(dev, gen) || ft9201_capture_polled(dev, gen, except)) {
+		return;
+	}
+
+	ft9201_capture_stop(dev, -EINTR);
+}
+
+/*
+ * Error recovery. A transfer error other than an unlink, a control timeout
+ * or a frame that never came after the finger was seen starts it, unless it
+ * is running already. Captures that fail meanwhile, or are asked for, are
+ * held back and started again once the device is back, so readers only see
+ * the delay. Each attempt stops all I/O, clears a halt on the bulk-in
+ * endpoint and checks that the sensor answers; after recover_retries of
+ * those, recover_backoff_ms apart and doubling, the device is reset and set
+ * up again. If that fails too the held back captures get the error.
+ */
+static void ft9201_recover_schedule(struct ft9201_device *dev, int err)
+{
+	unsigned long flags;
+	bool start;
+
+	/* unlinks and a device that is gone are nothing to recover from */
+	if (!recover || err == -ENOENT || err == -ECONNRESET || err == -ESHUTDOWN ||
+	    err == -ENODEV || err == -EPERM) {
+		return;
+	}
+
+	spin_lock_irqsave(&dev->capture_lock, flags);
+	start = !dev->recovering && !dev->disconnected;
+	if (start) {
+		dev->recovering = true;
+		dev->recover_attempt = 0;
+		dev->recover_start = ktime_get();
+		ft9201_health_publish_locked(dev);
+	}
+	spin_unlock_irqrestore(&dev->capture_lock, flags);
+
+	if (start) {
+		dev_warn(&dev->interface->dev, "Recovering from error %d", err);
+		queue_delayed_work(dev->capture_wq, &dev->recover_work, 0);
+	}
+}
+
+/* Stop all I/O for recovery or a reset, holding back a capture in progress */
+static void ft9201_recover_quiesce(struct ft9201_device *dev)
+{
+	bool put = false;
+
+	/* on capture_wq the capture work can be pending but never running */
+	cancel_delayed_work_sync(&dev->capture_work);
+	usb_kill_anchored_urbs(&dev->ctrl_anchor);
+	ft9201_stop_in_urbs(dev);
+
+	spin_lock_irq(&dev->capture_lock);
+	dev->arm_pending = false;
+	dev->detect_pending = false;
+	dev->sensor_armed = false;
+	if (dev->capture_state != FT9201_CAPTURE_IDLE) {
+		if (dev->capture_state != FT9201_CAPTURE_PREARM) {
+			dev->capture_deferred = true;
+		}
+		put = ft9201_capture_idle_locked(dev);
+	}
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irq(&dev->capture_lock);
+
+	if (put) {
+		usb_autopm_put_interface_async(dev->interface);
+	}
+}
+
+static int ft9201_recover_reset(struct ft9201_device *dev)
+{
+	int ret;
+
+	/* fails rather than waits while the interface is being unbound */
+	ret = usb_lock_device_for_reset(dev->udev, dev->interface);
+	if (ret < 0) {
+		return ret;
+	}
+	/* ft9201_pre_reset() and ft9201_post_reset() run in here */
+	ret = usb_reset_device(dev->udev);
+	usb_unlock_device(dev->udev);
+
+	return ret;
+}
+
+/*
+ * Check that the sensor answers, with the same 4 byte finger-detect read
+ * the capture path relies on rather than a guessed register layout.
+ */
+static int ft9201_recover_ping(struct ft9201_device *dev)
+{
+	u8 detect[4];
+
+	return usb_control_msg_recv(dev->udev, 0, FT9201_REQ_READ_REGISTERS,
+			USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			0, FT9201_REG_FINGER_DETECT, detect, sizeof(detect),
+			USB_CONTROL_OP_TIMEOUT, GFP_KERNEL);
+}
+
+/* Recovery is over, @err says whether the device came back */
+static void ft9201_recover_done(struct ft9201_device *dev, int err, bool reset)
+{
+	bool pm = dev->recover_pm;
+	bool restart;
+	u64 ns;
+
+	dev->recover_pm = false;
+
+	spin_lock_irq(&dev->capture_lock);
+	dev->recovering = false;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), dev->recover_start));
+	if (reset) {
+		dev->stats.recover_resets++;
+	}
+	if (err) {
+		dev->stats.recover_failures++;
+	} else {
+		dev->stats.recoveries++;
+		dev->stats.recover_ns += ns;
+		dev->stats.last_recover_ns = ns;
+		ft9201_hist_add(&dev->stats.recover_us, div_u64(ns, NSEC_PER_USEC));
+	}
+
+	/* what was held back, and streaming, carries on */
+	restart = (dev->capture_deferred || READ_ONCE(dev->streamers)) &&
+			dev->capture_state == FT9201_CAPTURE_IDLE;
+	if (restart && !err && !dev->disconnected) {
+		/* recovery's reference keeps the device awake */
+		usb_autopm_get_interface_no_resume(dev->interface);
+		dev->pm_held = true;
+		ft9201_capture_begin_locked(dev);
+		dev->capture_recovered = true;
+	} else if (restart) {
+		dev->capture_err = err ? err : -ENODEV;
+		dev->capture_done_gen++;
+		dev->stats.errors++;
+		if (READ_ONCE(dev->streamers)) {
+			dev->stream_err = dev->capture_err;
+			dev->stream_err_gen++;
+		}
+	}
+	dev->capture_deferred = false;
+	ft9201_auto_power_rearm_locked(dev);
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irq(&dev->capture_lock);
+
+	/* unbinding dropped it already */
+	if (pm && !dev->disconnected) {
+		usb_autopm_put_interface(dev->interface);
+	}
+	wake_up_interruptible(&dev->bulk_in_wait);
+}
+
+/*
+ * One recovery attempt. Runs on capture_wq, so the state machine stays out
+ * of its way, and requeues itself for the next attempt.
+ */
+static void ft9201_recover_work(struct work_struct *work)
+{
+	struct ft9201_device *dev = container_of(to_delayed_work(work), struct ft9201_device, recover_work);
+	unsigned int attempt = dev->recover_attempt;
+	unsigned int backoff;
+	bool reinit;
+	bool reset;
+	int ret = 0;
+
+	spin_lock_irq(&dev->capture_lock);
+	if (!dev->recovering) {
+		/* queued again by a reset that an earlier run finished off */
+		spin_unlock_irq(&dev->capture_lock);
+		return;
+	}
+	reinit = dev->recover_reinit;
+	dev->recover_reinit = false;
+	spin_unlock_irq(&dev->capture_lock);
+
+	if (dev->disconnected) {
+		ft9201_recover_done(dev, -ENODEV, false);
+		return;
+	}
+
+	/* held across attempts, so the device is not suspended in between */
+	if (!dev->recover_pm) {
+		ret = usb_autopm_get_interface(dev->interface);
+		dev->recover_pm = ret == 0;
+	}
+
+	reset = !reinit && attempt >= recover_retries;
+	if (ret == 0) {
+		ft9201_recover_quiesce(dev);
+		if (reset) {
+			ret = ft9201_recover_reset(dev);
+		} else if (!reinit) {
+			ret = usb_clear_halt(dev->udev, usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr));
+		}
+	}
+	if (ret == 0) {
+		ret = ft9201_recover_ping(dev);
+	}
+	if (ret == 0) {
+		ret = ft9201_initialize(dev);
+	}
+	if (ret == 0) {
+		ret = ft9201_start_in_urbs(dev, GFP_KERNEL);
+	}
+	trace_ft9201_recover(dev->interface->minor, attempt, reset, ret);
+
+	if (ret == 0) {
+		dev_info(&dev->interface->dev, "Recovered after %u attempts%s", attempt + 1,
+				reset ? ", with a reset" : "");
+		ft9201_recover_done(dev, 0, reset);
+		return;
+	}
+	if (reset || dev->disconnected) {
+		dev_err(&dev->interface->dev, "Could not recover, replug the device: %d", ret);
+		ft9201_recover_done(dev, ret, reset);
+		return;
+	}
+
+	dev->recover_attempt = attempt + 1;
+	backoff = min_t(unsigned int, recover_backoff_ms << min(attempt, 10u), FT9201_RECOVER_BACKOFF_MAX_MS);
+	queue_delayed_work(dev->capture_wq, &dev->recover_work, msecs_to_jiffies(backoff));
+}
+
+/* A capture error broadcast to streaming readers since this one last looked */
+static int ft9201_stream_take_error(struct ft9201_reader *reader)
+{
+	struct ft9201_device *dev = reader->dev;
+	int err = 0;
+
+	spin_lock_irq(&dev->capture_lock);
+	if (reader->stream_err_gen != dev->stream_err_gen) {
+		reader->stream_err_gen = dev->stream_err_gen;
+		err = dev->stream_err;
+	}
+	spin_unlock_irq(&dev->capture_lock);
+
+	return err;
+}
+
+static bool ft9201_stream_pending(struct ft9201_reader *reader)
+{
+	return !kfifo_is_empty(&reader->queue) ||
+			reader->stream_err_gen != READ_ONCE(reader->dev->stream_err_gen);
+}
+
+static bool ft9201_stream_ready(struct ft9201_reader *reader)
+{
+	return ft9201_stream_pending(reader) || !READ_ONCE(reader->streaming) ||
+			reader->dev->disconnected;
+}
+
+/* Drop this reader's queue and its pins. Called with reader->lock held. */
+static void ft9201_stream_stop(struct ft9201_reader *reader)
+{
+	struct ft9201_device *dev = reader->dev;
+	struct ft9201_frame frame;
+
+	if (!reader->streaming) {
+		return;
+	}
+
+	/* the last streamer leaving lets the state machine go idle after this frame */
+	spin_lock_irq(&dev->ring_lock);
+	reader->streaming = false;
+	dev->streamers--;
+	while (kfifo_get(&reader->queue, &frame)) {
+		ft9201_slot_unpin(dev, frame.slot);
+	}
+	spin_unlock_irq(&dev->ring_lock);
+
+	/* a later one-shot read() starts clean instead of at EOF */
+	ft9201_release_frame(reader);
+	reader->img_in_copied = 0;
+	reader->img_in_filled = 0;
+	reader->timetoexit = false;
+
+	kfifo_free(&reader->queue);
+}
+
+/* Give the reader a queue and start capturing into it. Called with reader->lock held. */
+static int ft9201_stream_start(struct ft9201_reader *reader, const struct ft9201_stream *cfg)
+{
+	struct ft9201_device *dev = reader->dev;
+	/* leave room for the urbs in flight, the reader's frame and one spare */
+	unsigned int max_depth = ft9201_pin_limit(dev) - 2;
+	unsigned int depth;
+	int ret;
+
+	depth = cfg->depth ? cfg->depth : max_depth;
+	depth = rounddown_pow_of_two(clamp(depth, 1u, max_depth));
+	ret = kfifo_alloc(&reader->queue, depth, GFP_KERNEL);
+	if (ret < 0) {
+		return ret;
+	}
+
+	spin_lock_irq(&dev->capture_lock);
+	reader->stream_err_gen = dev->stream_err_gen;
+	spin_unlock_irq(&dev->capture_lock);
+
+	spin_lock_irq(&dev->ring_lock);
+	reader->stream_overflow = cfg->overflow;
+	reader->streaming = true;
+	dev->streamers++;
+	spin_unlock_irq(&dev->ring_lock);
+
+	dev_dbg(&dev->interface->dev, "Streaming with a %u frame queue", depth);
+	ft9201_capture_start(dev);
+
+	return 0;
+}
+
+static int ft9201_set_streaming(struct ft9201_reader *reader, const struct ft9201_stream *cfg)
+{
+	struct ft9201_device *dev = reader->dev;
+	int ret;
+
+	if (cfg->overflow > FT9201_STREAM_DROP_NEWEST) {
+		return -EINVAL;
+	}
+
+	ret = mutex_lock_interruptible(&reader->lock);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (dev->disconnected) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	ft9201_stream_stop(reader);
+	if (cfg->enable) {
+		ret = ft9201_stream_start(reader, cfg);
+	}
+
+out:
+	mutex_unlock(&reader->lock);
+	return ret;
+}
+
+/* The reader's auto power reference goes. Called with reader->lock held. */
+static void ft9201_auto_power_off(struct ft9201_reader *reader)
+{
+	struct ft9201_device *dev = reader->dev;
+	bool disarm = false;
+	bool last;
+
+	reader->auto_power = false;
+
+	spin_lock_irq(&dev->capture_lock);
+	last = --dev->auto_power_users == 0;
+	if (last && dev->capture_state == FT9201_CAPTURE_IDLE && dev->sensor_armed) {
+		dev->sensor_armed = false;
+		disarm = true;
+	}
+	if (last && dev->capture_state == FT9201_CAPTURE_DETECT) {
+		/* a capture waiting on the frame alone goes back to polling */
+		ft9201_capture_queue(dev, 0);
+	}
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irq(&dev->capture_lock);
+
+	if (dev->disconnected) {
+		/* unbinding dropped the reference already */
+		return;
+	}
+	if (disarm) {
+		ft9201_ic_sensor_mode_exit(dev);
+	}
+	usb_autopm_put_interface(dev->interface);
+}
+
+/*
+ * FT9201_IOCTL_REQ_SET_AUTO_POWER: keep the sensor armed in its low-power
+ * mode between captures instead of polling it, so a touch is reported by
+ * the frame it pushes. Holds the device out of autosuspend while enabled,
+ * the bulk-in urbs have to stay queued to see that frame.
+ */
+static int ft9201_set_auto_power(struct ft9201_reader *reader, bool enable)
+{
+	struct ft9201_device *dev = reader->dev;
+	int ret;
+
+	ret = mutex_lock_interruptible(&reader->lock);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (dev->disconnected) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if (!enable) {
+		if (reader->auto_power) {
+			ft9201_auto_power_off(reader);
+		}
+		goto out;
+	}
+	if (reader->auto_power) {
+		goto out;
+	}
+
+	ret = usb_autopm_get_interface(dev->interface);
+	if (ret < 0) {
+		goto out;
+	}
+	/* recovery restarts the ring, and re-arms once it is done */
+	if (!READ_ONCE(dev->recovering)) {
+		ret = ft9201_start_in_urbs(dev, GFP_KERNEL);
+		if (ret < 0) {
+			usb_autopm_put_interface(dev->interface);
+			goto out;
+		}
+	}
+
+	reader->auto_power = true;
+	spin_lock_irq(&dev->capture_lock);
+	dev->auto_power_users++;
+	ft9201_auto_power_rearm_locked(dev);
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irq(&dev->capture_lock);
+
+out:
+	mutex_unlock(&reader->lock);
+	return ret;
+}
+
+static void ft9201_get_reader_stats(struct ft9201_reader *reader, struct ft9201_reader_stats *stats)
+{
+	struct ft9201_device *dev = reader->dev;
+
+	spin_lock_irq(&dev->ring_lock);
+	*stats = reader->stats;
+	stats->queued = reader->streaming ? kfifo_len(&reader->queue) : 0;
+	spin_unlock_irq(&dev->ring_lock);
+}
+
+/*
+ * Load the oldest queued frame; its queue pin becomes the reader's pin.
+ * Returns 1 when a frame is loaded, 0 when the queue is empty.
+ */
+static int ft9201_stream_next(struct ft9201_reader *reader)
+{
+	struct ft9201_device *dev = reader->dev;
+	struct ft9201_frame frame;
+	int got;
+	int err;
+
+	spin_lock_irq(&dev->ring_lock);
+	got = kfifo_get(&reader->queue, &frame);
+	spin_unlock_irq(&dev->ring_lock);
+
+	if (got) {
+		ft9201_load_frame(reader, &frame);
+		reader->timetoexit = false;
+		return 1;
+	}
+
+	err = ft9201_stream_take_error(reader);
+	if (err) {
+		return err;
+	}
+
+	/* an error left the state machine idle, pick it back up */
+	ft9201_capture_start(dev);
+
+	return 0;
+}
+
+static int has_data_remaining(struct ft9201_reader *reader)
+{
+	if ((reader->img_in_copied == 5120) && (reader->img_in_filled == 5120)) {
+		reader->timetoexit = true;
+	}
+	return reader->img_in_copied < reader->img_in_filled;
+}
+
+/*
+ * Copy out of the pinned ring slot into whatever @to describes: user
+ * memory for read()/readv(), pipe pages for splice(), registered buffers
+ * for io_uring. Short copies are returned as such.
+ */
+static ssize_t send_read_data(struct ft9201_reader *reader, struct iov_iter *to)
+{
+	struct ft9201_device *dev = reader->dev;
+	size_t remaining = reader->img_in_filled - reader->img_in_copied;
+	size_t to_copy = remaining;
+	size_t copied;
+	if (to_copy > iov_iter_count(to)) {
+		to_copy = iov_iter_count(to);
+	}
+
+	if (reader->img_in_copied + to_copy > dev->img_in_size) {
+		dev_info(&dev->interface->dev, "error img_in_copied + to_copy > dev->img_in_size");
+		return -EINVAL;
+	}
+
+	copied = copy_to_iter(reader->read_img_data + reader->img_in_copied, to_copy, to);
+	if (copied == 0 && to_copy != 0) {
+		trace_ft9201_copy_to_user(dev->interface->minor, reader->read_frame.seq,
+				reader->img_in_copied, to_copy, -EFAULT);
+		dev_info(&dev->interface->dev, "error copy_to_user");
+		return -EFAULT;
+	}
+	trace_ft9201_copy_to_user(dev->interface->minor, reader->read_frame.seq,
+			reader->img_in_copied, copied, 0);
+	reader->img_in_copied += copied;
+	if (reader->img_in_copied == reader->img_in_filled) {
+		ft9201_release_frame(reader);
+	}
+	return (ssize_t)copied;
+}
+
+/*
+ * Start a capture for read()/poll() unless one is outstanding, and load its
+ * frame once it has finished. Readers that wait at the same time share the
+ * capture, each pinning the frame for itself. Returns 1 when a frame is
+ * ready to copy out, 0 while the capture is still running. Called with
+ * reader->lock held.
+ */
+static int ft9201_read_collect(struct ft9201_reader *reader)
+{
+	struct ft9201_device *dev = reader->dev;
+	u32 seq;
+	int ret;
+
+	if (!reader->read_waiting) {
+		reader->read_gen = ft9201_capture_start(dev);
+		reader->read_waiting = true;
+	}
+
+	if (!ft9201_capture_ready(dev, reader->read_gen)) {
+		return 0;
+	}
+	reader->read_waiting = false;
+
+	ret = ft9201_capture_result(dev, &seq);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = ft9201_read_image(reader, seq);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return 1;
+}
+
+/*
+ * Load the next frame for this reader: the oldest queued one while
+ * streaming, otherwise the result of a capture shared with any other
+ * reader waiting at the same time. Sleeps unless @nonblock. Called with
+ * reader->lock held, which is dropped while sleeping and always held again
+ * on return.
+ */
+static int ft9201_frame_wait(struct ft9201_reader *reader, bool nonblock)
+{
+	struct ft9201_device *dev = reader->dev;
+	bool streaming;
+	u32 gen;
+	int ret;
+
+	while (true) {
+		if (dev->disconnected) {
+			return -ENODEV;
+		}
+
+		if (reader->streaming) {
+			ret = ft9201_stream_next(reader);
+		} else {
+			ret = ft9201_read_collect(reader);
+		}
+		if (ret != 0) {
+			return ret < 0 ? ret : 0;
+		}
+
+		if (nonblock) {
+			return -EAGAIN;
+		}
+
+		/* don't hold the lock across the capture, poll() needs it */
+		gen = reader->read_gen;
+		streaming = reader->streaming;
+		mutex_unlock(&reader->lock);
+
+		if (streaming) {
+			ret = wait_event_interruptible(dev->bulk_in_wait, ft9201_stream_ready(reader));
+		} else {
+			atomic_inc(&dev->capture_waiters);
+			ret = wait_event_interruptible(dev->bulk_in_wait,
+					ft9201_capture_ready(dev, gen) || dev->disconnected);
+			if (ret < 0) {
+				ft9201_capture_abandon(dev, gen, reader);
+			} else {
+				atomic_dec(&dev->capture_waiters);
+			}
+		}
+
+		mutex_lock(&reader->lock);
+		if (ret < 0) {
+			/* the capture may be gone, the next read starts a new one */
+			if (!streaming) {
+				reader->read_waiting = false;
+			}
+			return ret;
+		}
+	}
+}
+
+/*
+ * read(), readv(), splice() (through copy_splice_read) and io_uring all
+ * land here. IOCB_NOWAIT is treated like O_NONBLOCK.
+ */
+static ssize_t ft9201_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *fp = iocb->ki_filp;
+	struct ft9201_reader *reader = fp->private_data;
+	struct ft9201_device *dev;
+	bool nonblock = (fp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	ssize_t ret;
+
+	if (reader == NULL) {
+		pr_err("device is null\n");
+		return 0;
+	}
+	dev = reader->dev;
+
+	/* only this file's cursor is locked, other readers carry on */
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&reader->lock)) {
+			return -EAGAIN;
+		}
+	} else {
+		ret = mutex_lock_interruptible(&reader->lock);
+		if (ret < 0) {
+			pr_info("Interrupted while waiting on IO mutex");
+			return ret;
+		}
+	}
+
+	while (true) {
+		if (dev->disconnected) {
+			ret = -ENODEV;
+			break;
+		}
+
+		if (has_data_remaining(reader)) {
+			ret = send_read_data(reader, to);
+			break;
+		}
+
+		if (!reader->streaming && reader->timetoexit == true) {
+			reader->timetoexit = false;
+			pr_debug("Done reading fingerprint closing");
+			ret = 0;
+			break;
+		}
+
+		ret = ft9201_frame_wait(reader, nonblock);
+		if (ret < 0) {
+			break;
+		}
+	}
+
+	mutex_unlock(&reader->lock);
+	return ret;
+}
+
+/* FT9201_IOCTL_REQ_GET_FRAME: a whole frame and its descriptor in one call */
+static int ft9201_get_frame(struct ft9201_reader *reader, struct ft9201_get_frame *req, bool nonblock)
+{
+	struct ft9201_device *dev = reader->dev;
+	struct ft9201_frame *frame = &reader->read_frame;
+	int ret;
+
+	ret = mutex_lock_interruptible(&reader->lock);
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* start from a fresh frame, not whatever read() left behind */
+	ft9201_release_frame(reader);
+	reader->img_in_copied = 0;
+	reader->img_in_filled = 0;
+	reader->timetoexit = false;
+
+	ret = ft9201_frame_wait(reader, nonblock);
+	if (ret < 0) {
+		goto out;
+	}
+
+	memset(&req->desc, 0, sizeof(req->desc));
+	req->desc.version = FT9201_FRAME_DESC_VERSION;
+	req->desc.size = sizeof(req->desc);
+	req->desc.seq = frame->seq;
+	req->desc.len = frame->len;
+	req->desc.width = FT9201_IMG_WIDTH;
+	req->desc.height = FT9201_IMG_HEIGHT;
+	req->desc.detect_polls = frame->detect_polls;
+	req->desc.timestamp_ns = frame->timestamp_ns;
+	req->desc.transfer_ns = frame->transfer_ns;
+	req->desc.flags = frame->flags;
+	req->desc.mean = frame->mean;
+	req->desc.variance = frame->variance;
+	req->desc.coverage = frame->coverage;
+	req->desc.hash = frame->hash;
+
+	if (req->buf_len < frame->len) {
+		ret = -ENOSPC;
+	} else if (copy_to_user(u64_to_user_ptr(req->buf), reader->read_img_data, frame->len)) {
+		ret = -EFAULT;
+	}
+	trace_ft9201_copy_to_user(dev->interface->minor, frame->seq, 0, frame->len, ret);
+
+	/* the frame is consumed either way, read() continues with the next one */
+	ft9201_release_frame(reader);
+	reader->img_in_filled = 0;
+
+out:
+	mutex_unlock(&reader->lock);
+	return ret;
+}
+
+static size_t ft9201_multi_size(const struct ft9201_multi_capture *req)
+{
+	switch (req->mode) {
+	case FT9201_ACCUM_NONE:
+		return (size_t)req->frames * FT9201_IMG_SIZE;
+	case FT9201_ACCUM_SUM:
+		return FT9201_IMG_SIZE * sizeof(u32);
+	default:
+		return FT9201_IMG_SIZE;
+	}
+}
+
+/* Fold the reader's loaded frame into @acc, or copy it out as frame @i */
+static int ft9201_multi_add(struct ft9201_reader *reader, struct ft9201_multi_capture *req,
+		u32 *acc, unsigned int i)
+{
+	const unsigned char *data = reader->read_img_data;
+	unsigned int p;
+
+	switch (req->mode) {
+	case FT9201_ACCUM_NONE:
+		if (copy_to_user(u64_to_user_ptr(req->buf) + (size_t)i * FT9201_IMG_SIZE,
+				data, FT9201_IMG_SIZE)) {
+			return -EFAULT;
+		}
+		break;
+	case FT9201_ACCUM_MAX:
+		for (p = 0; p < FT9201_IMG_SIZE; p++) {
+			acc[p] = max_t(u32, acc[p], data[p]);
+		}
+		break;
+	default:
+		for (p = 0; p < FT9201_IMG_SIZE; p++) {
+			acc[p] += data[p];
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static int ft9201_multi_copy_out(struct ft9201_multi_capture *req, u32 *acc)
+{
+	unsigned char *img;
+	unsigned int p;
+	int ret = 0;
+
+	if (req->mode == FT9201_ACCUM_SUM) {
+		return copy_to_user(u64_to_user_ptr(req->buf), acc, FT9201_IMG_SIZE * sizeof(u32)) ?
+				-EFAULT : 0;
+	}
+
+	/* mean and max both fit a byte, narrow in place */
+	img = (unsigned char *)acc;
+	for (p = 0; p < FT9201_IMG_SIZE; p++) {
+		img[p] = req->mode == FT9201_ACCUM_MEAN ?
+				DIV_ROUND_CLOSEST(acc[p], req->frames) : acc[p];
+	}
+	if (copy_to_user(u64_to_user_ptr(req->buf), img, FT9201_IMG_SIZE)) {
+		ret = -EFAULT;
+	}
+
+	return ret;
+}
+
+/*
+ * FT9201_IOCTL_REQ_CAPTURE_MULTI: a private streaming session on this file
+ * that lasts for req->frames frames. The frames are accumulated straight
+ * out of their ring slots, so only the result crosses into userspace.
+ */
+static int ft9201_multi_capture(struct ft9201_reader *reader, struct ft9201_multi_capture *req)
+{
+	struct ft9201_device *dev = reader->dev;
+	struct ft9201_stream cfg = {
+		.enable = 1,
+		/* the oldest frames are the consecutive ones, keep them */
+		.overflow = FT9201_STREAM_DROP_NEWEST,
+	};
+	bool arm_once = req->flags & FT9201_MULTI_ARM_ONCE;
+	ktime_t start = ktime_get();
+	u32 *acc = NULL;
+	unsigned int i;
+	int ret;
+
+	if (req->frames == 0 || req->frames > FT9201_MULTI_MAX_FRAMES ||
+	    req->mode > FT9201_ACCUM_MAX || (req->flags & ~FT9201_MULTI_ARM_ONCE)) {
+		return -EINVAL;
+	}
+	if (req->buf_len < ft9201_multi_size(req)) {
+		return -ENOSPC;
+	}
+
+	if (req->mode != FT9201_ACCUM_NONE) {
+		acc = kvcalloc(FT9201_IMG_SIZE, sizeof(*acc), GFP_KERNEL);
+		if (acc == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	ret = mutex_lock_interruptible(&reader->lock);
+	if (ret < 0) {
+		goto out_free;
+	}
+
+	if (dev->disconnected) {
+		ret = -ENODEV;
+		goto out_unlock;
+	}
+	if (reader->streaming) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+
+	/* the session starts on a fresh frame, not whatever read() left behind */
+	ft9201_release_frame(reader);
+	reader->img_in_copied = 0;
+	reader->img_in_filled = 0;
+	reader->timetoexit = false;
+
+	if (arm_once) {
+		spin_lock_irq(&dev->capture_lock);
+		dev->arm_once_users++;
+		spin_unlock_irq(&dev->capture_lock);
+	}
+
+	ret = ft9201_stream_start(reader, &cfg);
+	if (ret < 0) {
+		goto out_arm;
+	}
+
+	for (i = 0; i < req->frames; i++) {
+		ret = ft9201_frame_wait(reader, false);
+		if (ret < 0) {
+			break;
+		}
+
+		if (i == 0) {
+			req->first_seq = reader->read_frame.seq;
+		}
+		req->last_seq = reader->read_frame.seq;
+
+		ret = ft9201_multi_add(reader, req, acc, i);
+		ft9201_release_frame(reader);
+		reader->img_in_filled = 0;
+		if (ret < 0) {
+			break;
+		}
+	}
+	req->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	ft9201_stream_stop(reader);
+
+	if (ret == 0 && acc != NULL) {
+		ret = ft9201_multi_copy_out(req, acc);
+	}
+
+out_arm:
+	if (arm_once) {
+		spin_lock_irq(&dev->capture_lock);
+		dev->arm_once_users--;
+		spin_unlock_irq(&dev->capture_lock);
+	}
+out_unlock:
+	mutex_unlock(&reader->lock);
+out_free:
+	kvfree(acc);
+	return ret;
+}
+
+/*
+ * Sensors used together, e.g. one per finger, share a group. A group
+ * capture resumes all of them first and only then starts their captures
+ * back to back, so each arm sequence goes out from its own workqueue at
+ * about the same time. Frames are timestamped on one clock at transfer
+ * completion and the spread between them is the skew.
+ */
+struct ft9201_group_stats {
+	u64 captures;			/* group captures that got a frame from every member */
+	u64 partial;			/* ones where some member failed */
+	u64 skew_ns;			/* cumulative over complete captures */
+	u64 max_skew_ns;
+	u64 trigger_ns;			/* cumulative first to last capture started */
+	struct ft9201_hist skew_us;
+};
+
+/* every bound sensor by minor; the list, the group fields and the stats */
+static LIST_HEAD(ft9201_devices);
+static DEFINE_MUTEX(ft9201_devices_lock);
+static struct ft9201_group_stats ft9201_group_stats;
+
+static void ft9201_devices_add(struct ft9201_device *dev)
+{
+	struct ft9201_device *pos;
+
+	mutex_lock(&ft9201_devices_lock);
+	list_for_each_entry(pos, &ft9201_devices, device_node) {
+		if (pos->interface->minor > dev->interface->minor) {
+			break;
+		}
+	}
+	list_add_tail(&dev->device_node, &pos->device_node);
+	mutex_unlock(&ft9201_devices_lock);
+}
+
+static void ft9201_devices_del(struct ft9201_device *dev)
+{
+	mutex_lock(&ft9201_devices_lock);
+	list_del(&dev->device_node);
+	mutex_unlock(&ft9201_devices_lock);
+}
+
+/* Take a reference on every connected member of @dev's group, in minor order */
+static unsigned int ft9201_group_get(struct ft9201_device *dev, struct ft9201_device **members)
+{
+	struct ft9201_device *pos;
+	unsigned int n = 0;
+
+	mutex_lock(&ft9201_devices_lock);
+	if (dev->group == 0) {
+		goto out;
+	}
+	list_for_each_entry(pos, &ft9201_devices, device_node) {
+		if (pos->group != dev->group || pos->disconnected) {
+			continue;
+		}
+		if (n == FT9201_GROUP_MAX_DEVICES) {
+			dev_warn(&dev->interface->dev, "Group %u has more than %u sensors", dev->group, n);
+			break;
 		}
+		kref_get(&pos->kref);
+		members[n++] = pos;
+	}
+out:
+	mutex_unlock(&ft9201_devices_lock);
+
+	return n;
+}
+
+/* Copy out the frame of a member's finished capture */
+static int ft9201_group_collect(struct ft9201_device *dev, struct ft9201_group_member *member,
+		void __user *buf)
+{
+	struct ft9201_frame frame;
+	int ret;
+
+	ret = ft9201_ring_get(dev, member->seq, &frame);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (frame.len != FT9201_IMG_SIZE) {
+		ret = -EIO;
+	} else if (copy_to_user(buf, ft9201_ring_frame(dev, frame.slot), FT9201_IMG_SIZE)) {
+		ret = -EFAULT;
+	}
+	member->timestamp_ns = frame.timestamp_ns;
+	ft9201_ring_put(dev, frame.slot);
 
-//	dev_info(&dev->interface->dev, "read registers returned: %d %d %d %d\n", local_value[0], local_value[1], local_value[2], local_value[3]);
+	return ret;
+}
+
+static int ft9201_group_capture(struct ft9201_device *dev, struct ft9201_group_capture *req)
+{
+	struct ft9201_device *members[FT9201_GROUP_MAX_DEVICES];
+	u32 gens[FT9201_GROUP_MAX_DEVICES];
+	bool awake[FT9201_GROUP_MAX_DEVICES];
+	struct ft9201_group_member *member;
+	unsigned int i, j, n, ok = 0;
+	u64 first = U64_MAX, last = 0;
+	ktime_t start;
+	int ret = 0;
+
+	n = ft9201_group_get(dev, members);
+	if (n == 0) {
+		return -ENOENT;
+	}
+
+	req->nr = n;
+	req->skew_ns = 0;
+	memset(req->member, 0, sizeof(req->member));
+	if (req->buf_len < n * FT9201_IMG_SIZE) {
+		ret = -ENOSPC;
+		goto out_put;
+	}
 
-	poo = local_value[0];
+	/* resuming takes a while, keep it out of the trigger */
+	for (i = 0; i < n; i++) {
+		member = &req->member[i];
+		member->minor = members[i]->interface->minor;
+		member->err = usb_autopm_get_interface(members[i]->interface);
+		awake[i] = member->err == 0;
 	}
 
-	ret = ft9201_read_image(dev);
+	start = ktime_get();
+	for (i = 0; i < n; i++) {
+		if (req->member[i].err == 0) {
+			atomic_inc(&members[i]->capture_waiters);
+			gens[i] = ft9201_capture_start(members[i]);
+		}
+	}
+	req->trigger_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	for (i = 0; i < n; i++) {
+		member = &req->member[i];
+		if (member->err) {
+			continue;
+		}
+
+		ret = wait_event_interruptible(members[i]->bulk_in_wait,
+				ft9201_capture_ready(members[i], gens[i]) || members[i]->disconnected);
 		if (ret < 0) {
-			break;
+			/* this one and the rest are still counted as waiting */
+			for (j = i; j < n; j++) {
+				if (req->member[j].err == 0) {
+					ft9201_capture_abandon(members[j], gens[j], NULL);
+				}
+			}
+			goto out_pm;
+		}
+		atomic_dec(&members[i]->capture_waiters);
+
+		if (members[i]->disconnected) {
+			member->err = -ENODEV;
+			continue;
 		}
+		member->err = ft9201_capture_result(members[i], &member->seq);
+	}
 
-	dev_info(&dev->interface->dev, "ft9201_read copied : %d\n", ret);
+	for (i = 0; i < n; i++) {
+		member = &req->member[i];
+		if (member->err == 0) {
+			member->err = ft9201_group_collect(members[i], member,
+					u64_to_user_ptr(req->buf) + (size_t)i * FT9201_IMG_SIZE);
+		}
+		if (member->err == 0) {
+			first = min(first, member->timestamp_ns);
+			last = max(last, member->timestamp_ns);
+			ok++;
+		}
+	}
+	if (ok > 1) {
+		req->skew_ns = last - first;
+	}
 
-/*
-	if (has_data_remaining(dev)) {
-		retval = send_read_data(dev, buf, count);
-//		break;
+	mutex_lock(&ft9201_devices_lock);
+	ft9201_group_stats.trigger_ns += req->trigger_ns;
+	if (ok == n) {
+		ft9201_group_stats.captures++;
+		ft9201_group_stats.skew_ns += req->skew_ns;
+		ft9201_group_stats.max_skew_ns = max(ft9201_group_stats.max_skew_ns, req->skew_ns);
+		ft9201_hist_add(&ft9201_group_stats.skew_us, div_u64(req->skew_ns, NSEC_PER_USEC));
+	} else {
+		ft9201_group_stats.partial++;
 	}
-*/
-//	if (dev->timetoexit == true) {
-//		mutex_unlock(&dev->io_mutex);
-//		kfree(dev->read_img_data);
-//		dev->read_img_data = NULL;
-//        ft9201_release(inode, fp);
-//		return 0;
-//		}
+	mutex_unlock(&ft9201_devices_lock);
 
+out_pm:
+	for (i = 0; i < n; i++) {
+		if (awake[i]) {
+			usb_autopm_put_interface(members[i]->interface);
+		}
+	}
+out_put:
+	for (i = 0; i < n; i++) {
+		kref_put(&members[i]->kref, ft9201_delete);
 	}
 
-exit:
-	mutex_unlock(&dev->io_mutex);
 	return ret;
 }
 
+static int ft9201_group_ioctl(struct ft9201_device *dev, struct ft9201_group_capture __user *arg)
+{
+	struct ft9201_group_capture *req;
+	int ret;
+
+	req = memdup_user(arg, sizeof(*req));
+	if (IS_ERR(req)) {
+		return PTR_ERR(req);
+	}
+
+	ret = dev->disconnected ? -ENODEV : ft9201_group_capture(dev, req);
+	/* nr goes back with -ENOSPC */
+	if ((ret == 0 || ret == -ENOSPC) && copy_to_user(arg, req, sizeof(*req))) {
+		ret = -EFAULT;
+	}
+
+	kfree(req);
+	return ret;
+}
+
+/*
+ * A frame, or EOF once it has been read, is ready when the loaded frame is
+ * non-empty or the capture read()/poll() started has finished. Polling
+ * starts that capture, so an event loop needs no blocking read to arm.
+ */
+static __poll_t ft9201_poll(struct file *file, poll_table *wait)
+{
+	struct ft9201_reader *reader = file->private_data;
+	struct ft9201_device *dev;
+	__poll_t mask = 0;
+
+	if (reader == NULL) {
+		return EPOLLERR | EPOLLHUP;
+	}
+	dev = reader->dev;
+
+	poll_wait(file, &dev->bulk_in_wait, wait);
+
+	mutex_lock(&reader->lock);
+	if (dev->disconnected) {
+		mask = EPOLLERR | EPOLLHUP;
+	} else if (reader->streaming) {
+		/* no EOF between frames, only a partly read or queued frame counts */
+		if (reader->img_in_copied < reader->img_in_filled || ft9201_stream_pending(reader)) {
+			mask = EPOLLIN | EPOLLRDNORM;
+		} else {
+			ft9201_capture_start(dev);
+		}
+	} else if (reader->img_in_filled) {
+		mask = EPOLLIN | EPOLLRDNORM;
+	} else {
+		if (!reader->read_waiting) {
+			reader->read_gen = ft9201_capture_start(dev);
+			reader->read_waiting = true;
+		}
+		if (ft9201_capture_ready(dev, reader->read_gen)) {
+			mask = EPOLLIN | EPOLLRDNORM;
+		}
+	}
+	mutex_unlock(&reader->lock);
+
+	return mask;
+}
+
 static void ft9201_delete(struct kref *kref)
 {
 	struct ft9201_device *dev = to_ft9201_dev(kref);
 
+	/* a capture started by the last reader may still be queued */
+	cancel_delayed_work_sync(&dev->capture_work);
+	cancel_delayed_work_sync(&dev->recover_work);
+	if (dev->capture_wq != NULL) {
+		destroy_workqueue(dev->capture_wq);
+	}
+	ft9201_free_ctrl_urbs(dev);
+	ft9201_free_in_urbs(dev);
+	ft9201_free_ring(dev);
 	usb_put_intf(dev->interface);
 	usb_put_dev(dev->udev);
-	if (dev->read_img_data != NULL) {
-		kfree(dev->read_img_data);
-		dev->read_img_data = NULL;
-	}
 	kfree(dev);
 }
 
@@ -475,7 +3735,18 @@ static int ft9201_probe(struct usb_interface *intf, const struct usb_device_id *
 	kref_init(&dev->kref);
 	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
 	spin_lock_init(&dev->err_lock);
+	mutex_init(&dev->io_mutex);
 	init_waitqueue_head(&dev->bulk_in_wait);
+	spin_lock_init(&dev->capture_lock);
+	seqcount_spinlock_init(&dev->health_seq, &dev->capture_lock);
+	seqlock_init(&dev->status_lock);
+	spin_lock_init(&dev->ring_lock);
+	INIT_LIST_HEAD(&dev->readers);
+	init_usb_anchor(&dev->ctrl_anchor);
+	mutex_init(&dev->reg_lock);
+	init_usb_anchor(&dev->in_anchor);
+	INIT_DELAYED_WORK(&dev->capture_work, ft9201_capture_work);
+	INIT_DELAYED_WORK(&dev->recover_work, ft9201_recover_work);
 
 	dev->udev = usb_get_dev(udev);
 	dev->interface = usb_get_intf(intf);
@@ -489,6 +3760,43 @@ static int ft9201_probe(struct usb_interface *intf, const struct usb_device_id *
 	}
 
 	dev->bulk_in_endpointAddr = bulk_in->bEndpointAddress;
+	dev->img_in_size = FT9201_IMG_SIZE;
+
+	/*
+	 * The detect poll blocks for up to a control timeout; with a queue per
+	 * device a slow sensor never holds up the others on the same host.
+	 */
+	dev->capture_wq = alloc_ordered_workqueue("ft9201/%s", WQ_HIGHPRI, dev_name(&intf->dev));
+	if (dev->capture_wq == NULL) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	retval = ft9201_alloc_ring(dev);
+	if (retval) {
+		dev_err(&intf->dev, "Could not allocate the frame ring\n");
+		goto error;
+	}
+
+	retval = ft9201_alloc_in_urbs(dev);
+	if (retval) {
+		dev_err(&intf->dev, "Could not allocate bulk-in urbs\n");
+		goto error;
+	}
+
+	retval = ft9201_alloc_ctrl_urbs(dev);
+	if (retval) {
+		dev_err(&intf->dev, "Could not allocate control urbs\n");
+		goto error;
+	}
+
+	ft9201_configure_burst(dev);
+
+	retval = ft9201_start_in_urbs(dev, GFP_KERNEL);
+	if (retval) {
+		dev_err(&intf->dev, "Could not submit bulk-in urbs\n");
+		goto error;
+	}
 
 	/* save our data pointer in this interface device */
 	usb_set_intfdata(intf, dev);
@@ -506,9 +3814,19 @@ static int ft9201_probe(struct usb_interface *intf, const struct usb_device_id *
 	/* let the user know what node this device is now attached to */
 	dev_info(&intf->dev, "USB fpreader device now attached to fpreader%d", intf->minor);
 
+	ft9201_devices_add(dev);
+
+	ft9201_debugfs_init(dev);
+
+	if (autosuspend_ms >= 0) {
+		pm_runtime_set_autosuspend_delay(&udev->dev, autosuspend_ms);
+		usb_enable_autosuspend(udev);
+	}
+
 	retval = ft9201_initialize(dev);
 	if (retval < 0) {
 		dev_err(&dev->interface->dev, "Error initializing device: %d", retval);
+		ft9201_recover_schedule(dev, retval);
 	}
 
 	return 0;
@@ -520,15 +3838,48 @@ error:
 	return retval;
 }
 
+/*
+ * Quiesce for a reset, from recovery or from anywhere else. Captures asked
+ * for until the device is set up again are held back, as during recovery.
+ */
 static int ft9201_pre_reset(struct usb_interface *interface) {
+	struct ft9201_device *dev = usb_get_intfdata(interface);
+
 	pr_info("Pre reset\n");
 
+	if (dev) {
+		spin_lock_irq(&dev->capture_lock);
+		if (!dev->recovering) {
+			dev->recovering = true;
+			dev->recover_attempt = 0;
+			dev->recover_start = ktime_get();
+		}
+		spin_unlock_irq(&dev->capture_lock);
+
+		ft9201_recover_quiesce(dev);
+	}
+
 	return 0;
 }
 
 static int ft9201_post_reset(struct usb_interface *interface) {
+	struct ft9201_device *dev = usb_get_intfdata(interface);
+
 	pr_info("Post reset\n");
 
+	if (dev) {
+		ft9201_reg_cache_drop(dev);
+		ft9201_configure_burst(dev);
+
+		/* recovery carries on by itself, a reset from elsewhere needs it to set the device up */
+		if (current_work() != &dev->recover_work.work) {
+			spin_lock_irq(&dev->capture_lock);
+			dev->recover_reinit = true;
+			spin_unlock_irq(&dev->capture_lock);
+			mod_delayed_work(dev->capture_wq, &dev->recover_work, 0);
+		}
+	}
+
 	return 0;
 }
 
@@ -539,20 +3890,26 @@ static void ft9201_disconnect(struct usb_interface *interface) {
 	pr_info("Disconnect");
 
 	dev = usb_get_intfdata(interface);
-	if (mutex_is_locked(&dev->io_mutex) == 1) {
-		mutex_unlock(&dev->io_mutex);
-	}
-	pr_info("Disconnect");
 	usb_set_intfdata(interface, NULL);
 
 	/* give back our minor */
 	usb_deregister_dev(interface, &ft9201_class);
+	ft9201_devices_del(dev);
+
+	/* waits for open debugfs files, dev stays valid until the kref_put below */
+	debugfs_remove_recursive(dev->debugfs_dir);
 
 	/* prevent more I/O from starting */
 	mutex_lock(&dev->io_mutex);
 	dev->disconnected = 1;
 	mutex_unlock(&dev->io_mutex);
 
+	/* an attempt waiting to reset the device gives up on the unbind */
+	cancel_delayed_work_sync(&dev->recover_work);
+	ft9201_capture_stop(dev, -ENODEV);
+	ft9201_stop_in_urbs(dev);
+	wake_up_interruptible(&dev->bulk_in_wait);
+
 	/* decrement our usage count */
 	kref_put(&dev->kref, ft9201_delete);
 
@@ -560,17 +3917,420 @@ static void ft9201_disconnect(struct usb_interface *interface) {
 }
 
 static int ft9201_suspend(struct usb_interface *intf, pm_message_t message) {
+	struct ft9201_device *dev = usb_get_intfdata(intf);
+
 	pr_info("Suspend");
 
+	if (dev) {
+		ft9201_capture_stop(dev, -ESHUTDOWN);
+		ft9201_stop_in_urbs(dev);
+
+		/* the arm sequence does not survive suspend */
+		spin_lock_irq(&dev->capture_lock);
+		dev->sensor_armed = false;
+		dev->stats.suspends++;
+		ft9201_health_publish_locked(dev);
+		spin_unlock_irq(&dev->capture_lock);
+	}
+
 	return 0;
 }
 
+/*
+ * Restart the bulk-in ring and get the sensor armed again in the
+ * background, so the first capture after idle only has to poll for the
+ * finger. Streaming picks up where suspend stopped it.
+ */
 static int ft9201_resume(struct usb_interface *intf) {
+	struct ft9201_device *dev = usb_get_intfdata(intf);
+
+	int retVal;
+
 	pr_info("Resume");
 
+	if (dev) {
+		dev->resume_time = ktime_get();
+		retVal = ft9201_start_in_urbs(dev, GFP_NOIO);
+
+		spin_lock_irq(&dev->capture_lock);
+		dev->stats.resumes++;
+		dev->stats.resume_ns += ktime_to_ns(ktime_sub(ktime_get(), dev->resume_time));
+		if (retVal == 0 && !dev->disconnected && !dev->recovering &&
+		    dev->capture_state == FT9201_CAPTURE_IDLE && (READ_ONCE(dev->streamers) || prearm)) {
+			/* we are resuming, so no need to resume again for the reference */
+			usb_autopm_get_interface_no_resume(intf);
+			dev->pm_held = true;
+			if (READ_ONCE(dev->streamers)) {
+				ft9201_capture_begin_locked(dev);
+			} else {
+				dev->capture_state = FT9201_CAPTURE_PREARM;
+				mod_delayed_work(dev->capture_wq, &dev->capture_work, 0);
+			}
+		}
+		ft9201_health_publish_locked(dev);
+		spin_unlock_irq(&dev->capture_lock);
+
+		return retVal;
+	}
+
+	return 0;
+}
+
+/* the device came back from a reset, none of its registers can be trusted */
+static int ft9201_reset_resume(struct usb_interface *intf) {
+	struct ft9201_device *dev = usb_get_intfdata(intf);
+
+	if (dev) {
+		ft9201_reg_cache_drop(dev);
+		ft9201_configure_burst(dev);
+	}
+
+	return ft9201_resume(intf);
+}
+
+/* capture counters, cumulative since probe, from the published snapshot */
+#define FT9201_STAT_ATTR(field)							\
+static ssize_t field##_show(struct device *d, struct device_attribute *attr, char *buf)	\
+{										\
+	struct ft9201_device *dev = usb_get_intfdata(to_usb_interface(d));	\
+	struct ft9201_health health;						\
+										\
+	ft9201_health_read(dev, &health);					\
+										\
+	return sysfs_emit(buf, "%llu\n", health.field);				\
+}										\
+static DEVICE_ATTR_RO(field)
+
+FT9201_STAT_ATTR(captures);
+FT9201_STAT_ATTR(errors);
+FT9201_STAT_ATTR(detect_polls);
+FT9201_STAT_ATTR(arm_to_detect_ns);
+FT9201_STAT_ATTR(detect_to_frame_ns);
+FT9201_STAT_ATTR(last_detect_to_frame_ns);
+FT9201_STAT_ATTR(resumes);
+FT9201_STAT_ATTR(resume_to_armed_ns);
+FT9201_STAT_ATTR(prearm_hits);
+FT9201_STAT_ATTR(recoveries);
+FT9201_STAT_ATTR(recover_failures);
+FT9201_STAT_ATTR(last_recover_ns);
+
+#define FT9201_RING_STAT_ATTR(field)						\
+static ssize_t field##_show(struct device *d, struct device_attribute *attr, char *buf)	\
+{										\
+	struct ft9201_device *dev = usb_get_intfdata(to_usb_interface(d));	\
+	u64 val;								\
+										\
+	spin_lock_irq(&dev->ring_lock);						\
+	val = dev->stats.field;							\
+	spin_unlock_irq(&dev->ring_lock);					\
+										\
+	return sysfs_emit(buf, "%llu\n", val);					\
+}										\
+static DEVICE_ATTR_RO(field)
+
+FT9201_RING_STAT_ATTR(stream_frames);
+FT9201_RING_STAT_ATTR(dropped_oldest);
+FT9201_RING_STAT_ATTR(dropped_newest);
+FT9201_RING_STAT_ATTR(short_frames);
+FT9201_RING_STAT_ATTR(gated_empty);
+FT9201_RING_STAT_ATTR(gated_duplicate);
+
+/* sensors sharing a non-zero group are captured together, see FT9201_IOCTL_REQ_GROUP_CAPTURE */
+static ssize_t group_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct ft9201_device *dev = usb_get_intfdata(to_usb_interface(d));
+	u32 group;
+
+	mutex_lock(&ft9201_devices_lock);
+	group = dev->group;
+	mutex_unlock(&ft9201_devices_lock);
+
+	return sysfs_emit(buf, "%u\n", group);
+}
+
+static ssize_t group_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct ft9201_device *dev = usb_get_intfdata(to_usb_interface(d));
+	u32 group;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &group);
+	if (ret) {
+		return ret;
+	}
+
+	mutex_lock(&ft9201_devices_lock);
+	dev->group = group;
+	mutex_unlock(&ft9201_devices_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(group);
+
+static struct attribute *ft9201_attrs[] = {
+		&dev_attr_group.attr,
+		&dev_attr_captures.attr,
+		&dev_attr_errors.attr,
+		&dev_attr_detect_polls.attr,
+		&dev_attr_arm_to_detect_ns.attr,
+		&dev_attr_detect_to_frame_ns.attr,
+		&dev_attr_last_detect_to_frame_ns.attr,
+		&dev_attr_resumes.attr,
+		&dev_attr_resume_to_armed_ns.attr,
+		&dev_attr_prearm_hits.attr,
+		&dev_attr_recoveries.attr,
+		&dev_attr_recover_failures.attr,
+		&dev_attr_last_recover_ns.attr,
+		&dev_attr_stream_frames.attr,
+		&dev_attr_dropped_oldest.attr,
+		&dev_attr_dropped_newest.attr,
+		&dev_attr_short_frames.attr,
+		&dev_attr_gated_empty.attr,
+		&dev_attr_gated_duplicate.attr,
+		NULL
+};
+ATTRIBUTE_GROUPS(ft9201);
+
+/*
+ * debugfs: ft9201/fpreaderN/{stats,histograms,registers,reset,recover}. The
+ * counters are the ones behind the sysfs attributes, writing to reset zeroes
+ * all of them and writing to recover runs error recovery. ft9201/group has
+ * the group capture skew of all sensors.
+ */
+static struct dentry *ft9201_debugfs_root;
+
+static void ft9201_stats_snapshot(struct ft9201_device *dev, struct ft9201_capture_stats *stats)
+{
+	spin_lock_irq(&dev->capture_lock);
+	*stats = dev->stats;
+	spin_unlock_irq(&dev->capture_lock);
+
+	/* only the ring-side counters, the whole struct is too big for the stack */
+	spin_lock_irq(&dev->ring_lock);
+	stats->stream_frames = dev->stats.stream_frames;
+	stats->dropped_oldest = dev->stats.dropped_oldest;
+	stats->dropped_newest = dev->stats.dropped_newest;
+	stats->short_frames = dev->stats.short_frames;
+	stats->gated_empty = dev->stats.gated_empty;
+	stats->gated_duplicate = dev->stats.gated_duplicate;
+	stats->bulk_transfers = dev->stats.bulk_transfers;
+	stats->bulk_frames = dev->stats.bulk_frames;
+	stats->bulk_errors = dev->stats.bulk_errors;
+	stats->bulk_us = dev->stats.bulk_us;
+	spin_unlock_irq(&dev->ring_lock);
+}
+
+static int ft9201_stats_show(struct seq_file *m, void *unused)
+{
+	struct ft9201_device *dev = m->private;
+	struct ft9201_capture_stats *stats;
+	struct ft9201_reg_stats reg;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (stats == NULL) {
+		return -ENOMEM;
+	}
+	ft9201_stats_snapshot(dev, stats);
+
+	seq_printf(m, "captures: %llu\n", stats->captures);
+	seq_printf(m, "errors: %llu\n", stats->errors);
+	seq_printf(m, "detect_polls: %llu\n", stats->detect_polls);
+	seq_printf(m, "ctrl_errors: %llu\n", stats->ctrl_errors);
+	seq_printf(m, "timeouts: %llu\n", stats->timeouts);
+	seq_printf(m, "arm_to_detect_ns: %llu\n", stats->arm_to_detect_ns);
+	seq_printf(m, "detect_to_frame_ns: %llu\n", stats->detect_to_frame_ns);
+	seq_printf(m, "bulk_transfers: %llu\n", stats->bulk_transfers);
+	seq_printf(m, "bulk_frames: %llu\n", stats->bulk_frames);
+	seq_printf(m, "bulk_errors: %llu\n", stats->bulk_errors);
+	seq_printf(m, "short_frames: %llu\n", stats->short_frames);
+	seq_printf(m, "gated_empty: %llu\n", stats->gated_empty);
+	seq_printf(m, "gated_duplicate: %llu\n", stats->gated_duplicate);
+	seq_printf(m, "stream_frames: %llu\n", stats->stream_frames);
+	seq_printf(m, "dropped_oldest: %llu\n", stats->dropped_oldest);
+	seq_printf(m, "dropped_newest: %llu\n", stats->dropped_newest);
+	seq_printf(m, "suspends: %llu\n", stats->suspends);
+	seq_printf(m, "resumes: %llu\n", stats->resumes);
+	seq_printf(m, "resume_ns: %llu\n", stats->resume_ns);
+	seq_printf(m, "resume_to_armed_ns: %llu\n", stats->resume_to_armed_ns);
+	seq_printf(m, "prearm_hits: %llu\n", stats->prearm_hits);
+	seq_printf(m, "auto_rearms: %llu\n", stats->auto_rearms);
+	seq_printf(m, "auto_power_fallbacks: %llu\n", stats->auto_power_fallbacks);
+	seq_printf(m, "auto_power_polled: %llu\n", stats->auto_power_polled);
+	seq_printf(m, "recoveries: %llu\n", stats->recoveries);
+	seq_printf(m, "recover_failures: %llu\n", stats->recover_failures);
+	seq_printf(m, "recover_resets: %llu\n", stats->recover_resets);
+	seq_printf(m, "recover_ns: %llu\n", stats->recover_ns);
+	seq_printf(m, "last_recover_ns: %llu\n", stats->last_recover_ns);
+
+	mutex_lock(&dev->reg_lock);
+	reg = dev->reg_stats;
+	mutex_unlock(&dev->reg_lock);
+
+	seq_printf(m, "reg_hits: %llu\n", reg.hits);
+	seq_printf(m, "reg_misses: %llu\n", reg.misses);
+	seq_printf(m, "reg_writes: %llu\n", reg.writes);
+	seq_printf(m, "reg_writes_elided: %llu\n", reg.writes_elided);
+	seq_printf(m, "reg_writes_batched: %llu\n", reg.writes_batched);
+	seq_printf(m, "reg_errors: %llu\n", reg.errors);
+
+	kfree(stats);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ft9201_stats);
+
+static void ft9201_hist_show(struct seq_file *m, const char *name, const char *unit,
+		const struct ft9201_hist *hist)
+{
+	unsigned int i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < FT9201_HIST_BUCKETS; i++) {
+		if (!hist->count[i]) {
+			continue;
+		}
+		if (i == 0) {
+			seq_printf(m, "  %10s%-3s %llu\n", "0", unit, hist->count[i]);
+		} else if (i == FT9201_HIST_BUCKETS - 1) {
+			seq_printf(m, "  >= %7llu%-3s %llu\n", 1ULL << (i - 1), unit, hist->count[i]);
+		} else {
+			seq_printf(m, "  < %8llu%-3s %llu\n", 1ULL << i, unit, hist->count[i]);
+		}
+	}
+}
+
+static int ft9201_histograms_show(struct seq_file *m, void *unused)
+{
+	struct ft9201_device *dev = m->private;
+	struct ft9201_capture_stats *stats;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (stats == NULL) {
+		return -ENOMEM;
+	}
+	ft9201_stats_snapshot(dev, stats);
+
+	ft9201_hist_show(m, "arm_to_detect", "us", &stats->arm_to_detect_us);
+	ft9201_hist_show(m, "detect_to_frame", "us", &stats->detect_to_frame_us);
+	ft9201_hist_show(m, "bulk_transfer", "us", &stats->bulk_us);
+	ft9201_hist_show(m, "polls_per_capture", "", &stats->polls_per_capture);
+	ft9201_hist_show(m, "resume_to_armed", "us", &stats->resume_to_armed_us);
+	ft9201_hist_show(m, "recover", "us", &stats->recover_us);
+
+	kfree(stats);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ft9201_histograms);
+
+/* cached registers, '*' marks ones held back by an open batch */
+static int ft9201_registers_show(struct seq_file *m, void *unused)
+{
+	struct ft9201_device *dev = m->private;
+	unsigned int reg;
+
+	mutex_lock(&dev->reg_lock);
+	for_each_set_bit(reg, dev->reg_valid, FT9201_NR_REGS) {
+		seq_printf(m, "%02x: %02x%s\n", reg, dev->reg_cache[reg],
+				test_bit(reg, dev->reg_dirty) ? " *" : "");
+	}
+	mutex_unlock(&dev->reg_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ft9201_registers);
+
+static int ft9201_reset_set(void *data, u64 val)
+{
+	struct ft9201_device *dev = data;
+	unsigned int capture_polls;
+
+	spin_lock_irq(&dev->capture_lock);
+	capture_polls = dev->stats.capture_polls;
+	spin_lock(&dev->ring_lock);
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	spin_unlock(&dev->ring_lock);
+	dev->stats.capture_polls = capture_polls;
+	ft9201_health_publish_locked(dev);
+	spin_unlock_irq(&dev->capture_lock);
+
+	mutex_lock(&dev->reg_lock);
+	memset(&dev->reg_stats, 0, sizeof(dev->reg_stats));
+	mutex_unlock(&dev->reg_lock);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(ft9201_reset_fops, NULL, ft9201_reset_set, "%llu\n");
+
+/* go through recovery as if a transfer had failed, to try it out */
+static int ft9201_recover_set(void *data, u64 val)
+{
+	ft9201_recover_schedule(data, -EIO);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(ft9201_recover_fops, NULL, ft9201_recover_set, "%llu\n");
+
+/* group captures across all sensors, cleared by writing to this file */
+static int ft9201_group_show(struct seq_file *m, void *unused)
+{
+	struct ft9201_group_stats *stats;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (stats == NULL) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&ft9201_devices_lock);
+	*stats = ft9201_group_stats;
+	mutex_unlock(&ft9201_devices_lock);
+
+	seq_printf(m, "captures: %llu\n", stats->captures);
+	seq_printf(m, "partial: %llu\n", stats->partial);
+	seq_printf(m, "skew_ns: %llu\n", stats->skew_ns);
+	seq_printf(m, "max_skew_ns: %llu\n", stats->max_skew_ns);
+	seq_printf(m, "trigger_ns: %llu\n", stats->trigger_ns);
+	ft9201_hist_show(m, "skew", "us", &stats->skew_us);
+
+	kfree(stats);
 	return 0;
 }
 
+static int ft9201_group_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ft9201_group_show, inode->i_private);
+}
+
+static ssize_t ft9201_group_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	mutex_lock(&ft9201_devices_lock);
+	memset(&ft9201_group_stats, 0, sizeof(ft9201_group_stats));
+	mutex_unlock(&ft9201_devices_lock);
+
+	return count;
+}
+
+static const struct file_operations ft9201_group_fops = {
+		.owner = THIS_MODULE,
+		.open = ft9201_group_open,
+		.read = seq_read,
+		.write = ft9201_group_write,
+		.llseek = seq_lseek,
+		.release = single_release,
+};
+
+static void ft9201_debugfs_init(struct ft9201_device *dev)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "fpreader%d", dev->interface->minor);
+	dev->debugfs_dir = debugfs_create_dir(name, ft9201_debugfs_root);
+
+	debugfs_create_file("stats", 0444, dev->debugfs_dir, dev, &ft9201_stats_fops);
+	debugfs_create_file("histograms", 0444, dev->debugfs_dir, dev, &ft9201_histograms_fops);
+	debugfs_create_file("registers", 0444, dev->debugfs_dir, dev, &ft9201_registers_fops);
+	debugfs_create_file_unsafe("reset", 0200, dev->debugfs_dir, dev, &ft9201_reset_fops);
+	debugfs_create_file_unsafe("recover", 0200, dev->debugfs_dir, dev, &ft9201_recover_fops);
+}
+
 static struct usb_driver ft9201_driver = {
 		.name = "ft9201",
 		.probe = ft9201_probe,
@@ -579,7 +4339,32 @@ static struct usb_driver ft9201_driver = {
 		.resume = ft9201_resume,
 		.pre_reset = ft9201_pre_reset,
 		.post_reset = ft9201_post_reset,
+		.reset_resume = ft9201_reset_resume,
 		.id_table = ft9201_table,
+		.dev_groups = ft9201_groups,
+		.supports_autosuspend = 1,
 };
 
-module_usb_driver(ft9201_driver);
+static int __init ft9201_init(void)
+{
+	int retval;
+
+	ft9201_debugfs_root = debugfs_create_dir("ft9201", NULL);
+	debugfs_create_file("group", 0644, ft9201_debugfs_root, NULL, &ft9201_group_fops);
+
+	retval = usb_register(&ft9201_driver);
+	if (retval) {
+		debugfs_remove_recursive(ft9201_debugfs_root);
+	}
+
+	return retval;
+}
+
+static void __exit ft9201_exit(void)
+{
+	usb_deregister(&ft9201_driver);
+	debugfs_remove_recursive(ft9201_debugfs_root);
+}
+
+module_init(ft9201_init);
+module_exit(ft9201_exit);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define 	FT9201_MAGIC 'F'
 
@@ -8,18 +9,248 @@
 #define 	FT9201_IOCTL_REQ_GET_STATUS			_IOR(FT9201_MAGIC, 0x02, struct ft9201_status)
 #define 	FT9201_IOCTL_REQ_SET_AUTO_POWER		_IO(FT9201_MAGIC, 0x03)
 #define 	FT9201_IOCTL_REQ_SENSOR_STATUS 		_IO(FT9201_MAGIC, 0x04)
+#define 	FT9201_IOCTL_REQ_CAPTURE			_IOR(FT9201_MAGIC, 0x05, __u32)
+#define 	FT9201_IOCTL_REQ_SET_STREAMING		_IOW(FT9201_MAGIC, 0x06, struct ft9201_stream)
+#define 	FT9201_IOCTL_REQ_READER_STATS		_IOR(FT9201_MAGIC, 0x07, struct ft9201_reader_stats)
+#define 	FT9201_IOCTL_REQ_GET_FRAME			_IOWR(FT9201_MAGIC, 0x08, struct ft9201_get_frame)
+#define 	FT9201_IOCTL_REQ_CAPTURE_MULTI		_IOWR(FT9201_MAGIC, 0x09, struct ft9201_multi_capture)
+#define 	FT9201_IOCTL_REQ_REGISTERS			_IOWR(FT9201_MAGIC, 0x0a, struct ft9201_registers)
+#define 	FT9201_IOCTL_REQ_GROUP_CAPTURE		_IOWR(FT9201_MAGIC, 0x0b, struct ft9201_group_capture)
+#define 	FT9201_IOCTL_REQ_GET_HEALTH			_IOR(FT9201_MAGIC, 0x0c, struct ft9201_health)
 
 struct ft9201_status {
-	unsigned int initialized;
-	unsigned short sui_version;
-	unsigned char sensor_mcu_state;
-	int chip_variant;
-	unsigned char sensor_width;
-	unsigned char sensor_height;
-	unsigned short afe_chip_id;
-	unsigned char fw_version;
-	unsigned char agc_version;
-
-
-	unsigned char *raw_image_dta;
-};
\ No newline at end of file
+	__u32 initialized;
+	__u16 sui_version;
+	__u8 sensor_mcu_state;
+	__u8 reserved0;
+	__s32 chip_variant;
+	__u8 sensor_width;
+	__u8 sensor_height;
+	__u16 afe_chip_id;
+	__u8 fw_version;
+	__u8 agc_version;
+	__u16 reserved1;
+	__u32 frame_size;		/* bytes per frame */
+	__u32 last_seq;			/* newest frame in the ring, 0 if none yet */
+};
+
+/* ft9201_health.capture_state */
+#define 	FT9201_STATE_IDLE		0
+#define 	FT9201_STATE_PREARM		1	/* arming after resume, ahead of any capture */
+#define 	FT9201_STATE_ARM		2	/* sending the arm sequence */
+#define 	FT9201_STATE_DETECT		3	/* polling the sensor for a finger */
+#define 	FT9201_STATE_FRAME		4	/* finger seen, waiting for the frame */
+#define 	FT9201_STATE_RECOVERING		5	/* getting the device going again after an error */
+
+/*
+ * FT9201_IOCTL_REQ_GET_HEALTH: where the capture state machine is and its
+ * counters since probe, as one consistent snapshot. The capture path
+ * publishes it as it goes, so this never waits on a capture or on I/O and
+ * is cheap enough to poll. GET_STATUS does not wait either.
+ */
+struct ft9201_health {
+	__u32 capture_state;		/* FT9201_STATE_* */
+	__s32 last_err;			/* 0, or how the last capture failed */
+	__u32 last_seq;			/* newest frame in the ring, 0 if none yet */
+	__u32 streamers;		/* files streaming */
+	__u64 last_capture_ns;		/* CLOCK_MONOTONIC, when the last capture ended */
+	__u64 captures;
+	__u64 errors;
+	__u64 timeouts;
+	__u64 ctrl_errors;
+	__u64 detect_polls;
+	__u64 prearm_hits;
+	__u64 suspends;
+	__u64 resumes;
+	__u64 arm_to_detect_ns;		/* cumulative */
+	__u64 detect_to_frame_ns;	/* cumulative */
+	__u64 last_detect_to_frame_ns;
+	__u64 resume_to_armed_ns;	/* cumulative */
+	__u64 recoveries;		/* transfer errors the driver recovered from */
+	__u64 recover_failures;		/* recoveries that gave up */
+	__u64 recover_resets;		/* recoveries that had to reset the device */
+	__u64 recover_ns;		/* cumulative, error -> device usable again */
+	__u64 last_recover_ns;
+};
+
+/*
+ * Metadata of one frame. version and size describe the layout the driver
+ * filled in; fields are only ever appended, so a newer driver keeps the
+ * offsets an older program was built against.
+ */
+#define 	FT9201_FRAME_DESC_VERSION	2
+
+/* frame flags, set by the in-driver gate when its thresholds are enabled */
+#define 	FT9201_FRAME_EMPTY		(1 << 0)	/* too little contrast or coverage for a finger */
+#define 	FT9201_FRAME_DUPLICATE		(1 << 1)	/* same block hash as the previous frame */
+
+struct ft9201_frame_desc {
+	__u32 version;			/* FT9201_FRAME_DESC_VERSION */
+	__u32 size;			/* sizeof(struct ft9201_frame_desc) */
+	__u32 seq;			/* ring sequence number */
+	__u32 len;			/* bytes of frame data */
+	__u16 width;
+	__u16 height;
+	__u32 detect_polls;		/* finger-detect polls of the capture that produced it */
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC at transfer completion */
+	__u64 transfer_ns;		/* bulk-in submit -> completion */
+
+	/* version 2 */
+	__u32 flags;			/* FT9201_FRAME_* */
+	__u32 mean;			/* pixel mean, 0-255 */
+	__u32 variance;			/* pixel variance */
+	__u32 coverage;			/* per mille of 8x8 blocks with ridge contrast */
+	__u32 hash;			/* rolling hash of the quantized block means */
+	__u32 reserved;
+};
+
+/*
+ * FT9201_IOCTL_REQ_GET_FRAME: fetch the next frame the way read() would
+ * (the next queued one while streaming, a new capture otherwise) and copy
+ * it to buf along with its descriptor. Blocks unless the file is
+ * O_NONBLOCK. A frame partly consumed by read() is dropped.
+ */
+struct ft9201_get_frame {
+	__u64 buf;			/* in: user buffer for the frame data */
+	__u32 buf_len;			/* in: at least desc.len, or -ENOSPC */
+	__u32 reserved;
+	struct ft9201_frame_desc desc;	/* out */
+};
+
+/* what FT9201_IOCTL_REQ_CAPTURE_MULTI hands back, and the buf_len it needs */
+#define 	FT9201_ACCUM_NONE		0	/* every frame, frames * frame_size bytes */
+#define 	FT9201_ACCUM_SUM		1	/* __u32 per pixel, frame_size * 4 bytes */
+#define 	FT9201_ACCUM_MEAN		2	/* __u8 per pixel, rounded, frame_size bytes */
+#define 	FT9201_ACCUM_MAX		3	/* __u8 per pixel, frame_size bytes */
+
+#define 	FT9201_MULTI_MAX_FRAMES		256
+
+/* arm the sensor before the first frame only, not before each of them */
+#define 	FT9201_MULTI_ARM_ONCE		(1 << 0)
+
+/*
+ * FT9201_IOCTL_REQ_CAPTURE_MULTI: capture frames consecutive frames in one
+ * session and return them, or only their per-pixel accumulation. Frames
+ * the gate drops are not counted. Always blocks; fails with -EBUSY while
+ * the file is streaming.
+ */
+struct ft9201_multi_capture {
+	__u32 frames;			/* in: 1 .. FT9201_MULTI_MAX_FRAMES */
+	__u32 mode;			/* in: FT9201_ACCUM_* */
+	__u32 flags;			/* in: FT9201_MULTI_* */
+	__u32 buf_len;			/* in: see FT9201_ACCUM_*, or -ENOSPC */
+	__u64 buf;			/* in: user buffer */
+	__u32 first_seq;		/* out: ring sequence numbers of the frames used */
+	__u32 last_seq;
+	__u64 elapsed_ns;		/* out: first frame requested -> last frame in */
+};
+
+#define 	FT9201_REGS_MAX_OPS		256
+
+struct ft9201_reg_op {
+	__u8 reg;
+	__u8 val;			/* in for writes, out for reads */
+	__u8 write;
+	__u8 reserved;
+};
+
+/*
+ * FT9201_IOCTL_REQ_REGISTERS: read or write vendor registers, in order.
+ * Writes are sent together once all ops are done, writes of the value a
+ * register already holds are skipped, and only the sensor status
+ * registers are read from the device every time. Fails on the first op
+ * that does; count is then set to the ops that went through.
+ */
+struct ft9201_registers {
+	__u32 count;			/* in: 1 .. FT9201_REGS_MAX_OPS */
+	__u32 reserved;
+	__u64 ops;			/* in: user array of struct ft9201_reg_op */
+};
+
+#define 	FT9201_GROUP_MAX_DEVICES	16
+
+struct ft9201_group_member {
+	__s32 minor;			/* /dev/fpreader<minor> */
+	__s32 err;			/* 0, or why this sensor has no frame in buf */
+	__u32 seq;			/* ring sequence number of its frame */
+	__u32 reserved;
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC, when its transfer completed */
+};
+
+/*
+ * FT9201_IOCTL_REQ_GROUP_CAPTURE: capture one frame on every sensor in
+ * this one's group (the group sysfs attribute, 0 is none and fails with
+ * -ENOENT), all triggered at once, and copy the frames to buf in member
+ * order, which is by minor. A member that fails leaves its part of buf
+ * alone and sets err. Always blocks.
+ */
+struct ft9201_group_capture {
+	__u64 buf;			/* in: user buffer */
+	__u32 buf_len;			/* in: at least nr frames, or -ENOSPC */
+	__u32 nr;			/* out: members */
+	__u64 skew_ns;			/* out: latest minus earliest frame timestamp */
+	__u64 trigger_ns;		/* out: first to last capture started */
+	struct ft9201_group_member member[FT9201_GROUP_MAX_DEVICES];
+};
+
+/* what a streaming queue does with a new frame when it is full */
+#define 	FT9201_STREAM_DROP_OLDEST	0
+#define 	FT9201_STREAM_DROP_NEWEST	1
+
+/*
+ * Streaming mode: the driver re-arms the sensor after every frame and
+ * queues up to depth frames, read() then returns them back to back.
+ * Every open file has its own queue and cursor, and each frame is
+ * delivered to all of the files that have streaming enabled.
+ */
+struct ft9201_stream {
+	__u32 enable;
+	__u32 overflow;			/* FT9201_STREAM_DROP_* */
+	__u32 depth;			/* queued frames, 0 for the largest the ring allows */
+	__u32 reserved;
+};
+
+/* per open file, lag is counted in frames published after the one being read */
+struct ft9201_reader_stats {
+	__u64 frames;			/* frames handed to read() */
+	__u64 dropped_oldest;		/* queued frames pushed out by newer ones */
+	__u64 dropped_newest;		/* new frames refused by a full queue */
+	__u32 queued;			/* frames waiting in the streaming queue */
+	__u32 lag;			/* lag of the frame last handed to read() */
+	__u32 max_lag;
+	__u32 reserved;
+};
+
+/*
+ * mmap() layout of /dev/fpreaderN: one page holding struct ft9201_ring_ctrl,
+ * followed by nr_slots frames of frame_size bytes starting at data_offset.
+ *
+ * The driver publishes frame <seq> by filling desc[seq % nr_slots] and then
+ * advancing producer. Slots are recycled oldest first, so a consumer reads
+ * the frame from desc->slot and then checks that slot_seq[desc->slot] still
+ * equals seq; if not, the frame was overwritten while it was being read.
+ * consumer is owned by userspace and only used for bookkeeping. Frames the
+ * gate flagged are still published here, read() and GET_FRAME skip them.
+ */
+#define 	FT9201_RING_VERSION		1
+#define 	FT9201_RING_MAX_SLOTS	64
+
+struct ft9201_ring_desc {
+	__u32 seq;			/* 0 until the entry is first written */
+	__u32 slot;			/* data slot holding the frame */
+	__u32 len;			/* bytes received from the sensor */
+	__u32 flags;			/* FT9201_FRAME_* */
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC at transfer completion */
+};
+
+struct ft9201_ring_ctrl {
+	__u32 version;
+	__u32 nr_slots;
+	__u32 frame_size;
+	__u32 data_offset;
+	__u32 producer;			/* seq of the newest frame */
+	__u32 consumer;			/* seq of the last frame userspace consumed */
+	__u32 reserved[2];
+	__u32 slot_seq[FT9201_RING_MAX_SLOTS];	/* 0 while a slot is being refilled */
+	struct ft9201_ring_desc desc[FT9201_RING_MAX_SLOTS];
+};
@@ -0,0 +1,328 @@
+/*
+ * Scaling benchmark for the ft9201 driver: frames per second against the
+ * number of sensors streaming at once.
+ *
+ * For n = 1 .. number of devices, n threads each stream from their own
+ * /dev/fpreaderN for the given time using FT9201_IOCTL_REQ_GET_FRAME, and
+ * the aggregate rate is compared with n times the single-device rate.
+ * Each round also reports latency percentiles and the CPU time the whole
+ * system spent, from /proc/stat. Latency is completion to delivery while
+ * streaming, and the whole capture with -o, which asks for one frame at a
+ * time instead, and -a turns on auto power so the sensor is not polled
+ * between captures. Run it against emulated sensors (ft9201_emu), real ones
+ * only produce frames while touched.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ft9201.h"
+
+#define MAX_DEVICES	64
+#define FRAME_MAX	8192
+
+struct bench_thread {
+	pthread_t thread;
+	const char *path;
+	double seconds;
+	int oneshot;
+	int auto_power;
+	uint64_t frames;
+	uint64_t errors;
+	uint64_t *lat_ns;		/* one sample per frame */
+	size_t nr_lat;
+	size_t max_lat;
+	int err;
+};
+
+struct cpu_times {
+	unsigned long long busy;
+	unsigned long long sys;
+	unsigned long long total;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int read_cpu_times(struct cpu_times *t)
+{
+	unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+	FILE *f = fopen("/proc/stat", "r");
+	int n;
+
+	if (f == NULL) {
+		return -1;
+	}
+	n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+	fclose(f);
+	if (n != 8) {
+		return -1;
+	}
+
+	t->sys = system + irq + softirq;
+	t->busy = user + nice + t->sys + steal;
+	t->total = t->busy + idle + iowait;
+	return 0;
+}
+
+static void add_latency(struct bench_thread *t, uint64_t ns)
+{
+	uint64_t *lat;
+
+	if (t->nr_lat == t->max_lat) {
+		t->max_lat = t->max_lat ? t->max_lat * 2 : 4096;
+		lat = realloc(t->lat_ns, t->max_lat * sizeof(*lat));
+		if (lat == NULL) {
+			return;
+		}
+		t->lat_ns = lat;
+	}
+	t->lat_ns[t->nr_lat++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank, in microseconds */
+static double percentile(const uint64_t *sorted, size_t n, double pct)
+{
+	size_t i;
+
+	if (n == 0) {
+		return 0.0;
+	}
+	i = (size_t)(pct / 100.0 * n);
+	return sorted[i < n ? i : n - 1] / 1000.0;
+}
+
+static void *bench_run(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct ft9201_stream stream = { .enable = 1, .overflow = FT9201_STREAM_DROP_OLDEST };
+	struct ft9201_get_frame req;
+	unsigned char buf[FRAME_MAX];
+	struct pollfd pfd;
+	uint64_t start;
+	double end;
+	int fd;
+
+	fd = open(t->path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		t->err = errno;
+		return NULL;
+	}
+
+	if (t->auto_power && ioctl(fd, FT9201_IOCTL_REQ_SET_AUTO_POWER, 1) < 0) {
+		t->err = errno;
+		close(fd);
+		return NULL;
+	}
+
+	if (!t->oneshot && ioctl(fd, FT9201_IOCTL_REQ_SET_STREAMING, &stream) < 0) {
+		t->err = errno;
+		close(fd);
+		return NULL;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	end = now() + t->seconds;
+	start = now_ns();
+
+	while (now() < end) {
+		memset(&req, 0, sizeof(req));
+		req.buf = (uintptr_t)buf;
+		req.buf_len = sizeof(buf);
+
+		if (ioctl(fd, FT9201_IOCTL_REQ_GET_FRAME, &req) == 0) {
+			t->frames++;
+			if (t->oneshot) {
+				add_latency(t, now_ns() - start);
+				start = now_ns();
+			} else {
+				add_latency(t, now_ns() - req.desc.timestamp_ns);
+			}
+			continue;
+		}
+
+		if (errno == EAGAIN) {
+			poll(&pfd, 1, 100);
+		} else if (errno == ENODEV) {
+			t->err = errno;
+			break;
+		} else {
+			t->errors++;
+		}
+	}
+
+	if (!t->oneshot) {
+		stream.enable = 0;
+		ioctl(fd, FT9201_IOCTL_REQ_SET_STREAMING, &stream);
+	}
+	close(fd);
+
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t seconds] [-n devices] [-o] [-a] [device ...]\n", prog);
+	fprintf(stderr, "Without devices, /dev/fpreader0 .. /dev/fpreader<n-1> are used.\n");
+	fprintf(stderr, "-o captures one frame at a time instead of streaming.\n");
+	fprintf(stderr, "-a turns on auto power, arming the sensor instead of polling it.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static char names[MAX_DEVICES][32];
+	struct bench_thread threads[MAX_DEVICES];
+	const char *paths[MAX_DEVICES];
+	struct cpu_times cpu0, cpu1;
+	double seconds = 5.0;
+	double base = 0.0;
+	double start, elapsed, rate;
+	double cpu, sys, total;
+	uint64_t frames, errors;
+	uint64_t *lat;
+	size_t nr_lat;
+	int oneshot = 0;
+	int auto_power = 0;
+	int ndev = 0;
+	int count = 1;
+	int opt;
+	int i, n;
+
+	while ((opt = getopt(argc, argv, "t:n:oah")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'o':
+			oneshot = 1;
+			break;
+		case 'a':
+			auto_power = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	for (i = optind; i < argc && ndev < MAX_DEVICES; i++) {
+		paths[ndev++] = argv[i];
+	}
+	if (ndev == 0) {
+		for (i = 0; i < count && i < MAX_DEVICES; i++) {
+			snprintf(names[i], sizeof(names[i]), "/dev/fpreader%d", i);
+			paths[ndev++] = names[i];
+		}
+	}
+	if (ndev == 0 || seconds <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("%8s %10s %10s %10s %8s %9s %9s %9s %9s %6s %6s %7s\n",
+			"devices", "frames", "frames/s", "per dev", "scaling",
+			"p50 us", "p90 us", "p99 us", "max us", "cpu%", "sys%", "errors");
+
+	for (n = 1; n <= ndev; n++) {
+		memset(threads, 0, sizeof(threads));
+		memset(&cpu0, 0, sizeof(cpu0));
+		read_cpu_times(&cpu0);
+		start = now();
+
+		for (i = 0; i < n; i++) {
+			threads[i].path = paths[i];
+			threads[i].seconds = seconds;
+			threads[i].oneshot = oneshot;
+			threads[i].auto_power = auto_power;
+			if (pthread_create(&threads[i].thread, NULL, bench_run, &threads[i])) {
+				fprintf(stderr, "pthread_create failed\n");
+				return 1;
+			}
+		}
+
+		frames = 0;
+		errors = 0;
+		nr_lat = 0;
+		for (i = 0; i < n; i++) {
+			pthread_join(threads[i].thread, NULL);
+			if (threads[i].err) {
+				fprintf(stderr, "%s: %s\n", threads[i].path, strerror(threads[i].err));
+				return 1;
+			}
+			frames += threads[i].frames;
+			errors += threads[i].errors;
+			nr_lat += threads[i].nr_lat;
+		}
+
+		elapsed = now() - start;
+		memset(&cpu1, 0, sizeof(cpu1));
+		read_cpu_times(&cpu1);
+		rate = frames / elapsed;
+		if (n == 1) {
+			base = rate;
+		}
+
+		lat = malloc((nr_lat ? nr_lat : 1) * sizeof(*lat));
+		if (lat == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		nr_lat = 0;
+		for (i = 0; i < n; i++) {
+			memcpy(lat + nr_lat, threads[i].lat_ns, threads[i].nr_lat * sizeof(*lat));
+			nr_lat += threads[i].nr_lat;
+			free(threads[i].lat_ns);
+		}
+		qsort(lat, nr_lat, sizeof(*lat), cmp_u64);
+
+		total = cpu1.total - cpu0.total;
+		cpu = total > 0 ? 100.0 * (cpu1.busy - cpu0.busy) / total : 0.0;
+		sys = total > 0 ? 100.0 * (cpu1.sys - cpu0.sys) / total : 0.0;
+
+		/* 1.00 is linear: n devices deliver n times what one does */
+		printf("%8d %10llu %10.1f %10.1f %8.2f %9.0f %9.0f %9.0f %9.0f %6.1f %6.1f %7llu\n", n,
+				(unsigned long long)frames, rate, rate / n,
+				base > 0 ? rate / (base * n) : 0.0,
+				percentile(lat, nr_lat, 50), percentile(lat, nr_lat, 90),
+				percentile(lat, nr_lat, 99), nr_lat ? lat[nr_lat - 1] / 1000.0 : 0.0,
+				cpu, sys, (unsigned long long)errors);
+		fflush(stdout);
+		free(lat);
+	}
+
+	return 0;
+}
@@ -0,0 +1,1052 @@
+/*
+ * CUSE stand-in for /dev/fpreaderN, for load-testing the capture tools
+ * without sensors. Frames come from the userspace capture pipeline
+ * (ft9201_user.c) over the mock sensor, so detect latency, transfer
+ * latency and frame content are the mock's options, or are replayed from
+ * a directory of raw frames. On top of that the delivery rate can be
+ * capped, and captures failed or reads cut short at random.
+ *
+ * The file behaves as the driver's does: read() captures one frame, a
+ * capture is shared by everyone waiting on it, one frame per open file
+ * outside of streaming mode, O_NONBLOCK and poll(), and the ioctls
+ * INITIALIZE, GET_STATUS, GET_HEALTH, CAPTURE, SET_STREAMING, GET_FRAME,
+ * READER_STATS and SET_AUTO_POWER (accepted, the mock is not polled
+ * anyway). CUSE has no mmap(), and CAPTURE_MULTI, REGISTERS and
+ * GROUP_CAPTURE fail with EOPNOTSUPP. O_NONBLOCK is taken from open()
+ * for the ioctls, which do not see later fcntl() changes.
+ */
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
+#include <cuse_lowlevel.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ft9201.h"
+#include "ft9201_user.h"
+
+/* the driver's largest streaming queue with its default ring_slots: 16 - 4 urbs - 2 */
+#define CUSE_STREAM_DEPTH_MAX	10
+
+/* frame scoring, with the driver's default gate_block_variance and gate_hash_shift */
+#define CUSE_BLOCK		8
+#define CUSE_BLOCKS_X		(FT9201U_IMG_WIDTH / CUSE_BLOCK)
+#define CUSE_BLOCKS		(CUSE_BLOCKS_X * (FT9201U_IMG_HEIGHT / CUSE_BLOCK))
+#define CUSE_BLOCK_VARIANCE	100
+#define CUSE_HASH_SHIFT		4
+
+struct cuse_config {
+	unsigned int minor;		/* /dev/fpreader<minor> */
+	unsigned int rate;		/* frames/s at most, 0 for no limit */
+	unsigned int error_pct;		/* captures failed with EIO */
+	unsigned int short_pct;		/* read()s returning less than they could */
+	bool debug;
+};
+
+struct cuse_frame {
+	struct ft9201_frame_desc desc;
+	unsigned char data[FT9201U_IMG_SIZE];
+};
+
+/* Per open file, as struct ft9201_reader in the driver */
+struct cuse_reader {
+	struct cuse_reader *next;
+	bool nonblock;			/* O_NONBLOCK at open(), for the ioctls */
+
+	struct cuse_frame frame;	/* the one read() is copying out */
+	unsigned int img_in_copied;
+	unsigned int img_in_filled;
+	bool timetoexit;
+	bool read_waiting;
+	uint32_t read_gen;
+
+	bool streaming;
+	uint32_t stream_overflow;
+	struct cuse_frame *queue;
+	unsigned int depth;
+	unsigned int head;
+	unsigned int count;
+	uint32_t stream_err_gen;
+
+	struct ft9201_reader_stats stats;
+	struct fuse_pollhandle *ph;
+};
+
+static struct cuse_config cfg = {
+	.minor = 0,
+};
+
+static struct ft9201u_mock_config mock = {
+	.detect_ms = 20,
+	.pattern = FT9201U_PATTERN_RIDGES,
+};
+
+static struct ft9201u_config ucfg;
+
+/* replayed frames, the mock sends whatever replay_frame holds */
+static unsigned char *replay;
+static unsigned int replay_frames;
+static unsigned char replay_frame[FT9201U_IMG_SIZE];
+
+/* Everything below is under lock; cond wakes readers, start the capture thread */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t start;
+	bool running;			/* a capture is going or has been asked for */
+	bool stop;
+	uint32_t done_gen;		/* bumped as each capture ends */
+	int capture_err;		/* of the latest capture */
+	struct cuse_frame last;		/* its frame */
+	uint32_t seq;
+	unsigned int streamers;
+	uint32_t stream_err_gen;
+	int stream_err;
+	struct cuse_reader *readers;
+	struct ft9201_status status;
+	struct ft9201_health health;
+	unsigned int seed;
+} dev = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+};
+
+static struct ft9201u_dev *udev;
+
+#define cuse_dbg(...)	do { if (cfg.debug) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#define to_reader(fi)	((struct cuse_reader *)(uintptr_t)(fi)->fh)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* as ft9201_frame_score() */
+static void cuse_frame_score(struct cuse_frame *frame)
+{
+	uint32_t block_sum[CUSE_BLOCKS_X] = { 0 };
+	uint32_t block_sq[CUSE_BLOCKS_X] = { 0 };
+	unsigned int covered = 0;
+	unsigned int x, y, bx;
+	uint64_t sum = 0, sq = 0;
+	uint32_t hash = 0;
+	uint32_t n, var;
+	uint8_t p;
+
+	for (y = 0; y < FT9201U_IMG_HEIGHT; y++) {
+		for (x = 0; x < FT9201U_IMG_WIDTH; x++) {
+			p = frame->data[y * FT9201U_IMG_WIDTH + x];
+			block_sum[x / CUSE_BLOCK] += p;
+			block_sq[x / CUSE_BLOCK] += p * p;
+		}
+
+		if (y % CUSE_BLOCK != CUSE_BLOCK - 1) {
+			continue;
+		}
+
+		n = CUSE_BLOCK * CUSE_BLOCK;
+		for (bx = 0; bx < CUSE_BLOCKS_X; bx++) {
+			var = (block_sq[bx] * n - block_sum[bx] * block_sum[bx]) / (n * n);
+			if (var > CUSE_BLOCK_VARIANCE) {
+				covered++;
+			}
+			hash = hash * 31 + ((block_sum[bx] / n) >> CUSE_HASH_SHIFT);
+
+			sum += block_sum[bx];
+			sq += block_sq[bx];
+			block_sum[bx] = 0;
+			block_sq[bx] = 0;
+		}
+	}
+
+	frame->desc.mean = sum / FT9201U_IMG_SIZE;
+	frame->desc.variance = (sq * FT9201U_IMG_SIZE - sum * sum) /
+			((uint64_t)FT9201U_IMG_SIZE * FT9201U_IMG_SIZE);
+	frame->desc.coverage = covered * 1000 / CUSE_BLOCKS;
+	frame->desc.hash = hash;
+}
+
+static void cuse_notify_polls(void)
+{
+	struct cuse_reader *r;
+
+	for (r = dev.readers; r != NULL; r = r->next) {
+		if (r->ph != NULL) {
+			fuse_lowlevel_notify_poll(r->ph);
+			fuse_pollhandle_destroy(r->ph);
+			r->ph = NULL;
+		}
+	}
+}
+
+static void cuse_reader_push(struct cuse_reader *r, const struct cuse_frame *frame)
+{
+	if (r->count == r->depth) {
+		if (r->stream_overflow == FT9201_STREAM_DROP_NEWEST) {
+			r->stats.dropped_newest++;
+			return;
+		}
+		r->head = (r->head + 1) % r->depth;
+		r->count--;
+		r->stats.dropped_oldest++;
+	}
+
+	r->queue[(r->head + r->count) % r->depth] = *frame;
+	r->count++;
+}
+
+/* A capture ended: publish it, queue it to the streamers and wake everyone */
+static void cuse_capture_done(int ret, const unsigned char *data, const struct ft9201u_capture_info *info)
+{
+	struct ft9201_health *health = &dev.health;
+	struct cuse_frame *frame = &dev.last;
+	struct cuse_reader *r;
+
+	health->last_capture_ns = now_ns();
+	health->detect_polls += info->polls;
+
+	if (ret < 0) {
+		dev.capture_err = ret;
+		health->last_err = ret;
+		health->errors++;
+		if (ret == -ETIMEDOUT) {
+			health->timeouts++;
+		}
+		if (dev.streamers) {
+			dev.stream_err = ret;
+			dev.stream_err_gen++;
+		}
+	} else {
+		memset(&frame->desc, 0, sizeof(frame->desc));
+		frame->desc.version = FT9201_FRAME_DESC_VERSION;
+		frame->desc.size = sizeof(frame->desc);
+		frame->desc.seq = ++dev.seq;
+		frame->desc.len = ret;
+		frame->desc.width = FT9201U_IMG_WIDTH;
+		frame->desc.height = FT9201U_IMG_HEIGHT;
+		frame->desc.detect_polls = info->polls;
+		frame->desc.timestamp_ns = health->last_capture_ns;
+		/* the bulk-in transfers are queued the whole capture, as in the driver */
+		frame->desc.transfer_ns = info->capture_ns;
+		memcpy(frame->data, data, ret);
+		cuse_frame_score(frame);
+
+		dev.capture_err = 0;
+		health->last_err = 0;
+		health->captures++;
+		health->arm_to_detect_ns += info->arm_to_detect_ns;
+		health->detect_to_frame_ns += info->detect_to_frame_ns;
+		health->last_detect_to_frame_ns = info->detect_to_frame_ns;
+
+		for (r = dev.readers; r != NULL; r = r->next) {
+			if (r->streaming) {
+				cuse_reader_push(r, frame);
+			}
+		}
+	}
+
+	/* streaming goes on until an error, which the next read() picks up from */
+	dev.running = dev.streamers && ret >= 0;
+	health->capture_state = dev.running ? FT9201_STATE_ARM : FT9201_STATE_IDLE;
+	dev.done_gen++;
+
+	cuse_notify_polls();
+	pthread_cond_broadcast(&dev.cond);
+}
+
+static void *cuse_capture_thread(void *arg)
+{
+	static unsigned char data[FT9201U_IMG_SIZE];
+	struct ft9201u_capture_info info;
+	unsigned int next_replay = 0;
+	uint64_t next_ns = 0;
+	uint64_t now;
+	int ret;
+
+	(void)arg;
+
+	pthread_mutex_lock(&dev.lock);
+	for (;;) {
+		while (!dev.running && !dev.stop) {
+			pthread_cond_wait(&dev.start, &dev.lock);
+		}
+		if (dev.stop) {
+			break;
+		}
+		dev.health.capture_state = FT9201_STATE_ARM;
+		pthread_mutex_unlock(&dev.lock);
+
+		if (cfg.rate) {
+			now = now_ns();
+			if (now < next_ns) {
+				sleep_until(next_ns);
+			} else {
+				next_ns = now;
+			}
+			next_ns += 1000000000ULL / cfg.rate;
+		}
+		if (replay_frames) {
+			memcpy(replay_frame, replay + (size_t)next_replay * FT9201U_IMG_SIZE, FT9201U_IMG_SIZE);
+			next_replay = (next_replay + 1) % replay_frames;
+		}
+
+		memset(&info, 0, sizeof(info));
+		ret = ft9201u_capture(udev, data, &info);
+		if (ret >= 0 && cfg.error_pct && (unsigned int)rand_r(&dev.seed) % 100 < cfg.error_pct) {
+			ret = -EIO;
+		}
+		cuse_dbg("capture: %d, %u polls, %llu us\n", ret, info.polls,
+				(unsigned long long)info.capture_ns / 1000);
+
+		pthread_mutex_lock(&dev.lock);
+		cuse_capture_done(ret, data, &info);
+	}
+	pthread_mutex_unlock(&dev.lock);
+
+	return NULL;
+}
+
+/* as ft9201_capture_start(): join the running capture or start one */
+static uint32_t cuse_capture_start(void)
+{
+	if (!dev.running) {
+		dev.running = true;
+		dev.health.capture_state = FT9201_STATE_ARM;
+		pthread_cond_signal(&dev.start);
+	}
+
+	return dev.done_gen;
+}
+
+static void cuse_interrupt(fuse_req_t req, void *data)
+{
+	(void)req;
+	(void)data;
+
+	pthread_mutex_lock(&dev.lock);
+	pthread_cond_broadcast(&dev.cond);
+	pthread_mutex_unlock(&dev.lock);
+}
+
+static void cuse_load_frame(struct cuse_reader *r, const struct cuse_frame *frame)
+{
+	uint32_t lag = dev.seq - frame->desc.seq;
+
+	r->frame = *frame;
+	r->img_in_copied = 0;
+	r->img_in_filled = frame->desc.len;
+
+	r->stats.frames++;
+	r->stats.lag = lag;
+	if (lag > r->stats.max_lag) {
+		r->stats.max_lag = lag;
+	}
+}
+
+/* as ft9201_read_collect() */
+static int cuse_read_collect(struct cuse_reader *r)
+{
+	if (!r->read_waiting) {
+		r->read_gen = cuse_capture_start();
+		r->read_waiting = true;
+	}
+
+	if (dev.done_gen == r->read_gen) {
+		return 0;
+	}
+	r->read_waiting = false;
+
+	if (dev.capture_err) {
+		return dev.capture_err;
+	}
+	if (dev.last.desc.len != FT9201U_IMG_SIZE) {
+		return -EINVAL;
+	}
+	cuse_load_frame(r, &dev.last);
+
+	return 1;
+}
+
+/* as ft9201_stream_next() */
+static int cuse_stream_next(struct cuse_reader *r)
+{
+	if (r->count) {
+		cuse_load_frame(r, &r->queue[r->head]);
+		r->head = (r->head + 1) % r->depth;
+		r->count--;
+		r->timetoexit = false;
+		return 1;
+	}
+
+	if (r->stream_err_gen != dev.stream_err_gen) {
+		r->stream_err_gen = dev.stream_err_gen;
+		return dev.stream_err;
+	}
+
+	cuse_capture_start();
+
+	return 0;
+}
+
+/* as ft9201_frame_wait(), with an interrupted request in place of a signal */
+static int cuse_frame_wait(fuse_req_t req, struct cuse_reader *r, bool nonblock)
+{
+	int ret;
+
+	while (true) {
+		ret = r->streaming ? cuse_stream_next(r) : cuse_read_collect(r);
+		if (ret != 0) {
+			return ret < 0 ? ret : 0;
+		}
+
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		if (fuse_req_interrupted(req)) {
+			if (!r->streaming) {
+				r->read_waiting = false;
+			}
+			return -EINTR;
+		}
+
+		pthread_cond_wait(&dev.cond, &dev.lock);
+	}
+}
+
+static void cuse_stream_stop(struct cuse_reader *r)
+{
+	if (!r->streaming) {
+		return;
+	}
+
+	r->streaming = false;
+	dev.streamers--;
+	dev.health.streamers = dev.streamers;
+	free(r->queue);
+	r->queue = NULL;
+	r->count = 0;
+
+	/* a later one-shot read() starts clean instead of at EOF */
+	r->img_in_copied = 0;
+	r->img_in_filled = 0;
+	r->timetoexit = false;
+
+	/* readers blocked in read() on this file go back to one-shot */
+	pthread_cond_broadcast(&dev.cond);
+}
+
+static int cuse_stream_start(struct cuse_reader *r, const struct ft9201_stream *stream)
+{
+	unsigned int depth = stream->depth ? stream->depth : CUSE_STREAM_DEPTH_MAX;
+
+	if (depth > CUSE_STREAM_DEPTH_MAX) {
+		depth = CUSE_STREAM_DEPTH_MAX;
+	}
+	/* the driver's kfifo rounds down to a power of two */
+	while (depth & (depth - 1)) {
+		depth &= depth - 1;
+	}
+
+	r->queue = calloc(depth, sizeof(*r->queue));
+	if (r->queue == NULL) {
+		return -ENOMEM;
+	}
+	r->depth = depth;
+	r->head = 0;
+	r->count = 0;
+	r->stream_overflow = stream->overflow;
+	r->stream_err_gen = dev.stream_err_gen;
+	r->streaming = true;
+	dev.streamers++;
+	dev.health.streamers = dev.streamers;
+
+	cuse_dbg("streaming with a %u frame queue\n", depth);
+	cuse_capture_start();
+
+	return 0;
+}
+
+static void cuse_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+	struct cuse_reader *r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	r->nonblock = fi->flags & O_NONBLOCK;
+
+	pthread_mutex_lock(&dev.lock);
+	r->next = dev.readers;
+	dev.readers = r;
+	pthread_mutex_unlock(&dev.lock);
+
+	fi->fh = (uintptr_t)r;
+	fuse_reply_open(req, fi);
+}
+
+static void cuse_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+	struct cuse_reader *r = to_reader(fi);
+	struct cuse_reader **p;
+
+	pthread_mutex_lock(&dev.lock);
+	cuse_stream_stop(r);
+	for (p = &dev.readers; *p != NULL; p = &(*p)->next) {
+		if (*p == r) {
+			*p = r->next;
+			break;
+		}
+	}
+	if (r->ph != NULL) {
+		fuse_pollhandle_destroy(r->ph);
+	}
+	pthread_mutex_unlock(&dev.lock);
+
+	free(r);
+	fuse_reply_err(req, 0);
+}
+
+/* as ft9201_read_iter(), down to one frame per open file outside streaming */
+static void cuse_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct cuse_reader *r = to_reader(fi);
+	bool nonblock = fi->flags & O_NONBLOCK;
+	unsigned char buf[FT9201U_IMG_SIZE];
+	size_t n = 0;
+	int ret = 0;
+
+	(void)off;
+
+	/* before taking the lock, it runs at once on an interrupted request */
+	fuse_req_interrupt_func(req, cuse_interrupt, NULL);
+
+	pthread_mutex_lock(&dev.lock);
+	while (true) {
+		if (r->img_in_copied == FT9201U_IMG_SIZE && r->img_in_filled == FT9201U_IMG_SIZE) {
+			r->timetoexit = true;
+		}
+		if (r->img_in_copied < r->img_in_filled) {
+			n = r->img_in_filled - r->img_in_copied;
+			if (n > size) {
+				n = size;
+			}
+			if (n > 1 && cfg.short_pct && (unsigned int)rand_r(&dev.seed) % 100 < cfg.short_pct) {
+				n = 1 + rand_r(&dev.seed) % (n - 1);
+			}
+			memcpy(buf, r->frame.data + r->img_in_copied, n);
+			r->img_in_copied += n;
+			break;
+		}
+
+		if (!r->streaming && r->timetoexit) {
+			r->timetoexit = false;
+			break;
+		}
+
+		ret = cuse_frame_wait(req, r, nonblock);
+		if (ret < 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dev.lock);
+
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_buf(req, (const char *)buf, n);
+	}
+}
+
+/* as ft9201_poll() */
+static void cuse_poll(fuse_req_t req, struct fuse_file_info *fi, struct fuse_pollhandle *ph)
+{
+	struct cuse_reader *r = to_reader(fi);
+	unsigned int mask = 0;
+
+	pthread_mutex_lock(&dev.lock);
+	if (r->ph != NULL) {
+		fuse_pollhandle_destroy(r->ph);
+	}
+	r->ph = ph;
+
+	if (r->streaming) {
+		if (r->img_in_copied < r->img_in_filled || r->count ||
+		    r->stream_err_gen != dev.stream_err_gen) {
+			mask = POLLIN | POLLRDNORM;
+		} else {
+			cuse_capture_start();
+		}
+	} else if (r->img_in_filled) {
+		mask = POLLIN | POLLRDNORM;
+	} else {
+		if (!r->read_waiting) {
+			r->read_gen = cuse_capture_start();
+			r->read_waiting = true;
+		}
+		if (dev.done_gen != r->read_gen) {
+			mask = POLLIN | POLLRDNORM;
+		}
+	}
+	pthread_mutex_unlock(&dev.lock);
+
+	fuse_reply_poll(req, mask);
+}
+
+/*
+ * CUSE ioctls are unrestricted: the kernel only knows the argument pointer,
+ * so the memory behind it is asked for with a retry before anything runs.
+ */
+static bool cuse_ioctl_need(fuse_req_t req, void *arg, size_t in_size, size_t out_size,
+		size_t in_bufsz, size_t out_bufsz)
+{
+	struct iovec in = { arg, in_size };
+	struct iovec out = { arg, out_size };
+
+	if (in_bufsz >= in_size && out_bufsz >= out_size) {
+		return false;
+	}
+	fuse_reply_ioctl_retry(req, in_size ? &in : NULL, in_size ? 1 : 0,
+			out_size ? &out : NULL, out_size ? 1 : 0);
+
+	return true;
+}
+
+static int cuse_capture(fuse_req_t req, uint32_t *seq)
+{
+	uint32_t gen;
+	int ret = 0;
+
+	gen = cuse_capture_start();
+	while (dev.done_gen == gen) {
+		if (fuse_req_interrupted(req)) {
+			return -EINTR;
+		}
+		pthread_cond_wait(&dev.cond, &dev.lock);
+	}
+
+	ret = dev.capture_err;
+	*seq = dev.seq;
+
+	return ret;
+}
+
+/* as ft9201_get_frame(), filling in the descriptor and the frame for the reply */
+static int cuse_get_frame(fuse_req_t req, struct cuse_reader *r, struct ft9201_get_frame *gf,
+		unsigned char *data)
+{
+	int ret;
+
+	/* start from a fresh frame, not whatever read() left behind */
+	r->img_in_copied = 0;
+	r->img_in_filled = 0;
+	r->timetoexit = false;
+
+	ret = cuse_frame_wait(req, r, r->nonblock);
+	if (ret < 0) {
+		return ret;
+	}
+
+	gf->desc = r->frame.desc;
+	if (gf->buf_len < r->frame.desc.len) {
+		ret = -ENOSPC;
+	} else {
+		memcpy(data, r->frame.data, r->frame.desc.len);
+	}
+
+	/* the frame is consumed either way, read() continues with the next one */
+	r->img_in_filled = 0;
+
+	return ret;
+}
+
+static void cuse_ioctl_get_frame(fuse_req_t req, struct cuse_reader *r, void *arg,
+		const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	unsigned char data[FT9201U_IMG_SIZE];
+	struct ft9201_get_frame gf;
+	struct iovec in, out[2];
+	size_t len;
+	int ret;
+
+	if (cuse_ioctl_need(req, arg, sizeof(gf), sizeof(gf), in_bufsz, out_bufsz)) {
+		return;
+	}
+	memcpy(&gf, in_buf, sizeof(gf));
+
+	/* then the frame buffer too, as much of it as a frame can fill */
+	len = gf.buf_len < FT9201U_IMG_SIZE ? 0 : FT9201U_IMG_SIZE;
+	if (out_bufsz < sizeof(gf) + len) {
+		in = (struct iovec){ arg, sizeof(gf) };
+		out[0] = (struct iovec){ arg, sizeof(gf) };
+		out[1] = (struct iovec){ (void *)(uintptr_t)gf.buf, len };
+		fuse_reply_ioctl_retry(req, &in, 1, out, len ? 2 : 1);
+		return;
+	}
+
+	pthread_mutex_lock(&dev.lock);
+	ret = cuse_get_frame(req, r, &gf, data);
+	pthread_mutex_unlock(&dev.lock);
+
+	/* the descriptor goes back even when the buffer was too small */
+	if (ret == 0 || ret == -ENOSPC) {
+		out[0] = (struct iovec){ &gf, sizeof(gf) };
+		out[1] = (struct iovec){ data, ret == 0 ? gf.desc.len : 0 };
+		fuse_reply_ioctl_iov(req, ret, out, ret == 0 ? 2 : 1);
+	} else {
+		fuse_reply_err(req, -ret);
+	}
+}
+
+static void cuse_ioctl(fuse_req_t req, int cmd, void *arg, struct fuse_file_info *fi,
+		unsigned int flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	struct cuse_reader *r = to_reader(fi);
+	struct ft9201_reader_stats reader_stats;
+	struct ft9201_stream stream;
+	struct ft9201_health health;
+	struct ft9201_status status;
+	uint32_t seq = 0;
+	int ret;
+
+	(void)flags;
+
+	fuse_req_interrupt_func(req, cuse_interrupt, NULL);
+
+	switch ((unsigned int)cmd) {
+	case FT9201_IOCTL_REQ_INITIALIZE:
+		pthread_mutex_lock(&dev.lock);
+		dev.status.initialized = 1;
+		pthread_mutex_unlock(&dev.lock);
+		fuse_reply_ioctl(req, 0, NULL, 0);
+		break;
+
+	case FT9201_IOCTL_REQ_GET_STATUS:
+		if (cuse_ioctl_need(req, arg, 0, sizeof(status), in_bufsz, out_bufsz)) {
+			return;
+		}
+		pthread_mutex_lock(&dev.lock);
+		status = dev.status;
+		status.last_seq = dev.seq;
+		pthread_mutex_unlock(&dev.lock);
+		fuse_reply_ioctl(req, 0, &status, sizeof(status));
+		break;
+
+	case FT9201_IOCTL_REQ_SET_AUTO_POWER:
+		fuse_reply_ioctl(req, 0, NULL, 0);
+		break;
+
+	case FT9201_IOCTL_REQ_GET_HEALTH:
+		if (cuse_ioctl_need(req, arg, 0, sizeof(health), in_bufsz, out_bufsz)) {
+			return;
+		}
+		pthread_mutex_lock(&dev.lock);
+		health = dev.health;
+		health.last_seq = dev.seq;
+		pthread_mutex_unlock(&dev.lock);
+		fuse_reply_ioctl(req, 0, &health, sizeof(health));
+		break;
+
+	case FT9201_IOCTL_REQ_CAPTURE:
+		if (cuse_ioctl_need(req, arg, 0, sizeof(seq), in_bufsz, out_bufsz)) {
+			return;
+		}
+		pthread_mutex_lock(&dev.lock);
+		ret = cuse_capture(req, &seq);
+		pthread_mutex_unlock(&dev.lock);
+		if (ret < 0) {
+			fuse_reply_err(req, -ret);
+		} else {
+			fuse_reply_ioctl(req, 0, &seq, sizeof(seq));
+		}
+		break;
+
+	case FT9201_IOCTL_REQ_SET_STREAMING:
+		if (cuse_ioctl_need(req, arg, sizeof(stream), 0, in_bufsz, out_bufsz)) {
+			return;
+		}
+		memcpy(&stream, in_buf, sizeof(stream));
+		if (stream.overflow > FT9201_STREAM_DROP_NEWEST) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		ret = 0;
+		pthread_mutex_lock(&dev.lock);
+		cuse_stream_stop(r);
+		if (stream.enable) {
+			ret = cuse_stream_start(r, &stream);
+		}
+		pthread_mutex_unlock(&dev.lock);
+		if (ret < 0) {
+			fuse_reply_err(req, -ret);
+		} else {
+			fuse_reply_ioctl(req, 0, NULL, 0);
+		}
+		break;
+
+	case FT9201_IOCTL_REQ_GET_FRAME:
+		cuse_ioctl_get_frame(req, r, arg, in_buf, in_bufsz, out_bufsz);
+		break;
+
+	case FT9201_IOCTL_REQ_READER_STATS:
+		if (cuse_ioctl_need(req, arg, 0, sizeof(reader_stats), in_bufsz, out_bufsz)) {
+			return;
+		}
+		pthread_mutex_lock(&dev.lock);
+		reader_stats = r->stats;
+		reader_stats.queued = r->streaming ? r->count : 0;
+		pthread_mutex_unlock(&dev.lock);
+		fuse_reply_ioctl(req, 0, &reader_stats, sizeof(reader_stats));
+		break;
+
+	case FT9201_IOCTL_REQ_CAPTURE_MULTI:
+	case FT9201_IOCTL_REQ_REGISTERS:
+	case FT9201_IOCTL_REQ_GROUP_CAPTURE:
+		fuse_reply_err(req, EOPNOTSUPP);
+		break;
+
+	default:
+		fuse_reply_err(req, EINVAL);
+		break;
+	}
+}
+
+static const struct cuse_lowlevel_ops cuse_ops = {
+	.open = cuse_open,
+	.release = cuse_release,
+	.read = cuse_read,
+	.poll = cuse_poll,
+	.ioctl = cuse_ioctl,
+};
+
+static int cuse_name_filter(const struct dirent *d)
+{
+	return d->d_name[0] != '.';
+}
+
+/* Every file in @path, in name order, each one or more raw frames */
+static int cuse_load_dir(const char *path)
+{
+	struct dirent **names;
+	char file[4096];
+	struct stat st;
+	unsigned int frames;
+	unsigned char *p;
+	FILE *f;
+	int i, n;
+	int ret = -1;
+
+	n = scandir(path, &names, cuse_name_filter, alphasort);
+	if (n < 0) {
+		perror(path);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		snprintf(file, sizeof(file), "%s/%s", path, names[i]->d_name);
+		if (stat(file, &st) || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+		if (st.st_size == 0 || st.st_size % FT9201U_IMG_SIZE) {
+			fprintf(stderr, "%s: not a multiple of %d bytes\n", file, FT9201U_IMG_SIZE);
+			goto out;
+		}
+
+		frames = st.st_size / FT9201U_IMG_SIZE;
+		p = realloc(replay, (size_t)(replay_frames + frames) * FT9201U_IMG_SIZE);
+		if (p == NULL) {
+			fprintf(stderr, "out of memory\n");
+			goto out;
+		}
+		replay = p;
+
+		f = fopen(file, "rb");
+		if (f == NULL) {
+			perror(file);
+			goto out;
+		}
+		if (fread(replay + (size_t)replay_frames * FT9201U_IMG_SIZE, FT9201U_IMG_SIZE, frames, f) != frames) {
+			fprintf(stderr, "%s: short read\n", file);
+			fclose(f);
+			goto out;
+		}
+		fclose(f);
+		replay_frames += frames;
+	}
+
+	if (replay_frames == 0) {
+		fprintf(stderr, "%s: no frames\n", path);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	for (i = 0; i < n; i++) {
+		free(names[i]);
+	}
+	free(names);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m minor    create /dev/fpreader<minor> (default 0)\n"
+		"  -d ms       finger detect delay after arming (default 20)\n"
+		"  -j ms       random extra detect delay, up to ms\n"
+		"  -l us       latency of every transfer (default 0)\n"
+		"  -t ms       fail captures with no finger after ms (default: wait for ever)\n"
+		"  -p pattern  frame content: ridges (default), blank, noise or dir:PATH,\n"
+		"              the raw frames of every file in PATH in turn\n"
+		"  -r fps      deliver at most fps frames a second\n"
+		"  -e pct      fail pct%% of captures with EIO\n"
+		"  -s pct      cut pct%% of reads short\n"
+		"  -v          log every capture, and the CUSE requests\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct cuse_info ci = { .flags = CUSE_UNRESTRICTED_IOCTL };
+	char devname[64];
+	const char *dev_info_argv[] = { devname };
+	char *fuse_argv[4];
+	int fuse_argc = 0;
+	pthread_t thread;
+	struct ft9201u_transport *t;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "m:d:j:l:t:p:r:e:s:vh")) != -1) {
+		switch (opt) {
+		case 'm':
+			cfg.minor = atoi(optarg);
+			break;
+		case 'd':
+			mock.detect_ms = atoi(optarg);
+			break;
+		case 'j':
+			mock.jitter_ms = atoi(optarg);
+			break;
+		case 'l':
+			mock.latency_us = atoi(optarg);
+			break;
+		case 't':
+			ucfg.detect_timeout_ms = atoi(optarg);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "ridges")) {
+				mock.pattern = FT9201U_PATTERN_RIDGES;
+			} else if (!strcmp(optarg, "blank")) {
+				mock.pattern = FT9201U_PATTERN_BLANK;
+			} else if (!strcmp(optarg, "noise")) {
+				mock.pattern = FT9201U_PATTERN_NOISE;
+			} else if (!strncmp(optarg, "dir:", 4)) {
+				mock.pattern = FT9201U_PATTERN_FRAME;
+				mock.frame = replay_frame;
+				if (cuse_load_dir(optarg + 4)) {
+					return 1;
+				}
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			cfg.rate = atoi(optarg);
+			break;
+		case 'e':
+			cfg.error_pct = atoi(optarg);
+			break;
+		case 's':
+			cfg.short_pct = atoi(optarg);
+			break;
+		case 'v':
+			cfg.debug = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	dev.seed = getpid();
+	mock.seed = dev.seed;
+	t = ft9201u_mock_create(&mock);
+	if (t == NULL) {
+		fprintf(stderr, "mock: %s\n", strerror(errno));
+		return 1;
+	}
+	udev = ft9201u_open(t, &ucfg);
+	if (udev == NULL) {
+		fprintf(stderr, "open: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* what ft9201_initialize() leaves behind on a working sensor */
+	dev.status.initialized = 1;
+	dev.status.sensor_width = FT9201U_IMG_WIDTH;
+	dev.status.sensor_height = FT9201U_IMG_HEIGHT;
+	dev.status.frame_size = FT9201U_IMG_SIZE;
+
+	if (pthread_create(&thread, NULL, cuse_capture_thread, NULL)) {
+		fprintf(stderr, "pthread_create failed\n");
+		return 1;
+	}
+
+	/* in the foreground, multithreaded: every blocked read() holds a thread */
+	snprintf(devname, sizeof(devname), "DEVNAME=fpreader%u", cfg.minor);
+	ci.dev_info_argc = 1;
+	ci.dev_info_argv = dev_info_argv;
+	fuse_argv[fuse_argc++] = argv[0];
+	fuse_argv[fuse_argc++] = "-f";
+	if (cfg.debug) {
+		fuse_argv[fuse_argc++] = "-d";
+	}
+	fuse_argv[fuse_argc] = NULL;
+
+	ret = cuse_lowlevel_main(fuse_argc, fuse_argv, &ci, &cuse_ops, NULL);
+
+	pthread_mutex_lock(&dev.lock);
+	dev.stop = true;
+	pthread_cond_signal(&dev.start);
+	pthread_mutex_unlock(&dev.lock);
+	pthread_join(thread, NULL);
+
+	ft9201u_close(udev);
+	free(replay);
+
+	return ret ? 1 : 0;
+}
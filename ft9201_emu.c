@@ -0,0 +1,655 @@
+/*
+ * FunctionFS emulator of the FT9201 sensor, for running and benchmarking
+ * the driver without hardware. Bound to dummy_hcd (see ft9201_emu.sh) it
+ * enumerates as 2808:9338 and speaks the vendor protocol the driver uses:
+ *
+ *   0x34, then 0x6f twice	arm the sensor for one frame
+ *   0x34 with wValue 0		leave sensor mode, disarming it
+ *   0x43 (4 bytes in)		finger-detect register, byte 0 set once a
+ *				finger is "seen" detect_ms after arming
+ *   0x35 (wValue bytes)	bulk-in transfer size, a multiple of the
+ *				frame size for bursts of several frames
+ *   bulk-in			one 5120 byte frame per arm, or a burst of
+ *				them back to back
+ *
+ * Any other vendor request is accepted, IN requests read back zeroes.
+ * The frame pattern, the detect delay and error injection are options.
+ */
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FT9201_IMG_WIDTH	0x50
+#define FT9201_IMG_HEIGHT	0x40
+#define FT9201_IMG_SIZE		(FT9201_IMG_WIDTH * FT9201_IMG_HEIGHT)
+
+#define FT9201_REQ_READ_REGISTERS	0x43
+#define FT9201_REQ_START_CAPTURE	0x34
+#define FT9201_REQ_BULK_TRANSFER_SIZE	0x35
+#define FT9201_REQ_ARM			0x6f
+
+/* 0x34 and the two 0x6f that follow it */
+#define FT9201_ARM_STEPS	3
+
+#define EMU_BURST_MAX		8
+
+enum emu_pattern {
+	PATTERN_RIDGES,
+	PATTERN_BLANK,
+	PATTERN_NOISE,
+	PATTERN_FILE,
+};
+
+struct emu_config {
+	unsigned int detect_ms;		/* arm -> finger present */
+	unsigned int jitter_ms;		/* uniform extra detect delay */
+	enum emu_pattern pattern;
+	bool repeat;			/* send the same frame every time */
+	unsigned int stall_pct;		/* control requests answered with a stall */
+	unsigned int short_pct;		/* frames cut to half their size */
+	unsigned int miss_pct;		/* arms that never produce a frame */
+	unsigned int burst_max;		/* longer bursts are refused with a stall */
+	bool verbose;
+};
+
+struct emu_stats {
+	unsigned long arms;
+	unsigned long polls;
+	unsigned long frames;
+	unsigned long bursts;		/* transfers of more than one frame */
+	unsigned long stalls;
+	unsigned long shorts;
+	unsigned long misses;
+};
+
+static struct emu_config cfg = {
+	.detect_ms = 20,
+	.pattern = PATTERN_RIDGES,
+	.burst_max = EMU_BURST_MAX,
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool enabled;			/* the host configured the function */
+	unsigned int arm_step;		/* arm requests seen since the last 0x34 */
+	bool armed;			/* waiting to produce a frame */
+	bool finger;			/* what the detect register reports */
+	unsigned int burst;		/* frames per bulk-in transfer */
+	struct timespec detect_time;
+	unsigned int seed;
+	struct emu_stats stats;
+} emu = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.burst = 1,
+};
+
+static unsigned char file_frame[FT9201_IMG_SIZE];
+static volatile sig_atomic_t stop;
+static int ep0_fd = -1, ep_in_fd = -1;
+
+#define emu_dbg(...)	do { if (cfg.verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+/* htole*() are not constant expressions, the descriptors need these */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x)	(x)
+#define cpu_to_le32(x)	(x)
+#else
+#define cpu_to_le16(x)	((((x) >> 8) & 0xffu) | (((x) & 0xffu) << 8))
+#define cpu_to_le32(x)	((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8) | \
+			 (((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
+#endif
+
+/* interface with one bulk-in and one bulk-out endpoint, as the driver expects */
+static const struct {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct {
+		struct usb_interface_descriptor intf;
+		struct usb_endpoint_descriptor_no_audio in;
+		struct usb_endpoint_descriptor_no_audio out;
+	} __attribute__((packed)) fs_descs, hs_descs;
+} __attribute__((packed)) descriptors = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.length = cpu_to_le32(sizeof(descriptors)),
+		/* the vendor requests go to the device, not the interface */
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC |
+				FUNCTIONFS_ALL_CTRL_RECIP),
+	},
+	.fs_count = cpu_to_le32(3),
+	.hs_count = cpu_to_le32(3),
+	.fs_descs = {
+		.intf = {
+			.bLength = sizeof(descriptors.fs_descs.intf),
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bNumEndpoints = 2,
+			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+			.iInterface = 1,
+		},
+		.in = {
+			.bLength = sizeof(descriptors.fs_descs.in),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 1 | USB_DIR_IN,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = cpu_to_le16(64),
+		},
+		.out = {
+			.bLength = sizeof(descriptors.fs_descs.out),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 2 | USB_DIR_OUT,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = cpu_to_le16(64),
+		},
+	},
+	.hs_descs = {
+		.intf = {
+			.bLength = sizeof(descriptors.hs_descs.intf),
+			.bDescriptorType = USB_DT_INTERFACE,
+			.bNumEndpoints = 2,
+			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+			.iInterface = 1,
+		},
+		.in = {
+			.bLength = sizeof(descriptors.hs_descs.in),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 1 | USB_DIR_IN,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = cpu_to_le16(512),
+		},
+		.out = {
+			.bLength = sizeof(descriptors.hs_descs.out),
+			.bDescriptorType = USB_DT_ENDPOINT,
+			.bEndpointAddress = 2 | USB_DIR_OUT,
+			.bmAttributes = USB_ENDPOINT_XFER_BULK,
+			.wMaxPacketSize = cpu_to_le16(512),
+		},
+	},
+};
+
+#define EMU_STR_INTERFACE	"FT9201 emulator"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		const char str1[sizeof(EMU_STR_INTERFACE)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = cpu_to_le32(sizeof(strings)),
+		.str_count = cpu_to_le32(1),
+		.lang_count = cpu_to_le32(1),
+	},
+	.lang0 = {
+		cpu_to_le16(0x0409),
+		EMU_STR_INTERFACE,
+	},
+};
+
+static bool emu_chance(unsigned int pct)
+{
+	return pct && (unsigned int)(rand_r(&emu.seed) % 100) < pct;
+}
+
+static void timespec_add_ms(struct timespec *ts, unsigned int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void emu_fill_frame(unsigned char *frame, unsigned long n)
+{
+	double angle, period, phase, v;
+	unsigned int seed = n;
+	int x, y;
+
+	switch (cfg.pattern) {
+	case PATTERN_BLANK:
+		memset(frame, 0x80, FT9201_IMG_SIZE);
+		return;
+
+	case PATTERN_FILE:
+		memcpy(frame, file_frame, FT9201_IMG_SIZE);
+		return;
+
+	case PATTERN_NOISE:
+		for (x = 0; x < FT9201_IMG_SIZE; x++) {
+			frame[x] = rand_r(&seed) & 0xff;
+		}
+		return;
+
+	case PATTERN_RIDGES:
+		break;
+	}
+
+	/* parallel ridges whose angle and phase move from one frame to the next */
+	angle = 0.6 + 0.05 * (double)(n % 32);
+	period = 3.0;
+	phase = 0.7 * (double)n;
+	for (y = 0; y < FT9201_IMG_HEIGHT; y++) {
+		for (x = 0; x < FT9201_IMG_WIDTH; x++) {
+			v = 128.0 + 90.0 * sin((x * cos(angle) + y * sin(angle)) / period + phase);
+			v += (int)(rand_r(&seed) % 17) - 8;
+			frame[y * FT9201_IMG_WIDTH + x] = v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
+		}
+	}
+}
+
+/*
+ * Sends one frame, or one burst of them in a single write, per arm,
+ * detect_ms (+ jitter) after the arm sequence ends. Cutting a burst
+ * short halves its last frame.
+ */
+static void *emu_frame_thread(void *arg)
+{
+	static unsigned char frames[EMU_BURST_MAX * FT9201_IMG_SIZE];
+	struct timespec deadline;
+	unsigned long n = 0;
+	unsigned int burst, i;
+	bool miss, cut;
+	ssize_t len;
+	int ret;
+
+	(void)arg;
+
+	while (!stop) {
+		pthread_mutex_lock(&emu.lock);
+		while (!stop && !(emu.enabled && emu.armed)) {
+			pthread_cond_wait(&emu.cond, &emu.lock);
+		}
+
+		/* wait out the detect delay, a new arm sequence restarts it */
+		ret = 0;
+		while (!stop && emu.enabled && emu.armed && ret != ETIMEDOUT) {
+			deadline = emu.detect_time;
+			ret = pthread_cond_timedwait(&emu.cond, &emu.lock, &deadline);
+		}
+		if (stop || !emu.enabled || !emu.armed) {
+			pthread_mutex_unlock(&emu.lock);
+			continue;
+		}
+
+		emu.finger = true;
+		burst = emu.burst;
+		miss = emu_chance(cfg.miss_pct);
+		cut = !miss && emu_chance(cfg.short_pct);
+		if (miss) {
+			/* the host times out and arms again */
+			emu.armed = false;
+			emu.stats.misses++;
+		}
+		pthread_mutex_unlock(&emu.lock);
+
+		if (miss) {
+			emu_dbg("arm %lu: no frame\n", emu.stats.arms);
+			continue;
+		}
+
+		for (i = 0; i < burst; i++) {
+			if (n + i == 0 || !cfg.repeat) {
+				emu_fill_frame(frames + i * FT9201_IMG_SIZE, n + i);
+			} else if (i > 0) {
+				memcpy(frames + i * FT9201_IMG_SIZE, frames, FT9201_IMG_SIZE);
+			}
+		}
+		len = write(ep_in_fd, frames, burst * FT9201_IMG_SIZE - (cut ? FT9201_IMG_SIZE / 2 : 0));
+
+		pthread_mutex_lock(&emu.lock);
+		emu.armed = false;
+		emu.finger = false;
+		if (len > 0) {
+			n += burst;
+			emu.stats.frames += burst;
+			if (burst > 1) {
+				emu.stats.bursts++;
+			}
+			if (cut) {
+				emu.stats.shorts++;
+			}
+		}
+		pthread_mutex_unlock(&emu.lock);
+
+		if (len < 0 && errno != ESHUTDOWN && errno != EINTR) {
+			perror("bulk-in write");
+		}
+		emu_dbg("frame %lu: %zd bytes\n", n, len);
+	}
+
+	return NULL;
+}
+
+/* A vendor OUT request, the arm sequence among them */
+static void emu_out_request(const struct usb_ctrlrequest *setup)
+{
+	pthread_mutex_lock(&emu.lock);
+	if (setup->bRequest == FT9201_REQ_BULK_TRANSFER_SIZE) {
+		emu.burst = le16toh(setup->wValue) / FT9201_IMG_SIZE;
+		if (emu.burst < 1) {
+			emu.burst = 1;
+		}
+		emu_dbg("bursts of %u frames\n", emu.burst);
+	} else if (setup->bRequest == FT9201_REQ_START_CAPTURE && setup->wValue == 0) {
+		emu.arm_step = 0;
+		emu.armed = false;
+		emu.finger = false;
+		emu_dbg("left sensor mode\n");
+	} else if (setup->bRequest == FT9201_REQ_START_CAPTURE) {
+		emu.arm_step = 1;
+		emu.armed = false;
+		emu.finger = false;
+	} else if (setup->bRequest == FT9201_REQ_ARM && emu.arm_step) {
+		emu.arm_step++;
+	}
+
+	if (emu.arm_step == FT9201_ARM_STEPS) {
+		emu.arm_step = 0;
+		emu.armed = true;
+		emu.stats.arms++;
+		clock_gettime(CLOCK_MONOTONIC, &emu.detect_time);
+		timespec_add_ms(&emu.detect_time, cfg.detect_ms +
+				(cfg.jitter_ms ? rand_r(&emu.seed) % (cfg.jitter_ms + 1) : 0));
+		pthread_cond_broadcast(&emu.cond);
+	}
+	pthread_mutex_unlock(&emu.lock);
+}
+
+static void emu_setup(const struct usb_ctrlrequest *setup)
+{
+	unsigned char buf[256] = { 0 };
+	uint16_t length = le16toh(setup->wLength);
+	bool in = setup->bRequestType & USB_DIR_IN;
+	bool stall;
+
+	if (length > sizeof(buf)) {
+		length = sizeof(buf);
+	}
+
+	pthread_mutex_lock(&emu.lock);
+	stall = emu_chance(cfg.stall_pct);
+	/* bursts the sensor cannot do */
+	if (!in && setup->bRequest == FT9201_REQ_BULK_TRANSFER_SIZE &&
+	    le16toh(setup->wValue) > cfg.burst_max * FT9201_IMG_SIZE) {
+		stall = true;
+	}
+	if (stall) {
+		emu.stats.stalls++;
+	}
+	pthread_mutex_unlock(&emu.lock);
+
+	emu_dbg("setup %02x %02x value %04x index %04x length %u%s\n",
+			setup->bRequestType, setup->bRequest, le16toh(setup->wValue),
+			le16toh(setup->wIndex), length, stall ? " (stall)" : "");
+
+	/* a transfer in the wrong direction stalls ep0 */
+	if (stall) {
+		if (in) {
+			if (read(ep0_fd, buf, 0) < 0 && errno != EL2HLT) {
+				perror("ep0 stall");
+			}
+		} else {
+			if (write(ep0_fd, buf, 0) < 0 && errno != EL2HLT) {
+				perror("ep0 stall");
+			}
+		}
+		return;
+	}
+
+	if (!in) {
+		if (read(ep0_fd, buf, length) < 0) {
+			perror("ep0 read");
+		}
+		emu_out_request(setup);
+		return;
+	}
+
+	if (setup->bRequest == FT9201_REQ_READ_REGISTERS) {
+		pthread_mutex_lock(&emu.lock);
+		emu.stats.polls++;
+		buf[0] = emu.finger;
+		pthread_mutex_unlock(&emu.lock);
+	}
+
+	if (write(ep0_fd, buf, length) < 0) {
+		perror("ep0 write");
+	}
+}
+
+static void emu_set_enabled(bool enabled)
+{
+	pthread_mutex_lock(&emu.lock);
+	emu.enabled = enabled;
+	emu.armed = false;
+	if (!enabled) {
+		/* back to single frames, as after a reset */
+		emu.burst = 1;
+	}
+	emu.finger = false;
+	emu.arm_step = 0;
+	pthread_cond_broadcast(&emu.cond);
+	pthread_mutex_unlock(&emu.lock);
+}
+
+static void emu_ep0_loop(void)
+{
+	struct usb_functionfs_event events[4];
+	ssize_t len;
+	int i;
+
+	while (!stop) {
+		len = read(ep0_fd, events, sizeof(events));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("ep0 read");
+			return;
+		}
+
+		for (i = 0; i < len / (ssize_t)sizeof(events[0]); i++) {
+			switch (events[i].type) {
+			case FUNCTIONFS_ENABLE:
+				emu_dbg("enable\n");
+				emu_set_enabled(true);
+				break;
+			case FUNCTIONFS_DISABLE:
+			case FUNCTIONFS_UNBIND:
+			case FUNCTIONFS_SUSPEND:
+				emu_dbg("disable (%u)\n", events[i].type);
+				emu_set_enabled(false);
+				break;
+			case FUNCTIONFS_SETUP:
+				emu_setup(&events[i].u.setup);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+static void emu_stop(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <functionfs mount>\n"
+		"  -d ms       finger detect delay after arming (default 20)\n"
+		"  -j ms       random extra detect delay, up to ms\n"
+		"  -p pattern  frame content: ridges (default), blank, noise or file:PATH\n"
+		"  -r          repeat the first frame every time\n"
+		"  -e pct      stall pct%% of control requests\n"
+		"  -s pct      cut pct%% of frames short\n"
+		"  -m pct      drop the frame of pct%% of arms\n"
+		"  -b frames   longest burst the sensor accepts (default and at most %d)\n"
+		"  -v          log every request and frame\n",
+		prog, EMU_BURST_MAX);
+}
+
+static int emu_load_file(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	size_t len;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	len = fread(file_frame, 1, sizeof(file_frame), f);
+	fclose(f);
+
+	if (len != sizeof(file_frame)) {
+		fprintf(stderr, "%s: expected %d bytes\n", path, FT9201_IMG_SIZE);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa = { .sa_handler = emu_stop };
+	pthread_condattr_t attr;
+	char path[512];
+	pthread_t thread;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:j:p:re:s:m:b:vh")) != -1) {
+		switch (opt) {
+		case 'd':
+			cfg.detect_ms = atoi(optarg);
+			break;
+		case 'j':
+			cfg.jitter_ms = atoi(optarg);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "ridges")) {
+				cfg.pattern = PATTERN_RIDGES;
+			} else if (!strcmp(optarg, "blank")) {
+				cfg.pattern = PATTERN_BLANK;
+			} else if (!strcmp(optarg, "noise")) {
+				cfg.pattern = PATTERN_NOISE;
+			} else if (!strncmp(optarg, "file:", 5)) {
+				cfg.pattern = PATTERN_FILE;
+				if (emu_load_file(optarg + 5)) {
+					return 1;
+				}
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			cfg.repeat = true;
+			break;
+		case 'e':
+			cfg.stall_pct = atoi(optarg);
+			break;
+		case 's':
+			cfg.short_pct = atoi(optarg);
+			break;
+		case 'm':
+			cfg.miss_pct = atoi(optarg);
+			break;
+		case 'b':
+			cfg.burst_max = atoi(optarg);
+			if (cfg.burst_max < 1 || cfg.burst_max > EMU_BURST_MAX) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'v':
+			cfg.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* detect deadlines are on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&emu.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	emu.seed = getpid();
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	snprintf(path, sizeof(path), "%s/ep0", argv[optind]);
+	ep0_fd = open(path, O_RDWR);
+	if (ep0_fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	if (write(ep0_fd, &descriptors, sizeof(descriptors)) < 0) {
+		perror("writing descriptors");
+		return 1;
+	}
+	if (write(ep0_fd, &strings, sizeof(strings)) < 0) {
+		perror("writing strings");
+		return 1;
+	}
+
+	/* endpoint files show up once the descriptors are in */
+	snprintf(path, sizeof(path), "%s/ep1", argv[optind]);
+	ep_in_fd = open(path, O_RDWR);
+	if (ep_in_fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	if (pthread_create(&thread, NULL, emu_frame_thread, NULL)) {
+		fprintf(stderr, "pthread_create failed\n");
+		return 1;
+	}
+
+	fprintf(stderr, "ft9201 emulator ready on %s\n", argv[optind]);
+	emu_ep0_loop();
+
+	stop = 1;
+	pthread_mutex_lock(&emu.lock);
+	pthread_cond_broadcast(&emu.cond);
+	pthread_mutex_unlock(&emu.lock);
+	/* the frame thread may sit in a bulk-in write the host never reads */
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+
+	fprintf(stderr, "arms %lu polls %lu frames %lu bursts %lu short %lu missed %lu stalls %lu\n",
+			emu.stats.arms, emu.stats.polls, emu.stats.frames, emu.stats.bursts,
+			emu.stats.shorts, emu.stats.misses, emu.stats.stalls);
+
+	close(ep_in_fd);
+	close(ep0_fd);
+	return 0;
+}
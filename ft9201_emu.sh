@@ -0,0 +1,123 @@
+#!/bin/sh
+# Emulated FT9201 sensors on dummy_hcd, for running and benchmarking the
+# driver without hardware. Needs root, configfs, libcomposite, dummy_hcd
+# and the ft9201 module loaded or installed.
+#
+#   ft9201_emu.sh start [count] [ft9201_emu options]
+#   ft9201_emu.sh stop
+#   ft9201_emu.sh bench [count] [ft9201_bench options]
+#
+# bench starts count sensors with the default emulator settings, runs
+# ft9201_bench on the fpreader nodes they bring up and stops them again.
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+CONFIGFS=/sys/kernel/config
+GADGETS=$CONFIGFS/usb_gadget
+FFS_ROOT=/dev/ffs-ft9201
+STATE=/run/ft9201_emu
+
+start() {
+	count=${1:-1}
+	[ $# -gt 0 ] && shift
+
+	modprobe libcomposite
+	modprobe dummy_hcd num="$count"
+	modprobe ft9201 2>/dev/null || true
+	mountpoint -q "$CONFIGFS" || mount -t configfs none "$CONFIGFS"
+	mkdir -p "$STATE"
+
+	i=0
+	while [ "$i" -lt "$count" ]; do
+		g=$GADGETS/ft9201_emu$i
+		ffs=$FFS_ROOT$i
+
+		mkdir "$g"
+		echo 0x2808 > "$g/idVendor"
+		echo 0x9338 > "$g/idProduct"
+		mkdir "$g/strings/0x409"
+		echo "ft9201-emu-$i" > "$g/strings/0x409/serialnumber"
+		echo "FT9201 emulator" > "$g/strings/0x409/product"
+		mkdir "$g/configs/c.1"
+		mkdir "$g/functions/ffs.ft9201_emu$i"
+		ln -s "$g/functions/ffs.ft9201_emu$i" "$g/configs/c.1/"
+
+		mkdir -p "$ffs"
+		mount -t functionfs "ft9201_emu$i" "$ffs"
+		"$HERE/ft9201_emu" "$@" "$ffs" &
+		echo $! > "$STATE/emu$i.pid"
+
+		# the endpoint files show up once the emulator wrote its descriptors
+		n=0
+		while [ ! -e "$ffs/ep1" ] && [ "$n" -lt 50 ]; do
+			sleep 0.1
+			n=$((n + 1))
+		done
+
+		echo "dummy_udc.$i" > "$g/UDC"
+		i=$((i + 1))
+	done
+}
+
+stop() {
+	for g in "$GADGETS"/ft9201_emu*; do
+		[ -d "$g" ] || continue
+		i=${g##*ft9201_emu}
+
+		echo "" > "$g/UDC" 2>/dev/null || true
+		if [ -f "$STATE/emu$i.pid" ]; then
+			kill "$(cat "$STATE/emu$i.pid")" 2>/dev/null || true
+			rm -f "$STATE/emu$i.pid"
+		fi
+		sleep 0.1
+		umount "$FFS_ROOT$i" 2>/dev/null || true
+		rmdir "$FFS_ROOT$i" 2>/dev/null || true
+
+		rm -f "$g/configs/c.1/ffs.ft9201_emu$i"
+		rmdir "$g/configs/c.1"
+		rmdir "$g/functions/ffs.ft9201_emu$i"
+		rmdir "$g/strings/0x409"
+		rmdir "$g"
+	done
+	modprobe -r dummy_hcd 2>/dev/null || true
+}
+
+# fpreader nodes that belong to the emulated sensors
+emulated_nodes() {
+	for d in /sys/class/usbmisc/fpreader*; do
+		[ -e "$d" ] || continue
+		serial=$(cat "$d/device/../serial" 2>/dev/null || true)
+		case "$serial" in
+		ft9201-emu-*) echo "/dev/${d##*/}" ;;
+		esac
+	done
+}
+
+bench() {
+	count=${1:-1}
+	[ $# -gt 0 ] && shift
+
+	start "$count"
+	trap stop EXIT INT TERM
+
+	n=0
+	while [ "$(emulated_nodes | wc -l)" -lt "$count" ] && [ "$n" -lt 100 ]; do
+		sleep 0.1
+		n=$((n + 1))
+	done
+
+	# shellcheck disable=SC2046
+	"$HERE/ft9201_bench" "$@" $(emulated_nodes)
+}
+
+cmd=${1:-}
+[ $# -gt 0 ] && shift
+case "$cmd" in
+start) start "$@" ;;
+stop) stop ;;
+bench) bench "$@" ;;
+*)
+	echo "Usage: $0 start [count] [emulator options] | stop | bench [count] [bench options]" >&2
+	exit 1
+	;;
+esac
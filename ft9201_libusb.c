@@ -0,0 +1,264 @@
+/*
+ * libusb transport for the userspace backend, on the asynchronous API:
+ * every ft9201u_xfer gets a libusb_transfer on first submit, kept until it
+ * is released, and completions run from libusb's event handling. The
+ * kernel module, if bound, is detached while the interface is claimed.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "ft9201_user.h"
+
+struct lusb {
+	struct ft9201u_transport t;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	unsigned char ep_in;
+};
+
+#define to_lusb(t)	((struct lusb *)(t))
+
+static int lusb_errno(int err)
+{
+	switch (err) {
+	case LIBUSB_ERROR_IO:
+		return -EIO;
+	case LIBUSB_ERROR_INVALID_PARAM:
+		return -EINVAL;
+	case LIBUSB_ERROR_ACCESS:
+		return -EACCES;
+	case LIBUSB_ERROR_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_ERROR_NOT_FOUND:
+		return -ENOENT;
+	case LIBUSB_ERROR_BUSY:
+		return -EBUSY;
+	case LIBUSB_ERROR_TIMEOUT:
+		return -ETIMEDOUT;
+	case LIBUSB_ERROR_OVERFLOW:
+		return -EOVERFLOW;
+	case LIBUSB_ERROR_PIPE:
+		return -EPIPE;
+	case LIBUSB_ERROR_INTERRUPTED:
+		return -EINTR;
+	case LIBUSB_ERROR_NO_MEM:
+		return -ENOMEM;
+	case LIBUSB_ERROR_NOT_SUPPORTED:
+		return -EOPNOTSUPP;
+	default:
+		return -EIO;
+	}
+}
+
+static int lusb_status(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return -ETIMEDOUT;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return -ECANCELED;
+	case LIBUSB_TRANSFER_STALL:
+		return -EPIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return -EOVERFLOW;
+	default:
+		return -EIO;
+	}
+}
+
+static void LIBUSB_CALL lusb_complete(struct libusb_transfer *transfer)
+{
+	struct ft9201u_xfer *xfer = transfer->user_data;
+	unsigned char *data = transfer->buffer;
+
+	xfer->status = lusb_status(transfer->status);
+	xfer->actual_length = transfer->actual_length;
+
+	/* control data follows the setup packet in the transfer's buffer */
+	if (xfer->type == FT9201U_XFER_CONTROL) {
+		data = libusb_control_transfer_get_data(transfer);
+		if ((xfer->request_type & FT9201U_DIR_IN) && xfer->actual_length) {
+			memcpy(xfer->data, data, xfer->actual_length);
+		}
+	}
+
+	xfer->complete(xfer);
+}
+
+static int lusb_submit(struct ft9201u_transport *t, struct ft9201u_xfer *xfer)
+{
+	struct lusb *l = to_lusb(t);
+	struct libusb_transfer *transfer = xfer->priv;
+	unsigned char *buf;
+
+	if (transfer == NULL) {
+		transfer = libusb_alloc_transfer(0);
+		if (transfer == NULL) {
+			return -ENOMEM;
+		}
+
+		if (xfer->type == FT9201U_XFER_CONTROL) {
+			buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + xfer->length);
+			if (buf == NULL) {
+				libusb_free_transfer(transfer);
+				return -ENOMEM;
+			}
+			libusb_fill_control_setup(buf, xfer->request_type, xfer->request, xfer->value,
+					xfer->index, xfer->length);
+			libusb_fill_control_transfer(transfer, l->handle, buf, lusb_complete, xfer,
+					xfer->timeout_ms);
+			transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		} else {
+			/* bulk-in lands straight in the pipeline's buffer */
+			libusb_fill_bulk_transfer(transfer, l->handle, l->ep_in, xfer->data, xfer->length,
+					lusb_complete, xfer, xfer->timeout_ms);
+		}
+		xfer->priv = transfer;
+	}
+
+	/* OUT control data is taken at submit time, like usb_control_msg_send() */
+	if (xfer->type == FT9201U_XFER_CONTROL && !(xfer->request_type & FT9201U_DIR_IN) && xfer->length) {
+		memcpy(libusb_control_transfer_get_data(transfer), xfer->data, xfer->length);
+	}
+
+	return lusb_errno(libusb_submit_transfer(transfer));
+}
+
+static void lusb_cancel(struct ft9201u_transport *t, struct ft9201u_xfer *xfer)
+{
+	(void)t;
+
+	/* fails harmlessly on a transfer that is not in flight */
+	if (xfer->priv != NULL) {
+		libusb_cancel_transfer(xfer->priv);
+	}
+}
+
+static int lusb_handle_events(struct ft9201u_transport *t, unsigned int timeout_us)
+{
+	struct lusb *l = to_lusb(t);
+	struct timeval tv = {
+		.tv_sec = timeout_us / 1000000,
+		.tv_usec = timeout_us % 1000000,
+	};
+	int ret;
+
+	ret = libusb_handle_events_timeout_completed(l->ctx, &tv, NULL);
+
+	return ret ? lusb_errno(ret) : 0;
+}
+
+static void lusb_release(struct ft9201u_transport *t, struct ft9201u_xfer *xfer)
+{
+	(void)t;
+
+	/* frees the control buffer along with it */
+	libusb_free_transfer(xfer->priv);
+	xfer->priv = NULL;
+}
+
+static void lusb_destroy(struct ft9201u_transport *t)
+{
+	struct lusb *l = to_lusb(t);
+
+	libusb_release_interface(l->handle, 0);
+	libusb_close(l->handle);
+	libusb_exit(l->ctx);
+	free(l);
+}
+
+static const struct ft9201u_transport_ops lusb_ops = {
+	.submit = lusb_submit,
+	.cancel = lusb_cancel,
+	.handle_events = lusb_handle_events,
+	.release = lusb_release,
+	.destroy = lusb_destroy,
+};
+
+/* the first bulk-in endpoint of interface 0, as the driver's probe finds it */
+static int lusb_find_ep_in(struct lusb *l)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *alt;
+	int ret, i;
+
+	ret = libusb_get_active_config_descriptor(libusb_get_device(l->handle), &config);
+	if (ret) {
+		return lusb_errno(ret);
+	}
+
+	ret = -ENODEV;
+	if (config->bNumInterfaces > 0 && config->interface[0].num_altsetting > 0) {
+		alt = &config->interface[0].altsetting[0];
+		for (i = 0; i < alt->bNumEndpoints; i++) {
+			if ((alt->endpoint[i].bEndpointAddress & LIBUSB_ENDPOINT_IN) &&
+			    (alt->endpoint[i].bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+			    LIBUSB_TRANSFER_TYPE_BULK) {
+				l->ep_in = alt->endpoint[i].bEndpointAddress;
+				ret = 0;
+				break;
+			}
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return ret;
+}
+
+struct ft9201u_transport *ft9201u_libusb_open(void)
+{
+	struct lusb *l;
+	int ret;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL) {
+		return NULL;
+	}
+	l->t.ops = &lusb_ops;
+
+	ret = libusb_init(&l->ctx);
+	if (ret) {
+		ret = lusb_errno(ret);
+		goto err_free;
+	}
+
+	l->handle = libusb_open_device_with_vid_pid(l->ctx, FT9201U_VENDOR_ID, FT9201U_PRODUCT_ID);
+	if (l->handle == NULL) {
+		ret = -ENODEV;
+		goto err_exit;
+	}
+
+	/* ft9201.ko gives the interface back when we let go of it */
+	libusb_set_auto_detach_kernel_driver(l->handle, 1);
+	ret = libusb_claim_interface(l->handle, 0);
+	if (ret) {
+		ret = lusb_errno(ret);
+		goto err_close;
+	}
+
+	ret = lusb_find_ep_in(l);
+	if (ret) {
+		goto err_release;
+	}
+
+	return &l->t;
+
+err_release:
+	libusb_release_interface(l->handle, 0);
+err_close:
+	libusb_close(l->handle);
+err_exit:
+	libusb_exit(l->ctx);
+err_free:
+	free(l);
+	errno = -ret;
+	return NULL;
+}
@@ -0,0 +1,298 @@
+/*
+ * Load driver for the capture tools: runs a tool (fingprint, ft9201_util
+ * ...) over and over against one or more devices from several workers at
+ * once, and reports how many runs a second went through and their latency
+ * percentiles. Meant for ft9201_cuse devices, which deliver frames as fast
+ * as they are asked for; real sensors only produce frames while touched.
+ *
+ * Each worker runs the tool in a directory of its own, since the tools
+ * write img.raw and friends to the current one, and a run counts as bad
+ * unless it exits with 0 and leaves a whole frame in the check file.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_SIZE	5120
+#define MAX_DEVICES	64
+#define MAX_WORKERS	256
+#define MAX_ARGS	32
+
+struct load_worker {
+	pthread_t thread;
+	const char *device;
+	char dir[64];
+	uint64_t runs;
+	uint64_t failed;		/* exited non-zero or died */
+	uint64_t bad_frames;		/* exited 0 without a whole frame */
+	uint64_t *lat_ns;
+	size_t nr_lat;
+	size_t max_lat;
+	int err;
+};
+
+static char *cmd_args[MAX_ARGS];
+static int cmd_argc;
+static const char *check_file = "img.raw";
+static double seconds = 10.0;
+static double deadline;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void add_lat(struct load_worker *w, uint64_t ns)
+{
+	uint64_t *lat;
+
+	if (w->nr_lat == w->max_lat) {
+		w->max_lat = w->max_lat ? w->max_lat * 2 : 1024;
+		lat = realloc(w->lat_ns, w->max_lat * sizeof(*lat));
+		if (lat == NULL) {
+			return;
+		}
+		w->lat_ns = lat;
+	}
+	w->lat_ns[w->nr_lat++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank, in milliseconds */
+static double percentile(const uint64_t *sorted, size_t n, double pct)
+{
+	size_t i;
+
+	if (n == 0) {
+		return 0.0;
+	}
+	i = (size_t)(pct / 100.0 * n);
+	return sorted[i < n ? i : n - 1] / 1e6;
+}
+
+/* One run of the tool, {} in its arguments replaced by the device */
+static int load_run(struct load_worker *w)
+{
+	char *argv[MAX_ARGS + 1];
+	int status;
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < cmd_argc; i++) {
+		argv[i] = strcmp(cmd_args[i], "{}") ? cmd_args[i] : (char *)w->device;
+	}
+	argv[i] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		return -errno;
+	}
+	if (pid == 0) {
+		/* keep the tools' chatter out of the report */
+		if (!freopen("/dev/null", "w", stdout)) {
+			_exit(127);
+		}
+		if (chdir(w->dir)) {
+			_exit(127);
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		return -errno;
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static void *load_worker_run(void *arg)
+{
+	struct load_worker *w = arg;
+	char path[128];
+	struct stat st;
+	uint64_t start;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", w->dir, check_file);
+
+	while (now() < deadline) {
+		unlink(path);
+
+		start = now_ns();
+		ret = load_run(w);
+		if (ret < 0) {
+			w->err = -ret;
+			break;
+		}
+		add_lat(w, now_ns() - start);
+		w->runs++;
+
+		if (ret) {
+			w->failed++;
+		} else if (stat(path, &st) || st.st_size != FRAME_SIZE) {
+			w->bad_frames++;
+		}
+	}
+
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] device ... -- command [args]\n"
+		"Runs command, {} in its arguments being the device, until time is up.\n"
+		"  -t seconds  run for this long (default 10)\n"
+		"  -w workers  runs going at once, spread over the devices (default 1 per device)\n"
+		"  -c file     frame the command leaves behind, relative to its directory\n"
+		"              (default img.raw)\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct load_worker workers[MAX_WORKERS];
+	const char *devices[MAX_DEVICES];
+	uint64_t runs = 0, failed = 0, bad = 0;
+	char tmpl[] = "/tmp/ft9201_load.XXXXXX";
+	char *base;
+	double start, elapsed;
+	uint64_t *lat;
+	size_t nr_lat = 0;
+	int nworkers = 0;
+	int ndev = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "+t:w:c:h")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			break;
+		case 'c':
+			check_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	for (i = optind; i < argc && strcmp(argv[i], "--"); i++) {
+		if (ndev < MAX_DEVICES) {
+			devices[ndev++] = argv[i];
+		}
+	}
+	for (i++; i < argc && cmd_argc < MAX_ARGS; i++) {
+		cmd_args[cmd_argc++] = argv[i];
+	}
+	if (nworkers == 0) {
+		nworkers = ndev;
+	}
+	if (ndev == 0 || cmd_argc == 0 || nworkers < 1 || nworkers > MAX_WORKERS || seconds <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* relative commands are found from where we were started, not the worker's directory */
+	if (strchr(cmd_args[0], '/') && cmd_args[0][0] != '/') {
+		base = realpath(cmd_args[0], NULL);
+		if (base == NULL) {
+			perror(cmd_args[0]);
+			return 1;
+		}
+		cmd_args[0] = base;
+	}
+
+	base = mkdtemp(tmpl);
+	if (base == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		workers[i].device = devices[i % ndev];
+		snprintf(workers[i].dir, sizeof(workers[i].dir), "%s/%d", base, i);
+		if (mkdir(workers[i].dir, 0700)) {
+			perror(workers[i].dir);
+			return 1;
+		}
+	}
+
+	start = now();
+	deadline = start + seconds;
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, load_worker_run, &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].err) {
+			fprintf(stderr, "worker %d: %s\n", i, strerror(workers[i].err));
+			return 1;
+		}
+		runs += workers[i].runs;
+		failed += workers[i].failed;
+		bad += workers[i].bad_frames;
+		nr_lat += workers[i].nr_lat;
+	}
+	elapsed = now() - start;
+
+	lat = malloc((nr_lat ? nr_lat : 1) * sizeof(*lat));
+	if (lat == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	nr_lat = 0;
+	for (i = 0; i < nworkers; i++) {
+		memcpy(lat + nr_lat, workers[i].lat_ns, workers[i].nr_lat * sizeof(*lat));
+		nr_lat += workers[i].nr_lat;
+		free(workers[i].lat_ns);
+	}
+	qsort(lat, nr_lat, sizeof(*lat), cmp_u64);
+
+	printf("%8s %8s %10s %10s %9s %9s %9s %9s %9s %8s %8s\n",
+			"devices", "workers", "runs", "runs/s", "p50 ms", "p90 ms", "p99 ms",
+			"p99.9 ms", "max ms", "failed", "bad");
+	printf("%8d %8d %10llu %10.1f %9.2f %9.2f %9.2f %9.2f %9.2f %8llu %8llu\n",
+			ndev, nworkers, (unsigned long long)runs, runs / elapsed,
+			percentile(lat, nr_lat, 50), percentile(lat, nr_lat, 90),
+			percentile(lat, nr_lat, 99), percentile(lat, nr_lat, 99.9),
+			nr_lat ? lat[nr_lat - 1] / 1e6 : 0.0,
+			(unsigned long long)failed, (unsigned long long)bad);
+	printf("worker directories are under %s\n", base);
+
+	free(lat);
+	return failed || bad ? 1 : 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * In-process mock FT9201 transport for the userspace backend. It answers
+ * the vendor protocol the way ft9201_emu does on a real bus: 0x34 then
+ * 0x6f twice arm the sensor, the finger-detect register (0x43) reads
+ * non-zero detect_ms (+ jitter) after arming, and one frame goes out on a
+ * queued bulk-in transfer at that moment. Every transfer takes latency_us.
+ * With both at 0 nothing ever sleeps and captures run at CPU speed.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ft9201_user.h"
+
+#define MOCK_ARM_STEPS		3
+
+struct mock_xfer {
+	struct ft9201u_xfer *xfer;
+	struct mock_xfer *next;		/* on pending or done */
+	uint64_t due_ns;		/* completes then, done list only */
+	bool queued;
+};
+
+struct mock {
+	struct ft9201u_transport t;
+	struct ft9201u_mock_config cfg;
+	struct mock_xfer *pending;	/* bulk-in, waiting for a frame */
+	struct mock_xfer *done;		/* completing once due */
+	unsigned int arm_step;		/* arm requests seen since the last 0x34 */
+	bool armed;
+	uint64_t detect_ns;		/* the finger shows up then */
+	unsigned long frames;
+	unsigned int seed;
+};
+
+#define to_mock(t)	((struct mock *)(t))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mock_sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* same patterns as ft9201_emu */
+static void mock_fill_frame(struct mock *m, unsigned char *frame, unsigned long n)
+{
+	double angle, period, phase, v;
+	unsigned int seed = n;
+	int x, y;
+
+	switch (m->cfg.pattern) {
+	case FT9201U_PATTERN_BLANK:
+		memset(frame, 0x80, FT9201U_IMG_SIZE);
+		return;
+
+	case FT9201U_PATTERN_FRAME:
+		memcpy(frame, m->cfg.frame, FT9201U_IMG_SIZE);
+		return;
+
+	case FT9201U_PATTERN_NOISE:
+		for (x = 0; x < FT9201U_IMG_SIZE; x++) {
+			frame[x] = rand_r(&seed) & 0xff;
+		}
+		return;
+
+	case FT9201U_PATTERN_RIDGES:
+		break;
+	}
+
+	angle = 0.6 + 0.05 * (double)(n % 32);
+	period = 3.0;
+	phase = 0.7 * (double)n;
+	for (y = 0; y < FT9201U_IMG_HEIGHT; y++) {
+		for (x = 0; x < FT9201U_IMG_WIDTH; x++) {
+			v = 128.0 + 90.0 * sin((x * cos(angle) + y * sin(angle)) / period + phase);
+			v += (int)(rand_r(&seed) % 17) - 8;
+			frame[y * FT9201U_IMG_WIDTH + x] = v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
+		}
+	}
+}
+
+static void mock_complete_later(struct mock *m, struct mock_xfer *mx, int status, unsigned int len, uint64_t now)
+{
+	struct mock_xfer **p;
+
+	mx->xfer->status = status;
+	mx->xfer->actual_length = len;
+	mx->due_ns = now + m->cfg.latency_us * 1000ULL;
+
+	/* in order of submission, the latency is the same for all */
+	for (p = &m->done; *p != NULL; p = &(*p)->next) {
+	}
+	mx->next = NULL;
+	*p = mx;
+}
+
+static void mock_control(struct mock *m, struct mock_xfer *mx, uint64_t now)
+{
+	struct ft9201u_xfer *xfer = mx->xfer;
+	unsigned int len = 0;
+	unsigned int jitter;
+
+	if (xfer->request_type & FT9201U_DIR_IN) {
+		/* any register reads back zero but the finger-detect one */
+		memset(xfer->data, 0, xfer->length);
+		if (xfer->request == FT9201U_REQ_READ_REGISTERS && xfer->length > 0) {
+			xfer->data[0] = m->armed && now >= m->detect_ns;
+		}
+		len = xfer->length;
+	} else if (xfer->request == FT9201U_REQ_START_CAPTURE && xfer->value == 0) {
+		/* leaves sensor mode */
+		m->arm_step = 0;
+		m->armed = false;
+	} else if (xfer->request == FT9201U_REQ_START_CAPTURE) {
+		m->arm_step = 1;
+		m->armed = false;
+	} else if (xfer->request == FT9201U_REQ_ARM && m->arm_step) {
+		m->arm_step++;
+	}
+
+	if (m->arm_step == MOCK_ARM_STEPS) {
+		m->arm_step = 0;
+		m->armed = true;
+		jitter = m->cfg.jitter_ms ? rand_r(&m->seed) % (m->cfg.jitter_ms + 1) : 0;
+		/* counted from when the host sees the last arm request complete */
+		m->detect_ns = now + m->cfg.latency_us * 1000ULL + (m->cfg.detect_ms + jitter) * 1000000ULL;
+	}
+
+	mock_complete_later(m, mx, 0, len, now);
+}
+
+/* The finger is there: the frame goes out on the oldest bulk-in transfer */
+static bool mock_send_frame(struct mock *m, uint64_t now)
+{
+	struct mock_xfer *mx = m->pending;
+
+	if (!m->armed || now < m->detect_ns || mx == NULL) {
+		return false;
+	}
+
+	m->pending = mx->next;
+	m->armed = false;
+	mock_fill_frame(m, mx->xfer->data, m->frames++);
+	mock_complete_later(m, mx, 0, FT9201U_IMG_SIZE, now);
+
+	return true;
+}
+
+static int mock_submit(struct ft9201u_transport *t, struct ft9201u_xfer *xfer)
+{
+	struct mock *m = to_mock(t);
+	struct mock_xfer *mx = xfer->priv;
+	struct mock_xfer **p;
+
+	if (mx == NULL) {
+		mx = calloc(1, sizeof(*mx));
+		if (mx == NULL) {
+			return -ENOMEM;
+		}
+		mx->xfer = xfer;
+		xfer->priv = mx;
+	}
+	if (mx->queued) {
+		return -EBUSY;
+	}
+	mx->queued = true;
+
+	if (xfer->type == FT9201U_XFER_CONTROL) {
+		mock_control(m, mx, now_ns());
+		return 0;
+	}
+
+	if (xfer->length < FT9201U_IMG_SIZE) {
+		mx->queued = false;
+		return -EINVAL;
+	}
+	for (p = &m->pending; *p != NULL; p = &(*p)->next) {
+	}
+	mx->next = NULL;
+	*p = mx;
+
+	return 0;
+}
+
+static bool mock_unlink(struct mock_xfer **list, struct mock_xfer *mx)
+{
+	struct mock_xfer **p;
+
+	for (p = list; *p != NULL; p = &(*p)->next) {
+		if (*p == mx) {
+			*p = mx->next;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void mock_cancel(struct ft9201u_transport *t, struct ft9201u_xfer *xfer)
+{
+	struct mock *m = to_mock(t);
+	struct mock_xfer *mx = xfer->priv;
+
+	/* control transfers have already been answered, they just complete */
+	if (mx != NULL && mx->queued && mock_unlink(&m->pending, mx)) {
+		mock_complete_later(m, mx, -ECANCELED, 0, now_ns());
+		mx->due_ns = 0;
+	}
+}
+
+static int mock_handle_events(struct ft9201u_transport *t, unsigned int timeout_us)
+{
+	struct mock *m = to_mock(t);
+	uint64_t end = now_ns() + timeout_us * 1000ULL;
+	struct mock_xfer *mx;
+	uint64_t now, next;
+	bool ran = false;
+
+	for (;;) {
+		now = now_ns();
+		mock_send_frame(m, now);
+
+		/* complete everything due; callbacks may submit more */
+		while (m->done != NULL && m->done->due_ns <= now) {
+			mx = m->done;
+			m->done = mx->next;
+			mx->queued = false;
+			mx->xfer->complete(mx->xfer);
+			ran = true;
+		}
+		if (ran || now >= end) {
+			return 0;
+		}
+
+		next = end;
+		if (m->done != NULL && m->done->due_ns < next) {
+			next = m->done->due_ns;
+		}
+		if (m->armed && m->pending != NULL && m->detect_ns < next) {
+			next = m->detect_ns;
+		}
+		mock_sleep_until(next);
+	}
+}
+
+static void mock_release(struct ft9201u_transport *t, struct ft9201u_xfer *xfer)
+{
+	(void)t;
+
+	free(xfer->priv);
+	xfer->priv = NULL;
+}
+
+static void mock_destroy(struct ft9201u_transport *t)
+{
+	free(to_mock(t));
+}
+
+static const struct ft9201u_transport_ops mock_ops = {
+	.submit = mock_submit,
+	.cancel = mock_cancel,
+	.handle_events = mock_handle_events,
+	.release = mock_release,
+	.destroy = mock_destroy,
+};
+
+struct ft9201u_transport *ft9201u_mock_create(const struct ft9201u_mock_config *cfg)
+{
+	struct mock *m;
+
+	if (cfg->pattern == FT9201U_PATTERN_FRAME && cfg->frame == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		return NULL;
+	}
+	m->t.ops = &mock_ops;
+	m->cfg = *cfg;
+	m->seed = cfg->seed;
+
+	return &m->t;
+}
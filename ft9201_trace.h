@@ -0,0 +1,221 @@
+/*
+ * Tracepoints for the FT9201 capture path, under events/ft9201/.
+ *
+ * A capture shows up as ft9201_capture_start, an ft9201_arm_msg for
+ * each control urb of the arm sequence (none if the sensor was already
+ * armed), one ft9201_detect_poll per finger-detect register read, the
+ * ft9201_bulk_end that delivered the frame and ft9201_capture_done,
+ * followed by one ft9201_copy_to_user per read() of that frame. Frames
+ * are matched up by seq and devices by the fpreader minor. Recovery
+ * from transfer errors logs one ft9201_recover per attempt.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ft9201
+
+#if !defined(_FT9201_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FT9201_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ft9201_capture_start,
+	TP_PROTO(int minor, u32 gen, bool streaming),
+	TP_ARGS(minor, gen, streaming),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, gen)
+		__field(bool, streaming)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->gen = gen;
+		__entry->streaming = streaming;
+	),
+
+	TP_printk("fpreader%d gen=%u streaming=%d",
+		__entry->minor, __entry->gen, __entry->streaming)
+);
+
+TRACE_EVENT(ft9201_arm_msg,
+	TP_PROTO(int minor, unsigned int step, u8 request, u16 value, u16 index,
+		 int ret, u64 duration_ns),
+	TP_ARGS(minor, step, request, value, index, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned int, step)
+		__field(u8, request)
+		__field(u16, value)
+		__field(u16, index)
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->step = step;
+		__entry->request = request;
+		__entry->value = value;
+		__entry->index = index;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("fpreader%d step=%u request=0x%02x value=0x%04x index=0x%04x ret=%d duration_ns=%llu",
+		__entry->minor, __entry->step, __entry->request, __entry->value,
+		__entry->index, __entry->ret, __entry->duration_ns)
+);
+
+TRACE_EVENT(ft9201_detect_poll,
+	TP_PROTO(int minor, u64 poll, bool finger, unsigned int interval_us,
+		 int ret, u64 duration_ns),
+	TP_ARGS(minor, poll, finger, interval_us, ret, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u64, poll)
+		__field(bool, finger)
+		__field(unsigned int, interval_us)
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->poll = poll;
+		__entry->finger = finger;
+		__entry->interval_us = interval_us;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("fpreader%d poll=%llu finger=%d next_us=%u ret=%d duration_ns=%llu",
+		__entry->minor, __entry->poll, __entry->finger,
+		__entry->interval_us, __entry->ret, __entry->duration_ns)
+);
+
+TRACE_EVENT(ft9201_bulk_start,
+	TP_PROTO(int minor, unsigned int slot, u32 length, int ret),
+	TP_ARGS(minor, slot, length, ret),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned int, slot)
+		__field(u32, length)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->slot = slot;
+		__entry->length = length;
+		__entry->ret = ret;
+	),
+
+	TP_printk("fpreader%d slot=%u length=%u ret=%d",
+		__entry->minor, __entry->slot, __entry->length, __entry->ret)
+);
+
+TRACE_EVENT(ft9201_bulk_end,
+	TP_PROTO(int minor, unsigned int slot, u32 seq, int status, u32 actual_length),
+	TP_ARGS(minor, slot, seq, status, actual_length),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned int, slot)
+		__field(u32, seq)
+		__field(int, status)
+		__field(u32, actual_length)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->slot = slot;
+		__entry->seq = seq;
+		__entry->status = status;
+		__entry->actual_length = actual_length;
+	),
+
+	TP_printk("fpreader%d slot=%u seq=%u status=%d actual_length=%u",
+		__entry->minor, __entry->slot, __entry->seq,
+		__entry->status, __entry->actual_length)
+);
+
+TRACE_EVENT(ft9201_capture_done,
+	TP_PROTO(int minor, u32 seq, int err, u64 capture_ns),
+	TP_ARGS(minor, seq, err, capture_ns),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, seq)
+		__field(int, err)
+		__field(u64, capture_ns)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->seq = seq;
+		__entry->err = err;
+		__entry->capture_ns = capture_ns;
+	),
+
+	TP_printk("fpreader%d seq=%u err=%d capture_ns=%llu",
+		__entry->minor, __entry->seq, __entry->err, __entry->capture_ns)
+);
+
+TRACE_EVENT(ft9201_recover,
+	TP_PROTO(int minor, unsigned int attempt, bool reset, int ret),
+	TP_ARGS(minor, attempt, reset, ret),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(unsigned int, attempt)
+		__field(bool, reset)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->attempt = attempt;
+		__entry->reset = reset;
+		__entry->ret = ret;
+	),
+
+	TP_printk("fpreader%d attempt=%u reset=%d ret=%d",
+		__entry->minor, __entry->attempt, __entry->reset, __entry->ret)
+);
+
+TRACE_EVENT(ft9201_copy_to_user,
+	TP_PROTO(int minor, u32 seq, size_t offset, size_t bytes, int ret),
+	TP_ARGS(minor, seq, offset, bytes, ret),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, seq)
+		__field(size_t, offset)
+		__field(size_t, bytes)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->seq = seq;
+		__entry->offset = offset;
+		__entry->bytes = bytes;
+		__entry->ret = ret;
+	),
+
+	TP_printk("fpreader%d seq=%u offset=%zu bytes=%zu ret=%d",
+		__entry->minor, __entry->seq, __entry->offset,
+		__entry->bytes, __entry->ret)
+);
+
+#endif /* _FT9201_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ft9201_trace
+#include <trace/define_trace.h>
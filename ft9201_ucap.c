@@ -0,0 +1,236 @@
+/*
+ * Capture from an FT9201 in userspace, without the kernel module: through
+ * libusb, or with -m from the in-process mock sensor, which needs no
+ * hardware or privileges at all. Takes the given number of captures back
+ * to back and reports the rate, the capture latency percentiles and the
+ * pipeline's counters; -o writes the frames out raw, one after the other.
+ * With -m -d 0 the whole pipeline runs at CPU speed.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ft9201_user.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank, in microseconds */
+static double percentile(const uint64_t *sorted, size_t n, double pct)
+{
+	size_t i;
+
+	if (n == 0) {
+		return 0.0;
+	}
+	i = (size_t)(pct / 100.0 * n);
+	return sorted[i < n ? i : n - 1] / 1000.0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m          capture from the mock sensor instead of libusb\n"
+		"  -n count    captures to take (default 100)\n"
+		"  -t ms       give up on a finger after ms (default: wait for ever)\n"
+		"  -o file     write the frames to file, raw\n"
+		"mock sensor:\n"
+		"  -d ms       finger detect delay after arming (default 20)\n"
+		"  -j ms       random extra detect delay, up to ms\n"
+		"  -l us       latency of every transfer (default 0)\n"
+		"  -p pattern  frame content: ridges (default), blank, noise or file:PATH\n",
+		prog);
+}
+
+static int load_file(const char *path, unsigned char *frame)
+{
+	FILE *f = fopen(path, "rb");
+	size_t len;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	len = fread(frame, 1, FT9201U_IMG_SIZE, f);
+	fclose(f);
+
+	if (len != FT9201U_IMG_SIZE) {
+		fprintf(stderr, "%s: expected %d bytes\n", path, FT9201U_IMG_SIZE);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char file_frame[FT9201U_IMG_SIZE];
+	struct ft9201u_mock_config mock = { .detect_ms = 20, .pattern = FT9201U_PATTERN_RIDGES };
+	struct ft9201u_config cfg = { 0 };
+	unsigned char frame[FT9201U_IMG_SIZE];
+	struct ft9201u_capture_info info;
+	struct ft9201u_transport *t;
+	struct ft9201u_stats stats;
+	struct ft9201u_dev *dev;
+	const char *out_path = NULL;
+	FILE *out = NULL;
+	uint64_t *lat;
+	uint64_t polls = 0;
+	size_t nr_lat = 0;
+	double start, elapsed;
+	int use_mock = 0;
+	int count = 100;
+	int opt;
+	int i, ret;
+
+	while ((opt = getopt(argc, argv, "mn:t:o:d:j:l:p:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			use_mock = 1;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 't':
+			cfg.detect_timeout_ms = atoi(optarg);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'd':
+			mock.detect_ms = atoi(optarg);
+			break;
+		case 'j':
+			mock.jitter_ms = atoi(optarg);
+			break;
+		case 'l':
+			mock.latency_us = atoi(optarg);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "ridges")) {
+				mock.pattern = FT9201U_PATTERN_RIDGES;
+			} else if (!strcmp(optarg, "blank")) {
+				mock.pattern = FT9201U_PATTERN_BLANK;
+			} else if (!strcmp(optarg, "noise")) {
+				mock.pattern = FT9201U_PATTERN_NOISE;
+			} else if (!strncmp(optarg, "file:", 5)) {
+				mock.pattern = FT9201U_PATTERN_FRAME;
+				mock.frame = file_frame;
+				if (load_file(optarg + 5, file_frame)) {
+					return 1;
+				}
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc || count < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (use_mock) {
+		mock.seed = getpid();
+		t = ft9201u_mock_create(&mock);
+	} else {
+#ifdef FT9201_LIBUSB
+		t = ft9201u_libusb_open();
+#else
+		/* built without libusb-1.0, see the Makefile */
+		t = NULL;
+		errno = EOPNOTSUPP;
+#endif
+	}
+	if (t == NULL) {
+		fprintf(stderr, "%s: %s\n", use_mock ? "mock" : "libusb", strerror(errno));
+		return 1;
+	}
+
+	dev = ft9201u_open(t, &cfg);
+	if (dev == NULL) {
+		fprintf(stderr, "open: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (out_path != NULL) {
+		out = fopen(out_path, "wb");
+		if (out == NULL) {
+			perror(out_path);
+			ft9201u_close(dev);
+			return 1;
+		}
+	}
+
+	lat = malloc(count * sizeof(*lat));
+	if (lat == NULL) {
+		fprintf(stderr, "out of memory\n");
+		ft9201u_close(dev);
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		ret = ft9201u_capture(dev, frame, &info);
+		if (ret < 0) {
+			fprintf(stderr, "capture %d: %s\n", i, strerror(-ret));
+			if (ret == -ENODEV) {
+				break;
+			}
+			continue;
+		}
+		lat[nr_lat++] = info.capture_ns;
+		polls += info.polls;
+		if (out != NULL && fwrite(frame, 1, ret, out) != (size_t)ret) {
+			perror(out_path);
+			break;
+		}
+	}
+	elapsed = now() - start;
+
+	qsort(lat, nr_lat, sizeof(*lat), cmp_u64);
+	printf("%zu frames in %.3f s, %.1f frames/s, %.2f polls per frame\n", nr_lat, elapsed,
+			elapsed > 0 ? nr_lat / elapsed : 0.0, nr_lat ? (double)polls / nr_lat : 0.0);
+	printf("capture us: p50 %.0f p90 %.0f p99 %.0f max %.0f\n",
+			percentile(lat, nr_lat, 50), percentile(lat, nr_lat, 90),
+			percentile(lat, nr_lat, 99), nr_lat ? lat[nr_lat - 1] / 1000.0 : 0.0);
+
+	ft9201u_get_stats(dev, &stats);
+	printf("captures %llu errors %llu timeouts %llu arms %llu detect_polls %llu "
+			"bulk_transfers %llu bulk_errors %llu stray_frames %llu\n",
+			(unsigned long long)stats.captures, (unsigned long long)stats.errors,
+			(unsigned long long)stats.timeouts, (unsigned long long)stats.arms,
+			(unsigned long long)stats.detect_polls, (unsigned long long)stats.bulk_transfers,
+			(unsigned long long)stats.bulk_errors, (unsigned long long)stats.stray_frames);
+
+	free(lat);
+	if (out != NULL) {
+		fclose(out);
+	}
+	ft9201u_close(dev);
+
+	return nr_lat == (size_t)count ? 0 : 1;
+}
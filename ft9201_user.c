@@ -0,0 +1,444 @@
+/*
+ * Capture pipeline of the userspace backend, see ft9201_user.h. It follows
+ * the capture state machine of ft9201.c: the arm sequence is sent as a
+ * chain of control transfers, then the finger-detect register is polled,
+ * starting at poll_min_us and backing off to poll_max_us, until a finger is
+ * seen or the frame turns up on one of the bulk-in transfers, which stay
+ * queued the whole time. Everything runs on the caller's thread, from the
+ * transport's completions and the poll and timeout deadlines in between.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ft9201_user.h"
+
+/* bulk-in transfers kept queued, as FT9201_IN_URBS in the driver */
+#define FT9201U_IN_XFERS	4
+
+#define FT9201U_ARM_STEPS	3
+#define FT9201U_CTRL_TIMEOUT_MS	1000
+
+/* longest wait for the transfers of a closing device */
+#define FT9201U_DRAIN_MS	2000
+
+static const struct {
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+} arm_seq[FT9201U_ARM_STEPS] = {
+	{ FT9201U_REQ_START_CAPTURE, 0x0003, 0 },
+	{ FT9201U_REQ_ARM, 0x0020, 37248 },
+	{ FT9201U_REQ_ARM, 0x1400, 36992 },
+};
+
+enum capture_state {
+	CAPTURE_IDLE,
+	CAPTURE_ARM,		/* sending the arm sequence */
+	CAPTURE_DETECT,		/* polling the sensor for a finger */
+	CAPTURE_FRAME,		/* finger seen, waiting on the bulk-in transfers */
+};
+
+struct ft9201u_dev {
+	struct ft9201u_transport *t;
+	struct ft9201u_config cfg;
+
+	struct ft9201u_xfer arm[FT9201U_ARM_STEPS];
+	struct ft9201u_xfer detect;
+	unsigned char detect_buf[4];
+	struct ft9201u_xfer in[FT9201U_IN_XFERS];
+	unsigned char in_buf[FT9201U_IN_XFERS][FT9201U_IMG_SIZE];
+	unsigned int in_flight;		/* submitted transfers, all kinds */
+	bool arm_pending;		/* a step of the arm sequence in flight */
+	bool detect_pending;
+	bool closing;
+
+	enum capture_state state;
+	bool done;
+	int err;
+	unsigned char *frame;		/* the caller's, while a capture runs */
+	int frame_len;
+	uint64_t next_poll_ns;		/* 0 when no poll is due */
+	uint64_t deadline_ns;		/* detect or frame timeout, 0 for none */
+	unsigned int poll_interval_us;
+	uint64_t start_ns;
+	uint64_t detect_ns;
+	struct ft9201u_capture_info info;
+	struct ft9201u_stats stats;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int submit(struct ft9201u_dev *dev, struct ft9201u_xfer *xfer)
+{
+	int ret;
+
+	ret = dev->t->ops->submit(dev->t, xfer);
+	if (ret == 0) {
+		dev->in_flight++;
+	}
+
+	return ret;
+}
+
+static void capture_finish(struct ft9201u_dev *dev, int err)
+{
+	if (dev->state == CAPTURE_IDLE) {
+		return;
+	}
+
+	dev->state = CAPTURE_IDLE;
+	dev->next_poll_ns = 0;
+	dev->deadline_ns = 0;
+	dev->err = err;
+	dev->done = true;
+	dev->info.capture_ns = now_ns() - dev->start_ns;
+	if (err) {
+		dev->stats.errors++;
+		if (err == -ETIMEDOUT) {
+			dev->stats.timeouts++;
+		}
+	} else {
+		dev->stats.captures++;
+	}
+}
+
+static void arm_complete(struct ft9201u_xfer *xfer)
+{
+	struct ft9201u_dev *dev = xfer->user;
+	unsigned int step = xfer - dev->arm;
+	uint64_t now;
+	int ret;
+
+	dev->in_flight--;
+	dev->arm_pending = false;
+	if (dev->state != CAPTURE_ARM) {
+		return;
+	}
+	if (xfer->status) {
+		capture_finish(dev, xfer->status);
+		return;
+	}
+
+	if (step + 1 < FT9201U_ARM_STEPS) {
+		ret = submit(dev, &dev->arm[step + 1]);
+		if (ret) {
+			capture_finish(dev, ret);
+		} else {
+			dev->arm_pending = true;
+		}
+		return;
+	}
+
+	/* armed, the first poll waits poll_min_us like the driver's */
+	now = now_ns();
+	dev->stats.arms++;
+	dev->state = CAPTURE_DETECT;
+	dev->poll_interval_us = dev->cfg.poll_min_us;
+	dev->next_poll_ns = now + dev->cfg.poll_min_us * 1000ULL;
+	dev->deadline_ns = dev->cfg.detect_timeout_ms ? now + dev->cfg.detect_timeout_ms * 1000000ULL : 0;
+}
+
+static void detect_complete(struct ft9201u_xfer *xfer)
+{
+	struct ft9201u_dev *dev = xfer->user;
+	uint64_t now = now_ns();
+	unsigned int max_us;
+
+	dev->in_flight--;
+	dev->detect_pending = false;
+	if (dev->state != CAPTURE_DETECT) {
+		/* the frame beat it, or the capture timed out */
+		return;
+	}
+	if (xfer->status == 0 && xfer->actual_length < 1) {
+		xfer->status = -EREMOTEIO;
+	}
+	if (xfer->status) {
+		capture_finish(dev, xfer->status);
+		return;
+	}
+
+	dev->stats.detect_polls++;
+	dev->info.polls++;
+	if (dev->detect_buf[0] != 0) {
+		dev->state = CAPTURE_FRAME;
+		dev->detect_ns = now;
+		dev->info.arm_to_detect_ns = now - dev->start_ns;
+		dev->next_poll_ns = 0;
+		dev->deadline_ns = now + dev->cfg.frame_timeout_ms * 1000000ULL;
+		return;
+	}
+
+	max_us = dev->cfg.poll_max_us > dev->cfg.poll_min_us ? dev->cfg.poll_max_us : dev->cfg.poll_min_us;
+	dev->next_poll_ns = now + dev->poll_interval_us * 1000ULL;
+	dev->poll_interval_us = dev->poll_interval_us * 2 < max_us ? dev->poll_interval_us * 2 : max_us;
+}
+
+static void bulk_complete(struct ft9201u_xfer *xfer)
+{
+	struct ft9201u_dev *dev = xfer->user;
+	bool capturing = dev->state == CAPTURE_DETECT || dev->state == CAPTURE_FRAME;
+	int ret;
+
+	dev->in_flight--;
+	if (xfer->status == -ECANCELED || dev->closing) {
+		return;
+	}
+
+	if (xfer->status) {
+		dev->stats.bulk_errors++;
+		if (capturing) {
+			capture_finish(dev, xfer->status);
+		}
+		/* a device that is gone takes no more transfers */
+		if (xfer->status == -ENODEV) {
+			return;
+		}
+	} else {
+		dev->stats.bulk_transfers++;
+		if (capturing) {
+			/* the sensor may push the frame before a poll saw the finger */
+			if (dev->state == CAPTURE_FRAME) {
+				dev->info.detect_to_frame_ns = now_ns() - dev->detect_ns;
+			}
+			dev->frame_len = xfer->actual_length;
+			memcpy(dev->frame, xfer->data, xfer->actual_length);
+			capture_finish(dev, 0);
+		} else {
+			dev->stats.stray_frames++;
+		}
+	}
+
+	/* straight back on the endpoint */
+	ret = submit(dev, xfer);
+	if (ret) {
+		capture_finish(dev, ret);
+	}
+}
+
+static void fill_ctrl(struct ft9201u_dev *dev, struct ft9201u_xfer *xfer, uint8_t request_type,
+		uint8_t request, uint16_t value, uint16_t index, unsigned char *data, unsigned int length,
+		void (*complete)(struct ft9201u_xfer *xfer))
+{
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->type = FT9201U_XFER_CONTROL;
+	xfer->request_type = request_type;
+	xfer->request = request;
+	xfer->value = value;
+	xfer->index = index;
+	xfer->data = data;
+	xfer->length = length;
+	xfer->timeout_ms = FT9201U_CTRL_TIMEOUT_MS;
+	xfer->complete = complete;
+	xfer->user = dev;
+}
+
+/* Run completions until the capture is done, polling and timing out on the way */
+static void capture_run(struct ft9201u_dev *dev)
+{
+	uint64_t now, next;
+	unsigned int timeout_us;
+	int ret;
+
+	while (!dev->done) {
+		now = now_ns();
+
+		if (dev->deadline_ns && now >= dev->deadline_ns) {
+			/* a detect read still in flight is ignored when it completes */
+			capture_finish(dev, -ETIMEDOUT);
+			break;
+		}
+		if (dev->state == CAPTURE_DETECT && dev->next_poll_ns && now >= dev->next_poll_ns &&
+		    !dev->detect_pending) {
+			dev->next_poll_ns = 0;
+			ret = submit(dev, &dev->detect);
+			if (ret) {
+				capture_finish(dev, ret);
+				break;
+			}
+			dev->detect_pending = true;
+		}
+
+		next = dev->next_poll_ns;
+		if (dev->deadline_ns && (!next || dev->deadline_ns < next)) {
+			next = dev->deadline_ns;
+		}
+		/* the transfers themselves time out, so this only bounds a single wait */
+		timeout_us = 1000000;
+		if (next) {
+			timeout_us = next > now ? (next - now) / 1000 : 0;
+			if (timeout_us > 1000000) {
+				timeout_us = 1000000;
+			}
+		}
+
+		ret = dev->t->ops->handle_events(dev->t, timeout_us);
+		if (ret < 0 && ret != -EINTR) {
+			capture_finish(dev, ret);
+		}
+	}
+}
+
+/*
+ * A capture that ended on an event handling error may have left a step of
+ * its arm sequence in flight; it has to complete before arm[0] is reused.
+ * The transfer has a timeout of its own, so this does not wait for ever.
+ */
+static int arm_drain(struct ft9201u_dev *dev)
+{
+	int ret;
+
+	while (dev->arm_pending) {
+		ret = dev->t->ops->handle_events(dev->t, 100000);
+		if (ret < 0 && ret != -EINTR) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int ft9201u_capture(struct ft9201u_dev *dev, unsigned char *frame, struct ft9201u_capture_info *info)
+{
+	int ret;
+
+	if (dev->state != CAPTURE_IDLE) {
+		return -EBUSY;
+	}
+	ret = arm_drain(dev);
+	if (ret) {
+		return ret;
+	}
+
+	memset(&dev->info, 0, sizeof(dev->info));
+	dev->frame = frame;
+	dev->frame_len = 0;
+	dev->done = false;
+	dev->err = 0;
+	dev->start_ns = now_ns();
+	dev->state = CAPTURE_ARM;
+
+	ret = submit(dev, &dev->arm[0]);
+	if (ret) {
+		capture_finish(dev, ret);
+	} else {
+		dev->arm_pending = true;
+		capture_run(dev);
+	}
+
+	dev->frame = NULL;
+	if (info != NULL) {
+		*info = dev->info;
+	}
+
+	return dev->err ? dev->err : dev->frame_len;
+}
+
+void ft9201u_get_stats(struct ft9201u_dev *dev, struct ft9201u_stats *stats)
+{
+	*stats = dev->stats;
+}
+
+struct ft9201u_dev *ft9201u_open(struct ft9201u_transport *t, const struct ft9201u_config *cfg)
+{
+	struct ft9201u_dev *dev;
+	struct ft9201u_xfer *xfer;
+	unsigned int i;
+	int ret;
+
+	dev = calloc(1, sizeof(*dev));
+	if (dev == NULL) {
+		t->ops->destroy(t);
+		return NULL;
+	}
+	dev->t = t;
+
+	if (cfg != NULL) {
+		dev->cfg = *cfg;
+	}
+	if (dev->cfg.poll_min_us == 0) {
+		dev->cfg.poll_min_us = 2000;
+	}
+	if (dev->cfg.poll_max_us == 0) {
+		dev->cfg.poll_max_us = 50000;
+	}
+	if (dev->cfg.frame_timeout_ms == 0) {
+		dev->cfg.frame_timeout_ms = 1000;
+	}
+
+	for (i = 0; i < FT9201U_ARM_STEPS; i++) {
+		fill_ctrl(dev, &dev->arm[i], FT9201U_VENDOR_DEVICE, arm_seq[i].request,
+				arm_seq[i].value, arm_seq[i].index, NULL, 0, arm_complete);
+	}
+	fill_ctrl(dev, &dev->detect, FT9201U_DIR_IN | FT9201U_VENDOR_DEVICE, FT9201U_REQ_READ_REGISTERS,
+			0, 0, dev->detect_buf, sizeof(dev->detect_buf), detect_complete);
+
+	for (i = 0; i < FT9201U_IN_XFERS; i++) {
+		xfer = &dev->in[i];
+		xfer->type = FT9201U_XFER_BULK_IN;
+		xfer->data = dev->in_buf[i];
+		xfer->length = FT9201U_IMG_SIZE;
+		xfer->complete = bulk_complete;
+		xfer->user = dev;
+
+		ret = submit(dev, xfer);
+		if (ret) {
+			ft9201u_close(dev);
+			errno = -ret;
+			return NULL;
+		}
+	}
+
+	return dev;
+}
+
+void ft9201u_close(struct ft9201u_dev *dev)
+{
+	uint64_t end = now_ns() + FT9201U_DRAIN_MS * 1000000ULL;
+	unsigned int i;
+
+	dev->closing = true;
+	dev->state = CAPTURE_IDLE;
+
+	for (i = 0; i < FT9201U_IN_XFERS; i++) {
+		dev->t->ops->cancel(dev->t, &dev->in[i]);
+	}
+	if (dev->detect_pending) {
+		dev->t->ops->cancel(dev->t, &dev->detect);
+	}
+	for (i = 0; i < FT9201U_ARM_STEPS; i++) {
+		dev->t->ops->cancel(dev->t, &dev->arm[i]);
+	}
+
+	/* the transport must not call back into freed transfers */
+	while (dev->in_flight && now_ns() < end) {
+		if (dev->t->ops->handle_events(dev->t, 100000) < 0) {
+			break;
+		}
+	}
+	if (dev->in_flight) {
+		/* leaked rather than freed under the transport's feet */
+		return;
+	}
+
+	for (i = 0; i < FT9201U_IN_XFERS; i++) {
+		dev->t->ops->release(dev->t, &dev->in[i]);
+	}
+	dev->t->ops->release(dev->t, &dev->detect);
+	for (i = 0; i < FT9201U_ARM_STEPS; i++) {
+		dev->t->ops->release(dev->t, &dev->arm[i]);
+	}
+
+	dev->t->ops->destroy(dev->t);
+	free(dev);
+}
@@ -0,0 +1,138 @@
+/*
+ * Userspace FT9201 capture, without the kernel module. The same protocol
+ * as ft9201.c (the arm sequence, finger-detect polls of register 0x43 with
+ * exponential backoff, 5120 byte frames on bulk-in transfers that are
+ * always queued) driven from an event loop over a pluggable transport.
+ *
+ * Transports are asynchronous, after libusb's model: transfers are
+ * submitted, and their completion callbacks run from handle_events(). Two
+ * come with it: libusb (ft9201_libusb.c), and an in-process mock sensor
+ * (ft9201_mock.c) with configurable detect delay, transfer latency and
+ * frame content, for running the pipeline with no hardware at all.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define FT9201U_IMG_WIDTH	0x50
+#define FT9201U_IMG_HEIGHT	0x40
+#define FT9201U_IMG_SIZE	(FT9201U_IMG_WIDTH * FT9201U_IMG_HEIGHT)
+
+#define FT9201U_VENDOR_ID	0x2808
+#define FT9201U_PRODUCT_ID	0x9338
+
+/* vendor requests, as in ft9201.c */
+#define FT9201U_REQ_READ_REGISTERS	0x43
+#define FT9201U_REQ_START_CAPTURE	0x34
+#define FT9201U_REQ_ARM			0x6f
+
+/* bRequestType */
+#define FT9201U_DIR_IN			0x80
+#define FT9201U_VENDOR_DEVICE		0x40
+
+enum ft9201u_xfer_type {
+	FT9201U_XFER_CONTROL,
+	FT9201U_XFER_BULK_IN,
+};
+
+/* One transfer. The pipeline owns it, the transport fills in the result. */
+struct ft9201u_xfer {
+	enum ft9201u_xfer_type type;
+	uint8_t request_type;		/* control only */
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	unsigned char *data;		/* IN data or the bulk-in buffer */
+	unsigned int length;
+	unsigned int timeout_ms;	/* 0 waits for ever */
+
+	int status;			/* 0, or a negative errno */
+	unsigned int actual_length;
+	void (*complete)(struct ft9201u_xfer *xfer);
+	void *user;			/* the pipeline's */
+	void *priv;			/* the transport's, NULL until first submitted */
+};
+
+struct ft9201u_transport;
+
+struct ft9201u_transport_ops {
+	/* 0 or a negative errno; complete() runs later, from handle_events() */
+	int (*submit)(struct ft9201u_transport *t, struct ft9201u_xfer *xfer);
+	/* completes the transfer with -ECANCELED, unless it already finished */
+	void (*cancel)(struct ft9201u_transport *t, struct ft9201u_xfer *xfer);
+	/* run due completions, waiting for them for up to timeout_us */
+	int (*handle_events)(struct ft9201u_transport *t, unsigned int timeout_us);
+	/* drop the transport's state of a transfer that is not in flight */
+	void (*release)(struct ft9201u_transport *t, struct ft9201u_xfer *xfer);
+	void (*destroy)(struct ft9201u_transport *t);
+};
+
+struct ft9201u_transport {
+	const struct ft9201u_transport_ops *ops;
+};
+
+/* capture tunables, the module parameters of the same names */
+struct ft9201u_config {
+	unsigned int poll_min_us;	/* default 2000 */
+	unsigned int poll_max_us;	/* default 50000 */
+	unsigned int detect_timeout_ms;	/* 0 waits for a finger for ever */
+	unsigned int frame_timeout_ms;	/* finger seen -> frame, default 1000 */
+};
+
+struct ft9201u_capture_info {
+	uint64_t capture_ns;		/* arm -> frame */
+	uint64_t arm_to_detect_ns;	/* 0 if the frame came before a poll saw the finger */
+	uint64_t detect_to_frame_ns;
+	unsigned int polls;
+};
+
+struct ft9201u_stats {
+	uint64_t captures;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t arms;
+	uint64_t detect_polls;
+	uint64_t bulk_transfers;
+	uint64_t bulk_errors;
+	uint64_t stray_frames;		/* frames that came with no capture running */
+};
+
+struct ft9201u_dev;
+
+/*
+ * Take over @t, queue the bulk-in transfers and return the device, or NULL
+ * with errno set. @cfg may be NULL for the defaults. The transport is
+ * destroyed with the device.
+ */
+struct ft9201u_dev *ft9201u_open(struct ft9201u_transport *t, const struct ft9201u_config *cfg);
+void ft9201u_close(struct ft9201u_dev *dev);
+
+/*
+ * Arm the sensor, wait for a finger and copy its frame into @frame, which
+ * holds FT9201U_IMG_SIZE bytes. Returns the frame length or a negative
+ * errno; @info may be NULL.
+ */
+int ft9201u_capture(struct ft9201u_dev *dev, unsigned char *frame, struct ft9201u_capture_info *info);
+void ft9201u_get_stats(struct ft9201u_dev *dev, struct ft9201u_stats *stats);
+
+/* in-process mock sensor */
+enum ft9201u_mock_pattern {
+	FT9201U_PATTERN_RIDGES,
+	FT9201U_PATTERN_BLANK,
+	FT9201U_PATTERN_NOISE,
+	FT9201U_PATTERN_FRAME,		/* the caller's frame every time */
+};
+
+struct ft9201u_mock_config {
+	unsigned int detect_ms;		/* arm -> finger present, 0 at once */
+	unsigned int jitter_ms;		/* uniform extra detect delay */
+	unsigned int latency_us;	/* every transfer takes this long */
+	enum ft9201u_mock_pattern pattern;
+	const unsigned char *frame;	/* FT9201U_IMG_SIZE bytes, FT9201U_PATTERN_FRAME */
+	unsigned int seed;
+};
+
+struct ft9201u_transport *ft9201u_mock_create(const struct ft9201u_mock_config *cfg);
+
+/* the first FT9201 on the bus, through libusb; NULL with errno set */
+struct ft9201u_transport *ft9201u_libusb_open(void);
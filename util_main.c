@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
@@ -33,6 +34,38 @@ MagickWriteImage(mw,"finger.png");
 
 
 
+/* device -> pipe -> file, the frame never passes through our memory */
+ssize_t splice_frame(int in, int out, size_t len)
+{
+	int p[2];
+	ssize_t n, done = 0;
+
+	if (pipe(p) == -1) {
+		return -1;
+	}
+
+	while ((size_t)done < len) {
+		n = splice(in, NULL, p[1], NULL, len - done, SPLICE_F_MOVE);
+		if (n <= 0) {
+			break;
+		}
+		while (n > 0) {
+			ssize_t m = splice(p[0], NULL, out, NULL, n, SPLICE_F_MOVE);
+			if (m <= 0) {
+				close(p[0]);
+				close(p[1]);
+				return -1;
+			}
+			n -= m;
+			done += m;
+		}
+	}
+
+	close(p[0]);
+	close(p[1]);
+	return done;
+}
+
 int main(int argc, char *argv[]) {
 	unsigned int action = 0;
 	printf("FT9201 utility program\n");
@@ -64,19 +97,19 @@ int main(int argc, char *argv[]) {
 	} else if (action == 1) {
 		printf("Reading\n");
 int fd;
-char buff[5120];
     fd = open(device_file_name,O_RDONLY);
-    if (fd != -1) {
-      read(fd,buff,5120);
-      close(fd);
-	}
   int sdfd;
-  sdfd = open("img.raw",O_WRONLY | O_CREAT);
+  sdfd = open("img.raw",O_WRONLY | O_CREAT | O_TRUNC, 0644);
   if (sdfd == -1) {
     printf("bad open\n");
     exit(-1);
   }
-  write(sdfd,buff,(5120));
+    if (fd != -1) {
+      if (splice_frame(fd, sdfd, 5120) != 5120) {
+        printf("short frame\n");
+      }
+      close(fd);
+	}
   close(sdfd);
     }
 	raw_wand();